@@ -0,0 +1,25 @@
+#ifndef BENCH_HPP_INCLUDED
+#define BENCH_HPP_INCLUDED
+
+#include <chrono>
+#include <cstddef>
+
+// wall clock time since construction or the last reset
+class stopwatch
+{
+    std::chrono::steady_clock::time_point m_start;
+
+public:
+    stopwatch() : m_start(std::chrono::steady_clock::now()) {}
+    void reset() { m_start = std::chrono::steady_clock::now(); }
+    double seconds() const { return std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count(); }
+    double ns_per_op(size_t ops) const { return seconds() * 1e9 / ops; }
+};
+
+void buffer_bench();
+void struct_bench();
+void serializer_mt_bench();
+void var_bench();
+void cast_bench();
+
+#endif // BENCH_HPP_INCLUDED
@@ -0,0 +1,98 @@
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <vector>
+#include "tinythread.h"
+#include "gg/buffer.hpp"
+#include "bench.hpp"
+
+namespace
+{
+    // the operations of the buffer before it was stored in chunks: one byte per deque element
+    class deque_buffer
+    {
+        tthread::mutex m_mutex;
+        std::deque<uint8_t> m_data;
+
+    public:
+        void push(const uint8_t* buf, size_t len)
+        {
+            tthread::lock_guard<tthread::mutex> guard(m_mutex);
+            for (size_t i = 0; i < len; ++i)
+                m_data.push_back(buf[i]);
+        }
+
+        size_t peek(uint8_t* buf, size_t len)
+        {
+            tthread::lock_guard<tthread::mutex> guard(m_mutex);
+            auto it = m_data.begin(), end = m_data.end();
+            size_t i = 0;
+
+            for (; it != end && i < len; ++it, ++i)
+                buf[i] = *it;
+
+            return i;
+        }
+
+        size_t pop(uint8_t* buf, size_t len)
+        {
+            tthread::lock_guard<tthread::mutex> guard(m_mutex);
+            auto it = m_data.begin(), end = m_data.end();
+            size_t i = 0;
+
+            for (; it != end && i < len; ++it, ++i)
+                buf[i] = *it;
+
+            m_data.erase(m_data.begin(), it);
+            return i;
+        }
+
+        void advance(size_t len)
+        {
+            tthread::lock_guard<tthread::mutex> guard(m_mutex);
+            m_data.erase(m_data.begin(), std::next(m_data.begin(), len));
+        }
+    };
+
+    // GB/s of 'total' bytes going through push/peek/pop/advance in blocks
+    template<class Buffer>
+    double measure(Buffer* buf, size_t block, size_t total)
+    {
+        std::vector<uint8_t> in(block, 0x5a), out(block);
+        stopwatch sw;
+
+        for (size_t done = 0; done < total; done += block)
+        {
+            buf->push(in.data(), block);
+            buf->push(in.data(), block);
+            buf->peek(out.data(), block);
+            buf->pop(out.data(), block);
+            buf->advance(block);
+        }
+
+        return 2.0 * total / sw.seconds() / 1e9;
+    }
+}
+
+// push, peek and pop throughput of the default buffer for different block sizes,
+// compared with the deque based implementation it replaced
+void buffer_bench()
+{
+    const size_t total = 256u << 20;
+    const size_t deque_total = 32u << 20; // it's slow enough to measure with less data
+
+    for (size_t block : { 64u, 1024u, 16384u })
+    {
+        deque_buffer deque_buf;
+        double deque_rate = measure(&deque_buf, block, deque_total);
+
+        gg::buffer* buf = gg::buffer::create();
+        double rate = measure(buf, block, total);
+        buf->drop();
+
+        std::cout << "block " << std::setw(5) << block << " B: " << std::fixed << std::setprecision(2)
+                  << "deque " << std::setw(5) << deque_rate << " GB/s, chunked " << std::setw(5) << rate
+                  << " GB/s (push + pop)" << std::endl;
+    }
+}
@@ -0,0 +1,37 @@
+#include <cstring>
+#include <iostream>
+#include "bench.hpp"
+
+struct benchmark
+{
+    const char* name;
+    void (*func)();
+};
+
+static const benchmark benchmarks[] =
+{
+    { "buffer", buffer_bench },
+    { "struct", struct_bench },
+    { "serializer_mt", serializer_mt_bench },
+    { "var", var_bench },
+    { "cast", cast_bench },
+};
+
+// runs every benchmark, or only the ones named on the command line
+int main(int argc, char** argv)
+{
+    for (const benchmark& b : benchmarks)
+    {
+        bool selected = (argc < 2);
+
+        for (int i = 1; i < argc; ++i)
+            if (std::strcmp(argv[i], b.name) == 0) selected = true;
+
+        if (!selected) continue;
+
+        std::cout << "== " << b.name << std::endl;
+        b.func();
+    }
+
+    return 0;
+}
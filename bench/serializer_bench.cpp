@@ -0,0 +1,164 @@
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "tinythread.h"
+#include "c_serializer.hpp"
+#include "gg/buffer.hpp"
+#include "bench.hpp"
+
+using namespace gg;
+
+namespace
+{
+    enum class color : uint8_t { red, green };
+
+    // the same record twice: once for add_struct_rule, once for rules written per field
+    struct position { int32_t x, y; float z; double w; color c; };
+    struct record { int32_t id; std::string name; double value; position pos; };
+    struct field_position { int32_t x, y; float z; double w; color c; };
+    struct field_record { int32_t id; std::string name; double value; field_position pos; };
+
+    void add_field_rules(serializer& srl)
+    {
+        srl.add_rule_ex<field_position>(
+            [](const var& v, buffer* buf, const serializer* s)
+            {
+                const field_position& p = v.get<field_position>();
+                return s->serialize(p.x, buf) && s->serialize(p.y, buf) && s->serialize(p.z, buf)
+                    && s->serialize(p.w, buf) && s->serialize(p.c, buf);
+            },
+            [](buffer* buf, const serializer* s)->optional<var>
+            {
+                auto x = s->deserialize<int32_t>(buf);
+                auto y = s->deserialize<int32_t>(buf);
+                auto z = s->deserialize<float>(buf);
+                auto w = s->deserialize<double>(buf);
+                auto c = s->deserialize<color>(buf);
+                if (!x || !y || !z || !w || !c) return {};
+
+                return field_position { *x, *y, *z, *w, *c };
+            });
+
+        srl.add_rule_ex<field_record>(
+            [](const var& v, buffer* buf, const serializer* s)
+            {
+                const field_record& r = v.get<field_record>();
+                return s->serialize(r.id, buf) && s->serialize(r.name, buf)
+                    && s->serialize(r.value, buf) && s->serialize(r.pos, buf);
+            },
+            [](buffer* buf, const serializer* s)->optional<var>
+            {
+                auto id = s->deserialize<int32_t>(buf);
+                auto name = s->deserialize(buf);
+                auto value = s->deserialize<double>(buf);
+                auto pos = s->deserialize<field_position>(buf);
+                if (!id || !name || !value || !pos) return {};
+
+                return field_record { *id, name->get<std::string>(), *value, *pos };
+            });
+    }
+
+    struct worker_data
+    {
+        const serializer* srl;
+        int count;
+        bool failed;
+    };
+
+    void serialize_ints(void* arg)
+    {
+        worker_data* data = static_cast<worker_data*>(arg);
+        buffer* buf = buffer::create();
+
+        for (int i = 0; i < data->count; ++i)
+        {
+            data->srl->serialize(var(int32_t(i)), buf);
+            optional<var> v = data->srl->deserialize(buf);
+            if (!v || v->get<int32_t>() != i) data->failed = true;
+        }
+
+        buf->drop();
+    }
+
+    void run(const char* name, int count,
+             const std::function<bool(buffer*)>& ser, const std::function<bool(buffer*)>& deser)
+    {
+        buffer* buf = buffer::create();
+        stopwatch sw;
+
+        for (int i = 0; i < count; ++i) ser(buf);
+        double ser_ns = sw.ns_per_op(count);
+        size_t bytes = buf->available() / count;
+
+        sw.reset();
+        for (int i = 0; i < count; ++i)
+        {
+            if (!deser(buf))
+            {
+                std::cout << name << ": deserialization failed" << std::endl;
+                break;
+            }
+        }
+        double deser_ns = sw.ns_per_op(count);
+        buf->drop();
+
+        std::cout << std::left << std::setw(16) << name << std::right << std::fixed << std::setprecision(0)
+                  << "serialize " << std::setw(6) << ser_ns << " ns, deserialize " << std::setw(6) << deser_ns
+                  << " ns, " << bytes << " bytes" << std::endl;
+    }
+}
+
+// a record with a nested struct, registered with add_struct_rule or with a rule per field
+void struct_bench()
+{
+    const int count = 200000;
+    c_serializer cs(nullptr);
+    serializer& srl = cs;
+
+    srl.add_trivial_rule<color>();
+    srl.add_struct_rule<position, GG_FIELD(position, x), GG_FIELD(position, y), GG_FIELD(position, z),
+                        GG_FIELD(position, w), GG_FIELD(position, c)>();
+    srl.add_struct_rule<record, GG_FIELD(record, id), GG_FIELD(record, name), GG_FIELD(record, value),
+                        GG_FIELD(record, pos)>();
+    add_field_rules(srl);
+
+    record rec { 42, "some name", 3.5, { 1, -2, 0.25f, 1e100, color::green } };
+    field_record field_rec { 42, "some name", 3.5, { 1, -2, 0.25f, 1e100, color::green } };
+
+    run("add_rule_ex", count,
+        [&](buffer* buf) { return srl.serialize(field_rec, buf); },
+        [&](buffer* buf) { return (bool)srl.deserialize<field_record>(buf); });
+    run("add_struct_rule", count,
+        [&](buffer* buf) { return srl.serialize(rec, buf); },
+        [&](buffer* buf) { return (bool)srl.deserialize<record>(buf); });
+}
+
+// each thread serializes and deserializes int32 values on its own buffer with a shared serializer
+void serializer_mt_bench()
+{
+    const int count = 200000;
+    c_serializer srl(nullptr);
+
+    for (int threads = 1; threads <= 4; threads *= 2)
+    {
+        std::vector<worker_data> data(threads, worker_data { &srl, count, false });
+        std::vector<std::unique_ptr<tthread::thread>> workers;
+        stopwatch sw;
+
+        for (worker_data& d : data)
+            workers.emplace_back(new tthread::thread(serialize_ints, &d));
+
+        for (auto& t : workers)
+            t->join();
+
+        double rate = threads * count / sw.seconds() / 1e6;
+        bool failed = false;
+        for (const worker_data& d : data) failed |= d.failed;
+
+        std::cout << threads << " thread(s): " << std::fixed << std::setprecision(2) << rate
+                  << " Mops/s (serialize + deserialize)" << (failed ? ", FAILED" : "") << std::endl;
+    }
+}
@@ -0,0 +1,117 @@
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <new>
+#include <string>
+#include "gg/function.hpp"
+#include "gg/var.hpp"
+#include "bench.hpp"
+
+using namespace gg;
+
+// counts every allocation of the program, the benchmarks only look at differences
+static size_t allocations = 0;
+
+void* operator new(size_t size)
+{
+    ++allocations;
+    void* ptr = std::malloc(size ? size : 1);
+    if (ptr == nullptr) throw std::bad_alloc();
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+namespace
+{
+    void report(const char* name, size_t allocs, const stopwatch& sw)
+    {
+        std::cout << std::left << std::setw(32) << name << std::right << std::setw(8) << allocs
+                  << " allocations, " << std::fixed << std::setprecision(1) << sw.seconds() * 1e3 << " ms" << std::endl;
+    }
+
+    void report(const char* name, double ns)
+    {
+        std::cout << std::left << std::setw(32) << name << std::right << std::fixed << std::setprecision(0)
+                  << std::setw(8) << ns << " ns" << std::endl;
+    }
+}
+
+// small values are stored inline in var, so building and copying lists of them doesn't allocate per element
+void var_bench()
+{
+    const int count = 1000000;
+    std::cout << "sizeof(var) = " << sizeof(var) << std::endl;
+
+    size_t start = allocations;
+    stopwatch sw;
+    varlist vl;
+    vl.reserve(count);
+
+    for (int i = 0; i < count; ++i)
+    {
+        if (i % 3 == 0) vl.emplace_back(i);
+        else if (i % 3 == 1) vl.emplace_back(i * 0.5);
+        else vl.emplace_back(i % 2 == 0);
+    }
+    report("1M scalars into a varlist", allocations - start, sw);
+
+    start = allocations;
+    sw.reset();
+    varlist copy = vl;
+    report("copying that varlist", allocations - start, sw);
+
+    std::map<std::string, var> attrs;
+    for (int i = 0; i < 20; ++i)
+        attrs.emplace("attr" + std::to_string(i), (i % 2) ? var(i) : var(1.5 * i));
+
+    start = allocations;
+    sw.reset();
+    for (int i = 0; i < 50000; ++i)
+    {
+        std::map<std::string, var> attrs_copy = attrs;
+        (void)attrs_copy;
+    }
+    report("50k copies of a 20-entry map", allocations - start, sw);
+}
+
+// cast() between numbers and text, and invoke() that casts its arguments the same way
+void cast_bench()
+{
+    const int count = 1000000;
+    var int_val(12345), str_val(std::string("12345.5")), double_val(2.5);
+    double sum = 0;
+
+    stopwatch sw;
+    for (int i = 0; i < count; ++i) sum += int_val.cast<double>();
+    report("int -> double", sw.ns_per_op(count));
+
+    sw.reset();
+    for (int i = 0; i < count; ++i) sum += str_val.cast<double>();
+    report("string -> double", sw.ns_per_op(count));
+
+    sw.reset();
+    for (int i = 0; i < count; ++i) sum += double_val.cast<std::string>().size();
+    report("double -> string", sw.ns_per_op(count));
+
+    // a script-style call: arguments arrive as parsed tokens or as results of nested calls
+    gg::function<double(int, double, int64_t, float)> func =
+        [](int a, double b, int64_t c, float d) { return a + b + c + d; };
+    varlist str_args { var(std::string("12")), var(std::string("3.5")), var(std::string("-400")), var(std::string("0.25")) };
+    varlist num_args { var(12.0), var(3), var(-400), var(0.25) };
+    const int calls = 200000;
+
+    sw.reset();
+    for (int i = 0; i < calls; ++i) sum += func.invoke(str_args);
+    report("invoke with string arguments", sw.ns_per_op(calls));
+
+    sw.reset();
+    for (int i = 0; i < calls; ++i) sum += func.invoke(num_args);
+    report("invoke with numeric arguments", sw.ns_per_op(calls));
+
+    if (sum == 0) std::cout << "unexpected sum" << std::endl;
+}
@@ -38,6 +38,10 @@ namespace gg
         T operator-= (T val) { return __sync_sub_and_fetch(&m_val, val); }
 
         T exchange(T old_val, T new_val) { return __sync_val_compare_and_swap(&m_val, old_val, new_val); }
+
+        // acquire/release ordering only, cheaper than the full barriers above
+        T load() const { return __atomic_load_n(&m_val, __ATOMIC_ACQUIRE); }
+        void store(T val) { __atomic_store_n(&m_val, val, __ATOMIC_RELEASE); }
     };
 };
 
@@ -3,12 +3,92 @@
 
 #include <iosfwd>
 #include <cstdint>
+#include <string>
 #include <vector>
 #include "gg/refcounted.hpp"
 #include "gg/optional.hpp"
 
 namespace gg
 {
+    /*
+     * Read-only window to the bytes stored in a buffer. The view doesn't copy
+     * anything, so it's only valid until the next operation that consumes data
+     * from the buffer (advance, clear, pop or merging it into another buffer).
+     */
+    class buffer_view
+    {
+    public:
+        struct span
+        {
+            const uint8_t* data;
+            size_t size;
+        };
+
+        static const size_t npos = static_cast<size_t>(-1);
+
+        buffer_view();
+        buffer_view(const uint8_t* data, size_t size);
+        buffer_view(std::vector<span> spans);
+        buffer_view(const buffer_view&);
+        buffer_view(buffer_view&&);
+        ~buffer_view();
+        buffer_view& operator= (const buffer_view&);
+        buffer_view& operator= (buffer_view&&);
+
+        size_t size() const;
+        bool empty() const;
+        bool is_contiguous() const;
+        const uint8_t* data() const; // nullptr if the view is not contiguous
+        size_t span_count() const;
+        const span& get_span(size_t i) const;
+        uint8_t operator[] (size_t pos) const;
+        size_t copy(uint8_t* buf, size_t len, size_t start_pos = 0) const;
+        buffer_view slice(size_t start_pos, size_t len) const;
+        size_t find(uint8_t byte, size_t start_pos = 0) const;
+        size_t find(const uint8_t* pattern, size_t len, size_t start_pos = 0) const;
+
+    private:
+        span m_single;
+        std::vector<span> m_spans; // only used if there are multiple spans
+        size_t m_size;
+    };
+
+    /*
+     * Read-only bytes that keep their memory alive, so unlike buffer_view they stay
+     * valid after the buffer is consumed or destroyed. They either refer to a part of
+     * a buffer chunk (see buffer::share) or to a copy of their own. Deserializers can
+     * return strings and byte arrays as views (see serializer::set_string_views). A
+     * non-const var::get<std::string>() or get<std::vector<uint8_t>>() turns them into
+     * copies in place, and var::cast() returns a copy without changing the var.
+     */
+    class shared_view
+    {
+    public:
+        shared_view();
+        shared_view(const uint8_t* data, size_t size); // copies the data
+        explicit shared_view(const buffer_view&);    // copies the data
+        shared_view(const reference_counted* owner, const uint8_t* data, size_t size); // grabs 'owner'
+        shared_view(const shared_view&);
+        shared_view(shared_view&&) noexcept;
+        ~shared_view();
+        shared_view& operator= (const shared_view&);
+        shared_view& operator= (shared_view&&) noexcept;
+
+        size_t size() const;
+        bool empty() const;
+        const uint8_t* data() const;
+        std::string to_string() const;
+        std::vector<uint8_t> to_byte_array() const;
+        operator std::string() const { return to_string(); }
+
+    private:
+        const reference_counted* m_owner;
+        const uint8_t* m_data;
+        size_t m_size;
+    };
+
+    std::ostream& operator<< (std::ostream&, const shared_view&);
+
     class buffer : public reference_counted
     {
     protected:
@@ -17,7 +97,41 @@ namespace gg
     public:
         typedef std::vector<uint8_t> byte_array;
 
-        static buffer* create();
+        static const size_t npos = buffer_view::npos;
+
+        enum class mode
+        {
+            SYNCHRONIZED,   // any thread can read or write the buffer
+            LOCK_FREE_SPSC, // one thread writes the buffer while another one reads it
+            UNSYNCHRONIZED  // the buffer never leaves the thread that uses it
+        };
+
+        struct pool_stats
+        {
+            size_t hits;           // allocations served from a free list
+            size_t misses;         // allocations that had to use the heap
+            size_t bytes_retained; // memory kept in free lists for reuse
+        };
+
+        struct usage_stats
+        {
+            std::string owner;
+            uint64_t bytes_pushed;
+            uint64_t bytes_popped;
+            size_t size;
+            size_t high_water_mark;
+            uint64_t lock_count; // always 0 for lock-free and unsynchronized buffers
+        };
+
+        static buffer* create(mode m = mode::SYNCHRONIZED);
+        // the buffer is stored in a memory mapped file and the existing contents
+        // of the file are readable (the mapping grows if needed, invalidating views)
+        static buffer* create_mapped(std::string path, size_t size = 0);
+        static pool_stats get_pool_stats();
+        // usage statistics of every buffer with tracking enabled
+        // (the values of an unsynchronized buffer might be a bit behind)
+        static std::vector<usage_stats> get_tracked_buffers();
+        static void dump_tracked_buffers(std::ostream&);
 
         virtual size_t available() const = 0;
         virtual void advance(size_t len) = 0;
@@ -28,6 +142,9 @@ namespace gg
         virtual size_t peek(uint8_t* buf, size_t len) const = 0;
         virtual size_t peek(size_t start_pos, uint8_t* buf, size_t len) const = 0;
 
+        virtual buffer_view view(size_t len) const = 0;
+        virtual buffer_view view(size_t start_pos, size_t len) const = 0;
+
         virtual void push(uint8_t byte) = 0;
         virtual void push(const uint8_t* buf, size_t len) = 0;
         virtual void push(const byte_array& buf) = 0;
@@ -37,6 +154,137 @@ namespace gg
         virtual optional<uint8_t> pop() = 0;
         virtual byte_array pop(size_t len) = 0;
         virtual size_t pop(uint8_t* buf, size_t len) = 0;
+
+        // find() returns the position of the first match at or after 'start_pos' (or npos),
+        // and pop_until() pops the bytes up to and including 'delim' (nothing if it's not found)
+        virtual size_t find(uint8_t byte, size_t start_pos = 0) const = 0;
+        virtual size_t find(const uint8_t* pattern, size_t len, size_t start_pos = 0) const = 0;
+        virtual byte_array pop_until(uint8_t delim) = 0;
+
+        // direct write access: prepare() returns at least 'len' bytes of writable memory
+        // at the end of the buffer, and commit() makes the first 'len' bytes of it readable
+        // (no other write operation is allowed between the two calls)
+        virtual uint8_t* prepare(size_t len) = 0;
+        virtual void commit(size_t len) = 0;
+
+        // direct read access: data() returns the first contiguous block of readable bytes
+        virtual buffer_view::span data() const = 0;
+        void consume(size_t len) { advance(len); }
+
+        // the bytes in the range without copying them if the implementation can share its
+        // memory, otherwise (and for short ranges, which are cheaper to copy) as a copy
+        virtual shared_view share(size_t start_pos, size_t len) const { return shared_view(view(start_pos, len)); }
+
+        // vectored read access: fills 'spans' with at most 'max_spans' contiguous blocks
+        // covering the first 'len' readable bytes and returns the number of spans filled
+        virtual size_t gather(buffer_view::span* spans, size_t max_spans, size_t len) const = 0;
+
+        // data beyond 'threshold' bytes is stored in a temporary mapped file instead of memory
+        // (0 disables spilling, lock-free and mapped buffers ignore this setting)
+        virtual void set_spill_threshold(size_t threshold) = 0;
+
+        // tracking collects usage statistics and lists the buffer among the tracked buffers
+        // under the name of its owner (the statistics are all zero while tracking is disabled)
+        virtual void enable_tracking(std::string owner) = 0;
+        virtual void disable_tracking() = 0;
+        virtual usage_stats get_usage_stats() const = 0;
+    };
+
+    /*
+     * Read cursor over the readable bytes of a buffer. The data is decoded straight
+     * from the buffer's memory (a few spans at a time, so long buffers are not walked
+     * at once) and nothing is consumed from the buffer until commit(), which makes a
+     * failed decode cheap to abandon or rewind. The reader only sees the bytes that
+     * were available when it was created, and the buffer must not be consumed by
+     * anybody else while the reader is in use.
+     */
+    class buffer_reader
+    {
+    public:
+        buffer_reader(buffer* buf);
+        buffer_reader(const buffer_reader&) = delete;
+        ~buffer_reader();
+
+        buffer* get_buffer() const;
+        size_t position() const;
+        size_t remaining() const;
+        void rewind(size_t pos); // moves the cursor back to a position returned by position()
+
+        // both of them fail without moving the cursor if less than 'len' bytes remain
+        bool read(uint8_t* buf, size_t len);
+        bool skip(size_t len);
+
+        template<class T>
+        bool read(T& t)
+        {
+            return this->read(reinterpret_cast<uint8_t*>(&t), sizeof(T));
+        }
+
+        // the next 'len' bytes as a view (see buffer::share)
+        bool read(shared_view& vw, size_t len);
+
+        // consumes the bytes before the cursor from the buffer
+        void commit();
+
+    private:
+        static const size_t max_spans = 8;
+        static const size_t window_size = 64 * 1024;
+
+        buffer* m_buf;
+        buffer_view::span m_spans[max_spans];
+        size_t m_span_count;
+        size_t m_span;      // current span
+        size_t m_offset;    // position in the current span
+        size_t m_spans_pos; // position of the first span's first byte
+        size_t m_pos;
+        size_t m_available;
+
+        void fetch(size_t len);
+        void reset_spans();
+    };
+
+    /*
+     * Compresses buffer contents in independent blocks of at most 'block_size' bytes.
+     * Every block carries a small header, so decode() can leave an incomplete block
+     * in the source buffer until the rest of it arrives. The built-in codec uses a
+     * LZ77 scheme (LZ4 sequence format), higher levels search more match candidates.
+     */
+    class buffer_codec : public reference_counted
+    {
+    protected:
+        virtual ~buffer_codec() {}
+
+    public:
+        struct stats
+        {
+            uint64_t encoded_blocks;
+            uint64_t encode_input;   // raw bytes
+            uint64_t encode_output;  // compressed bytes including the block headers
+            uint64_t encode_time_us;
+            uint64_t decoded_blocks;
+            uint64_t decode_input;
+            uint64_t decode_output;
+            uint64_t decode_time_us;
+
+            double get_ratio() const { return (encode_output > 0) ? (double)encode_input / encode_output : 1.0; }
+        };
+
+        static const size_t max_block_size = 1024 * 1024;
+        static const int min_level = 1;
+        static const int max_level = 9;
+
+        static buffer_codec* create(size_t block_size = 64 * 1024, int level = min_level);
+
+        virtual size_t get_block_size() const = 0;
+        virtual int get_level() const = 0;
+
+        // encodes and consumes every readable byte of 'src', returns the bytes pushed to 'dest'
+        virtual size_t encode(buffer* src, buffer* dest) = 0;
+        // decodes and consumes the complete blocks of 'src', returns the bytes pushed to 'dest'
+        // (throws std::runtime_error if the data is corrupt)
+        virtual size_t decode(buffer* src, buffer* dest) = 0;
+
+        virtual stats get_stats() const = 0;
     };
 
     std::ostream& operator<< (std::ostream&, const buffer&);
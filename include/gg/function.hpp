@@ -39,6 +39,18 @@ namespace gg
 
         template<class T>
         using get_signature = typename get_signature_impl<T>::type;
+
+        template<size_t... I>
+        struct index_sequence { };
+
+        template<size_t N, size_t... I>
+        struct make_index_sequence_impl : make_index_sequence_impl<N - 1, N - 1, I...> { };
+
+        template<size_t... I>
+        struct make_index_sequence_impl<0, I...> { using type = index_sequence<I...>; };
+
+        template<size_t N>
+        using make_index_sequence = typename make_index_sequence_impl<N>::type;
     };
 
     template<class>
@@ -49,43 +61,11 @@ namespace gg
     {
         std::function<R(Args...)> m_func;
 
-        template<class _R, class... _Args>
-        static _R _invoke(std::function<_R(_Args...)> func, varlist vl);
-
-        template<class _R>
-        static _R _invoke(std::function<_R()> func, varlist vl)
-        {
-            if (vl.size() > 0)
-                throw std::runtime_error("too long argument list");
-
-            return func();
-        }
-
-        template<class _R, class _Arg0, class... _Args>
-        static _R _invoke(std::function<_R(_Arg0, _Args...)> func, varlist vl)
+        // every argument is converted straight from its place in the list, then there is a single call
+        template<size_t... I>
+        R _invoke(const varlist& vl, meta::index_sequence<I...>) const
         {
-            if (vl.size() == 0)
-                throw std::runtime_error("too short argument list");
-
-            _Arg0 arg0 = vl[0].cast<_Arg0>();
-            vl.erase(vl.begin());
-            std::function<_R(_Args... args)> lambda =
-                [=](_Args... args) -> _R { return func(arg0, args...); };
-
-            return _invoke(lambda, vl);
-        }
-
-        template<class _R, class... _Args>
-        static _R _invoke(_R(*func)(_Args...))
-        {
-            return _invoke(std::function<_R(_Args...)>(func));
-        }
-
-        template<class _F>
-        static typename std::result_of<meta::get_signature<_F>>::type
-        _invoke(_F func)
-        {
-            return _invoke(std::function<meta::get_signature<_F>>(func));
+            return m_func(vl[I].cast<typename std::decay<Args>::type>()...);
         }
 
     public:
@@ -111,7 +91,18 @@ namespace gg
         function& operator= (gg::function<R(Args...)>&& func) { m_func = std::move(func.m_func); return *this; }
 
         R operator() (Args... args) const { return m_func(std::forward<Args>(args)...); }
-        R invoke(varlist vl) const { return _invoke(m_func, vl); }
+
+        R invoke(const varlist& vl) const
+        {
+            if (vl.size() < sizeof...(Args))
+                throw std::runtime_error("too short argument list");
+
+            if (vl.size() > sizeof...(Args))
+                throw std::runtime_error("too long argument list");
+
+            return _invoke(vl, meta::make_index_sequence<sizeof...(Args)>());
+        }
+
         operator bool() const { return static_cast<bool>(m_func); }
         operator std::function<R(Args...)>() const { return m_func; }
     };
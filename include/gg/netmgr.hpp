@@ -67,6 +67,10 @@ namespace gg
         virtual packet_handler* get_packet_handler() const = 0;
         virtual void set_connection_handler(connection_handler*) = 0;
         virtual connection_handler* get_connection_handler() const = 0;
+        // compresses the output and decompresses the input transparently (TCP only,
+        // the peer has to use a codec as well, nullptr switches it off)
+        virtual void set_codec(buffer_codec*) = 0;
+        virtual buffer_codec* get_codec() const = 0;
         virtual void send(buffer*) = 0;
         virtual void send(uint8_t*, size_t) = 0;
         virtual bool is_opened() const = 0;
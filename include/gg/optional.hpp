@@ -88,8 +88,8 @@ namespace gg
 
         friend std::istream& operator>> (std::istream& i, optional& opt)
         {
-            if (opt.m_val.is_empty()) opt.m_val.construct();
-            opt.m_valid = istream_extract(i, *opt);
+            if (opt.m_val.is_empty()) opt.m_val.template construct<T>();
+            opt.m_valid = istream_extract(i, opt.m_val.template get<T>());
             if (!opt.m_valid) opt.m_val.clear();
             return i;
         }
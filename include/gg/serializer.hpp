@@ -4,6 +4,9 @@
 #include <cstdint>
 #include <cstring>
 #include <functional>
+#include <string>
+#include <type_traits>
+#include <vector>
 #include "gg/var.hpp"
 #include "gg/refcounted.hpp"
 #include "gg/optional.hpp"
@@ -14,6 +17,45 @@ namespace gg
 {
     class application;
 
+    template<class T, class... Fields>
+    class struct_serializer;
+
+    namespace meta
+    {
+        // deserialized as shared_view if the serializer uses views (see set_string_views)
+        template<class T>
+        using is_viewable = std::integral_constant<bool,
+            std::is_same<T, std::string>::value || std::is_same<T, std::vector<uint8_t>>::value>;
+    };
+
+    /*
+     * Decodes one value (or frame) over multiple calls: strings and varlists keep their
+     * progress, so a big value is decoded as it arrives instead of from the beginning
+     * every time. Other values are decoded at once when they have fully arrived.
+     * feed() consumes what it decoded and stops once it went through 'max_bytes' (0
+     * means no limit, and a value that isn't split can go over it). A failed frame is
+     * skipped, but an unframed stream can't be continued after a failure. The creator
+     * serializer has to outlive the deserializer.
+     */
+    class incremental_deserializer : public reference_counted
+    {
+    protected:
+        virtual ~incremental_deserializer() {}
+
+    public:
+        enum status
+        {
+            in_progress, // needs more data
+            finished,    // the value is ready, see get_result()
+            failed,      // the value is dropped, but the next one can be decoded
+            broken       // the stream can't be decoded any further (until reset)
+        };
+
+        virtual status feed(buffer*, size_t max_bytes = 0) = 0;
+        virtual optional<var> get_result() = 0;
+        virtual void reset() = 0;
+    };
+
     class serializer
     {
     protected:
@@ -24,14 +66,44 @@ namespace gg
         typedef std::function<bool(const var&, buffer*)> serializer_func;
         typedef std::function<optional<var>(buffer*, const serializer*)> deserializer_func_ex;
         typedef std::function<optional<var>(buffer*)> deserializer_func;
+        typedef std::function<optional<var>(buffer_reader&, const serializer*)> reader_func;
 
         virtual application* get_app() const = 0;
+        /*
+         * 1: every value is prefixed with its 8 byte type hash, lengths are uint16
+         * 2: compact format, values are prefixed with a varint type tag agreed on by
+         *    the two ends, integers and lengths are varints, floats are 4 bytes
+         * Rules can check it to pick the encoding of their own fields (see write_length).
+         */
+        virtual unsigned get_format_version() const = 0;
+        // strings and byte arrays (std::vector<uint8_t>) are deserialized as shared_view
+        // instead of copies if enabled, and views are serialized like strings (strings
+        // that the incremental deserializer gets in pieces stay std::string, though)
+        virtual void set_string_views(bool enabled) = 0;
+        virtual bool get_string_views() const = 0;
+        // a rule can be added once per type, except for the std::vector arrays of
+        // numbers: their built-in rules are replaced by the first rule of the user
         virtual void add_rule_ex(typeinfo, serializer_func_ex, deserializer_func_ex) = 0;
         virtual void add_rule(typeinfo, serializer_func, deserializer_func) = 0;
+        // the deserializer decodes through a cursor, which is rewound if it fails
+        virtual void add_reader_rule(typeinfo, serializer_func_ex, reader_func) = 0;
         virtual void remove_rule(typeinfo) = 0;
         virtual bool serialize(const var&, buffer*) const = 0;
         virtual optional<var> deserialize(buffer*) const = 0;
+        virtual optional<var> deserialize(buffer_reader&) const = 0;
         virtual varlist deserialize_all(buffer*) const = 0;
+        /*
+         * Frames put a header before the message: its length as a little endian uint32,
+         * where the highest bit means that the CRC32 of the message follows (also uint32).
+         * deserialize_frame() doesn't touch an incomplete frame (see get_frame_size), but
+         * it consumes a complete one even if it's broken, so the next frame can be read.
+         * In format v2 a broken frame loses the names it interned (see write_name), so
+         * the frames after it can't be trusted: the incremental deserializer returns
+         * 'broken' then, and the connection should be dropped.
+         */
+        virtual bool serialize_frame(const var&, buffer*, bool checksum) const = 0;
+        virtual optional<var> deserialize_frame(buffer*) const = 0;
+        virtual incremental_deserializer* create_incremental_deserializer(bool framed) const = 0;
 
         template<class T>
         bool serialize(const T& t, buffer* buf) const
@@ -46,10 +118,11 @@ namespace gg
         {
             optional<var> data = this->deserialize(buf);
 
-            if (!data || data->get_type() != typeid(T))
+            // a view is turned into a copy by the non-const get()
+            if (!data || !(data->is<T>() || (meta::is_viewable<T>::value && data->is<shared_view>())))
                 return {};
             return
-                std::move(*data);
+                std::move(data->get<T>());
         }
 
         template<class T>
@@ -64,43 +137,331 @@ namespace gg
             this->add_rule(typeid(T), s, d);
         }
 
+        template<class T>
+        void add_reader_rule(serializer_func_ex s, reader_func d)
+        {
+            this->add_reader_rule(typeid(T), s, d);
+        }
+
         template<class T>
         void add_trivial_rule()
         {
-            serializer_func s = [](const var& v, buffer* buf)->bool
+            serializer_func_ex s = [](const var& v, buffer* buf, const serializer*)->bool
             {
-                if (buf == nullptr || v.get_type() != typeid(T))
+                if (buf == nullptr || !v.is<T>())
                     return false;
 
                 buf->push(reinterpret_cast<const uint8_t*>(v.get_ptr<T>()), sizeof(T));
                 return true;
             };
 
-            deserializer_func d = [](buffer* buf)->optional<var>
+            reader_func d = [](buffer_reader& rd, const serializer*)->optional<var>
             {
-                if (buf == nullptr || (buf->available() < sizeof(T)))
+                T t;
+                if (!rd.read(t))
                     return {};
 
+                return std::move(t);
+            };
+
+            this->add_reader_rule(typeid(T), s, d);
+        }
+
+        // adds a rule for an aggregate type from its field list (see GG_FIELD)
+        template<class T, class... Fields>
+        void add_struct_rule()
+        {
+            serializer_func_ex s = [](const var& v, buffer* buf, const serializer* srl)->bool
+            {
+                if (buf == nullptr || !v.is<T>())
+                    return false;
+
+                return struct_serializer<T, Fields...>::serialize(v.get<T>(), buf, srl);
+            };
+
+            reader_func d = [](buffer_reader& rd, const serializer* srl)->optional<var>
+            {
                 T t;
-                buf->pop(reinterpret_cast<uint8_t*>(&t), sizeof(T));
+                if (!struct_serializer<T, Fields...>::deserialize(t, rd, srl))
+                    return {};
+
                 return std::move(t);
             };
 
-            this->add_rule(typeid(T), s, d);
+            this->add_reader_rule(typeid(T), s, d);
+        }
+    };
+
+
+    // lengths and counts are uint16 in format v1 (longer ones fail) and varints in v2
+    bool write_length(buffer* buf, size_t len, const serializer* s);
+    bool read_length(buffer_reader& rd, size_t& len, const serializer* s);
+
+
+    namespace meta
+    {
+        // bools and enums are read through an integer, since not every byte pattern is a valid value of them
+        template<class T, class = void>
+        struct field_raw_type { typedef T type; };
+
+        template<class T>
+        struct field_raw_type<T, typename std::enable_if<std::is_enum<T>::value>::type> { typedef typename std::underlying_type<T>::type type; };
+
+        template<>
+        struct field_raw_type<bool> { typedef uint8_t type; };
+
+        /*
+         * Reads and writes a single field of a described struct. Arithmetic and enum
+         * fields are copied as raw bytes (like add_trivial_rule does) and strings get
+         * a length prefix (like serialize_string, see write_length), so neither of them
+         * touches a var. Any other type falls back to the rules of the serializer.
+         */
+        template<class T, class = void>
+        struct field_codec
+        {
+            static const bool is_fixed = false;
+            static const size_t fixed_size = 0;
+
+            static bool push(const T& t, buffer* buf, const serializer* s)
+            {
+                if (s == nullptr) return false;
+                return s->serialize(t, buf);
+            }
+
+            static bool pop(T& t, buffer_reader& rd, const serializer* s)
+            {
+                if (s == nullptr) return false;
+
+                optional<var> data = s->deserialize(rd);
+                if (!data || !(data->is<T>() || (is_viewable<T>::value && data->is<shared_view>()))) return false;
+
+                t = std::move(data->get<T>());
+                return true;
+            }
+        };
+
+        template<class T>
+        struct field_codec<T, typename std::enable_if<std::is_arithmetic<T>::value || std::is_enum<T>::value>::type>
+        {
+            typedef typename field_raw_type<T>::type raw_type;
+            static_assert(sizeof(raw_type) == sizeof(T), "unexpected size");
+
+            static const bool is_fixed = true;
+            static const size_t fixed_size = sizeof(T);
+
+            static uint8_t* write(const T& t, uint8_t* p)
+            {
+                std::memcpy(p, &t, sizeof(T));
+                return p + sizeof(T);
+            }
+
+            static const uint8_t* read(T& t, const uint8_t* p)
+            {
+                raw_type raw;
+                std::memcpy(&raw, p, sizeof(T));
+                t = static_cast<T>(raw);
+                return p + sizeof(T);
+            }
+
+            static bool push(const T& t, buffer* buf, const serializer*)
+            {
+                buf->push(reinterpret_cast<const uint8_t*>(&t), sizeof(T));
+                return true;
+            }
+
+            static bool pop(T& t, buffer_reader& rd, const serializer*)
+            {
+                raw_type raw;
+                if (!rd.read(raw)) return false;
+
+                t = static_cast<T>(raw);
+                return true;
+            }
+        };
+
+        template<>
+        struct field_codec<std::string>
+        {
+            static const bool is_fixed = false;
+            static const size_t fixed_size = 0;
+
+            static bool push(const std::string& str, buffer* buf, const serializer* s)
+            {
+                if (!write_length(buf, str.length(), s)) return false;
+
+                buf->push(reinterpret_cast<const uint8_t*>(str.data()), str.length());
+                return true;
+            }
+
+            static bool pop(std::string& str, buffer_reader& rd, const serializer* s)
+            {
+                size_t len;
+                if (!read_length(rd, len, s) || rd.remaining() < len) return false;
+
+                str.resize(len);
+                return rd.read(reinterpret_cast<uint8_t*>(&str[0]), len);
+            }
+        };
+
+        template<class... Fields>
+        struct field_list;
+
+        template<>
+        struct field_list<>
+        {
+            static const bool is_fixed = true;
+            static const size_t fixed_size = 0;
+        };
+
+        template<class F, class... Rest>
+        struct field_list<F, Rest...>
+        {
+            static const bool is_fixed = F::codec::is_fixed && field_list<Rest...>::is_fixed;
+            static const size_t fixed_size = F::codec::fixed_size + field_list<Rest...>::fixed_size;
+        };
+    };
+
+    // describes a data member of T, use it through GG_FIELD(T, member)
+    template<class P, P ptr>
+    struct struct_field;
+
+    template<class T, class M, M T::* ptr>
+    struct struct_field<M T::*, ptr>
+    {
+        typedef M type;
+        typedef meta::field_codec<M> codec;
+
+        static const M& get(const T& t) { return t.*ptr; }
+        static M& get(T& t) { return t.*ptr; }
+    };
+
+    #define GG_FIELD(type, member) gg::struct_field<decltype(&type::member), &type::member>
+
+    /*
+     * Serializes the listed fields of T one after the other, in the order they were
+     * given and without any type information between them. If every field has a fixed
+     * size, the whole struct is packed on the stack and pushed in a single call.
+     * Usage:
+     *   struct point { int32_t x, y; std::string name; };
+     *   srl->add_struct_rule<point, GG_FIELD(point, x), GG_FIELD(point, y), GG_FIELD(point, name)>();
+     */
+    template<class T, class... Fields>
+    class struct_serializer
+    {
+        static_assert(sizeof...(Fields) > 0, "empty field list");
+
+        typedef meta::field_list<Fields...> fields;
+
+        template<bool Fixed>
+        using fixed = std::integral_constant<bool, Fixed>;
+
+        static bool serialize(const T& t, buffer* buf, const serializer*, fixed<true>)
+        {
+            uint8_t data[fields::fixed_size];
+            uint8_t* p = data;
+            int expand[] = { (p = Fields::codec::write(Fields::get(t), p), 0)... };
+            (void)expand;
+
+            buf->push(data, fields::fixed_size);
+            return true;
+        }
+
+        static bool serialize(const T& t, buffer* buf, const serializer* s, fixed<false>)
+        {
+            bool ok = true;
+            int expand[] = { (ok = ok && Fields::codec::push(Fields::get(t), buf, s), 0)... };
+            (void)expand;
+
+            return ok;
+        }
+
+        static bool deserialize(T& t, buffer_reader& rd, const serializer*, fixed<true>)
+        {
+            uint8_t data[fields::fixed_size];
+            if (!rd.read(data, fields::fixed_size))
+                return false;
+
+            const uint8_t* p = data;
+            int expand[] = { (p = Fields::codec::read(Fields::get(t), p), 0)... };
+            (void)expand;
+
+            return true;
+        }
+
+        static bool deserialize(T& t, buffer_reader& rd, const serializer* s, fixed<false>)
+        {
+            bool ok = true;
+            int expand[] = { (ok = ok && Fields::codec::pop(Fields::get(t), rd, s), 0)... };
+            (void)expand;
+
+            return ok;
+        }
+
+    public:
+        // the serializer is only used for fields that don't have a built-in codec
+        static bool serialize(const T& t, buffer* buf, const serializer* s = nullptr)
+        {
+            if (buf == nullptr) return false;
+            return serialize(t, buf, s, fixed<fields::is_fixed>());
+        }
+
+        // the cursor is rewound on failure, but some fields of 't' might be overwritten
+        static bool deserialize(T& t, buffer_reader& rd, const serializer* s = nullptr)
+        {
+            size_t start = rd.position();
+            if (deserialize(t, rd, s, fixed<fields::is_fixed>()))
+                return true;
+
+            rd.rewind(start);
+            return false;
+        }
+
+        static bool deserialize(T& t, buffer* buf, const serializer* s = nullptr)
+        {
+            if (buf == nullptr) return false;
+
+            buffer_reader rd(buf);
+            if (!deserialize(t, rd, s))
+                return false;
+
+            rd.commit();
+            return true;
         }
     };
 
+    // size of the frame at the beginning of the buffer (header included) if it has
+    // arrived completely, otherwise 0
+    size_t get_frame_size(const buffer* buf);
+
+    // LEB128 varints, the signed ones are zigzag encoded so small negative numbers stay short
+    void write_varint(buffer* buf, uint64_t value);
+    bool read_varint(buffer_reader& rd, uint64_t& value);
+    void write_signed_varint(buffer* buf, int64_t value);
+    bool read_signed_varint(buffer_reader& rd, int64_t& value);
+
+    // names that repeat a lot (like attribute keys) have the string layout of write_length
+    // in format v1, while v2 only sends their string for the first time and an id later
+    // (see c_compact_serializer)
+    bool write_name(buffer* buf, const std::string& name, const serializer* s);
+    bool read_name(buffer_reader& rd, std::string& name, const serializer* s);
+
+    // the read_* functions are the cursor based versions of the deserializers
+
     bool serialize_varlist(const var& v, buffer* buf, const serializer* s);
     optional<var> deserialize_varlist(buffer* buf, const serializer* s);
+    optional<var> read_varlist(buffer_reader& rd, const serializer* s);
 
     bool serialize_string(const var& v, buffer* buf);
     optional<var> deserialize_string(buffer* buf);
+    optional<var> read_string(buffer_reader& rd);
 
     bool serialize_float(const var& v, buffer* buf);
     optional<var> deserialize_float(buffer* buf);
+    optional<var> read_float(buffer_reader& rd);
 
     bool serialize_double(const var& v, buffer* buf);
     optional<var> deserialize_double(buffer* buf);
+    optional<var> read_double(buffer_reader& rd);
 };
 
 #endif // GG_SERIALIZER_HPP_INCLUDED
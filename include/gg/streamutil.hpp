@@ -136,7 +136,7 @@ namespace gg
     bool istream_extract(std::istream& o, T& t,
         typename std::enable_if<meta::has_extract_op<T>::value>::type* = 0)
     {
-        return (o >> t);
+        return static_cast<bool>(o >> t);
     }
 
     template<class T>
@@ -1,80 +1,387 @@
 #ifndef GG_VAR_HPP_INCLUDED
 #define GG_VAR_HPP_INCLUDED
 
+#include <algorithm>
 #include <iosfwd>
+#include <cstdint>
+#include <limits>
+#include <new>
 #include <string>
 #include <vector>
 #include <tuple>
 #include <typeinfo>
 #include <type_traits>
 #include <stdexcept>
+#include "gg/refcounted.hpp"
 #include "gg/streamutil.hpp"
 
 namespace gg
 {
-    class var
+    /*
+     * Static table of the operations var needs on a value. Owned values of a type
+     * share one descriptor, so type checks are pointer comparisons. References have
+     * their own descriptors, which point to the descriptor of the referenced type.
+     */
+    struct type_descriptor
     {
-        class var_impl_base
+        // the value of an arithmetic type, which any other arithmetic type can be made from
+        struct number
         {
-        public:
-            virtual ~var_impl_base() {}
-            virtual var_impl_base* clone() const = 0;
-            virtual void* get_ptr() = 0;
-            virtual const void* get_ptr() const = 0;
-            virtual const std::type_info& get_type() const = 0;
-            virtual void extract_to(std::ostream&) const = 0;
+            enum kind_t { signed_int, unsigned_int, floating, character } kind;
+            union
+            {
+                int64_t i;
+                uint64_t u;
+                long double f;
+            };
+
+            template<class T>
+            void set(T t)
+            {
+                if (std::is_floating_point<T>::value) { kind = floating; f = t; }
+                else if (std::is_same<T, char>::value || std::is_same<T, signed char>::value ||
+                         std::is_same<T, unsigned char>::value) { kind = character; i = t; }
+                else if (std::is_signed<T>::value) { kind = signed_int; i = t; }
+                else { kind = unsigned_int; u = t; }
+            }
+
+            /*
+             * The value is clamped to the range of T before the cast, the same way as
+             * the parsed text in var::convert(), so out of range values (which would be
+             * undefined for floating point sources) give the min or max. NaN gives 0 to
+             * integral types, while NaN and the infinities stay as they are in floating
+             * point types.
+             */
+            template<class T>
+            typename std::enable_if<std::is_same<T, bool>::value, T>::type
+            get() const
+            {
+                switch (kind)
+                {
+                    case unsigned_int: return (u != 0);
+                    case floating: return (f != 0 && f == f);
+                    default: return (i != 0);
+                }
+            }
+
+            template<class T>
+            typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value, T>::type
+            get() const
+            {
+                typedef std::numeric_limits<T> limits;
+
+                switch (kind)
+                {
+                    case unsigned_int:
+                        return (u > static_cast<uint64_t>(limits::max())) ? limits::max() : static_cast<T>(u);
+
+                    case floating:
+                    {
+                        // 2^digits is the first value above the max (and its negative is the min of signed types)
+                        const long double bound = 2.0L * static_cast<long double>(static_cast<T>(1) << (limits::digits - 1));
+                        if (f != f) return 0;
+                        if (f <= (limits::is_signed ? -bound : 0.0L)) return limits::min();
+                        if (f >= bound) return limits::max();
+                        return static_cast<T>(f);
+                    }
+
+                    default:
+                        if (i < 0) return (i < static_cast<int64_t>(limits::min())) ? limits::min() : static_cast<T>(i);
+                        return (static_cast<uint64_t>(i) > static_cast<uint64_t>(limits::max())) ? limits::max() : static_cast<T>(i);
+                }
+            }
+
+            template<class T>
+            typename std::enable_if<std::is_floating_point<T>::value, T>::type
+            get() const
+            {
+                long double t;
+
+                switch (kind)
+                {
+                    case unsigned_int: t = static_cast<long double>(u); break;
+                    case floating: t = f; break;
+                    default: t = static_cast<long double>(i); break;
+                }
+
+                // infinities fit in every floating type, only finite values out of range are clamped
+                const long double inf = std::numeric_limits<long double>::infinity();
+                if (t != inf && t != -inf)
+                {
+                    t = std::max<long double>(t, -std::numeric_limits<T>::max());
+                    t = std::min<long double>(t, std::numeric_limits<T>::max());
+                }
+
+                return static_cast<T>(t);
+            }
         };
 
+        const type_descriptor* value;      // owned values of the same type (itself for those)
+        const std::type_info& (*type)();
+        size_t (*hash)();                  // same as typeinfo::get_hash(), computed once
+        enum storage_kind
+        {
+            stored_inline,
+            stored_allocated,
+            stored_shared,          // refcounted and immutable, see var::share()
+            stored_reference,
+            stored_const_reference
+        } kind;                            // apart from inline, the var only stores a pointer to the value
+        void (*copy)(void* dest, const void* src);
+        void (*move)(void* dest, void* src); // destroys the source too
+        void (*destroy)(void*);
+        void (*extract)(std::ostream&, const void* value);
+        bool (*to_number)(const void* value, number&); // false if the type isn't arithmetic
+        const type_descriptor* (*share)(void*);        // owned values only, returns the new descriptor
+        void (*detach)(void*);                         // shared values only, makes an owned copy
+
+        // descriptors are not merged between a dll and its host, so the pointers
+        // of the same type can differ, which is checked by the slow path. the hash
+        // rules out different types first, so type_info is only compared on a match
+        bool is_same(const type_descriptor& d) const
+        {
+            return (value == d.value || (hash() == d.hash() && type() == d.type()));
+        }
+    };
+
+    class var
+    {
+        /*
+         * Values that fit in 'inline_size' bytes and can't throw when moved are
+         * stored in the var itself, others are allocated and only their pointer is
+         * stored. Copying or moving an inline value doesn't allocate either.
+         */
+        static const size_t inline_size = 3 * sizeof(void*);
+        typedef typename std::aligned_storage<inline_size, alignof(double)>::type storage;
+
+        template<class T>
+        struct fits_inline : std::integral_constant<bool,
+            sizeof(T) <= sizeof(storage) && alignof(T) <= alignof(storage) &&
+            std::is_nothrow_move_constructible<T>::value> {};
+
         template<class T>
-        class var_impl : public var_impl_base
+        struct inline_value
         {
-            T m_var;
-            const std::type_info* m_type;
+            template<class... Args>
+            static void create(void* dest, Args&&... args) { new (dest) T(std::forward<Args>(args)...); }
+            static void copy(void* dest, const void* src) { new (dest) T(*static_cast<const T*>(src)); }
+            static void move(void* dest, void* src) { T* t = static_cast<T*>(src); new (dest) T(std::move(*t)); t->~T(); }
+            static void destroy(void* p) { static_cast<T*>(p)->~T(); }
+            static void* get(void* p) { return p; }
+        };
 
-        public:
+        template<class T>
+        struct allocated_value
+        {
             template<class... Args>
-            var_impl(Args... args) : m_var(std::forward<Args>(args)...), m_type(&typeid(T)) {}
-            ~var_impl() {}
-            var_impl_base* clone() const { return new var_impl<T>(m_var); }
-            void* get_ptr() { return static_cast<void*>(&m_var); }
-            const void* get_ptr() const { return static_cast<const void*>(&m_var); }
-            const std::type_info& get_type() const { return *m_type; }
-            void extract_to(std::ostream& o) const { ostream_insert(o, m_var); }
+            static void create(void* dest, Args&&... args) { *static_cast<T**>(dest) = new T(std::forward<Args>(args)...); }
+            static void copy(void* dest, const void* src) { *static_cast<T**>(dest) = new T(**static_cast<T* const*>(src)); }
+            static void move(void* dest, void* src) { *static_cast<T**>(dest) = *static_cast<T**>(src); }
+            static void destroy(void* p) { delete *static_cast<T**>(p); }
+            static void* get(void* p) { return *static_cast<T**>(p); }
         };
 
         template<class T>
-        class var_ref_impl : public var_impl_base
+        struct shared_value
+        {
+            struct payload : public reference_counted
+            {
+                T m_value;
+
+                template<class... Args>
+                payload(Args&&... args) : m_value(std::forward<Args>(args)...) {}
+            };
+
+            // the value pointer comes first, so the var can access it like any other indirect value
+            struct slots
+            {
+                T* value;
+                payload* owner;
+            };
+
+            static void copy(void* dest, const void* src)
+            {
+                const slots& s = *static_cast<const slots*>(src);
+                s.owner->grab();
+                new (dest) slots(s);
+            }
+
+            static void move(void* dest, void* src) { new (dest) slots(*static_cast<slots*>(src)); }
+            static void destroy(void* p) { static_cast<slots*>(p)->owner->drop(); }
+
+            template<class Ops>
+            static const type_descriptor* share(void* p)
+            {
+                T* t = static_cast<T*>(Ops::get(p));
+                payload* owner = new payload(std::move(*t));
+                Ops::destroy(p);
+                new (p) slots { &owner->m_value, owner };
+                return &descriptors<T>::shared;
+            }
+
+            static void detach(void* p)
+            {
+                slots s = *static_cast<slots*>(p);
+                try
+                {
+                    // the last owner can take the value
+                    if (s.owner->get_ref_count() == 1) descriptors<T>::ops::create(p, std::move(*s.value));
+                    else descriptors<T>::ops::create(p, *s.value);
+                }
+                catch (...)
+                {
+                    s.owner->drop();
+                    throw;
+                }
+                s.owner->drop();
+            }
+        };
+
+        struct referenced_value
         {
-            T& m_var;
-            const std::type_info* m_type;
+            static void copy(void* dest, const void* src) { *static_cast<void**>(dest) = *static_cast<void* const*>(src); }
+            static void move(void* dest, void* src) { *static_cast<void**>(dest) = *static_cast<void**>(src); }
+            static void destroy(void*) {}
+        };
 
-        public:
-            var_ref_impl(T& t) : m_var(t), m_type(&typeid(T)) {}
-            ~var_ref_impl() {}
-            var_impl_base* clone() const { return new var_ref_impl<T>(m_var); }
-            void* get_ptr() { return static_cast<void*>(&m_var); }
-            const void* get_ptr() const { return static_cast<const void*>(&m_var); }
-            const std::type_info& get_type() const { return *m_type; }
-            void extract_to(std::ostream& o) const { ostream_insert(o, m_var); }
+        template<class T> static const std::type_info& type() { return typeid(T); }
+        template<class T> static size_t hash() { static const size_t h = typeid(T).hash_code(); return h; }
+        template<class T> static void extract(std::ostream& o, const void* p) { ostream_insert(o, *static_cast<const T*>(p)); }
+
+        template<class T, bool = std::is_arithmetic<T>::value>
+        struct arithmetic
+        {
+            static bool to_number(const void* p, type_descriptor::number& n) { n.set(*static_cast<const T*>(p)); return true; }
         };
 
         template<class T>
-        class var_const_ref_impl : public var_impl_base
+        struct arithmetic<T, false>
         {
-            const T& m_var;
-            const std::type_info* m_type;
+            static bool to_number(const void*, type_descriptor::number&) { return false; }
+        };
 
-        public:
-            var_const_ref_impl(const T& t) : m_var(t), m_type(&typeid(T)) {}
-            ~var_const_ref_impl() {}
-            var_impl_base* clone() const { return new var_const_ref_impl<T>(m_var); }
-            void* get_ptr() { throw std::runtime_error("can't access const reference"); }
-            const void* get_ptr() const { return static_cast<const void*>(&m_var); }
-            const std::type_info& get_type() const { return *m_type; }
-            void extract_to(std::ostream& o) const { ostream_insert(o, m_var); }
+        template<class T>
+        struct is_character : std::integral_constant<bool,
+            std::is_same<T, char>::value || std::is_same<T, signed char>::value ||
+            std::is_same<T, unsigned char>::value> {};
+
+        template<class T>
+        struct descriptors
+        {
+            typedef typename std::conditional<fits_inline<T>::value, inline_value<T>, allocated_value<T>>::type ops;
+
+            static const type_descriptor value;
+            static const type_descriptor shared;
+            static const type_descriptor reference;
+            static const type_descriptor const_reference;
         };
 
-        var_impl_base* m_var = nullptr;
+        static const type_descriptor empty_descriptor;
+
+        const type_descriptor* m_desc = nullptr;
+        storage m_storage;
+
+        void* get_value_ptr() const;
+        void destroy();
+        void detach();
+
+        /*
+         * An owned shared_view is replaced by a copy of the requested type (std::string
+         * or byte array) by the non-const accessors, while cast() returns such a copy
+         * and leaves the var alone. The const accessors don't convert anything, so a
+         * var can be read by multiple threads.
+         */
+        bool materialize(const type_descriptor&);
+        bool copy_view(std::string&) const;
+        bool copy_view(std::vector<uint8_t>&) const;
+        template<class T> bool copy_view(T&) const { return false; }
+
+        /*
+         * Conversions done by cast() without a stringstream: between arithmetic types
+         * (clamped to the range of the target), from a string (or shared_view) to a number with strtoll and
+         * co., and from a number to a string. Characters are not parsed or formatted as
+         * numbers, for them the stream behavior stays. Anything else returns false.
+         */
+        bool get_text(const char*& data, size_t& len) const;
+        static bool parse_signed(const char* data, size_t len, int64_t& result);
+        static bool parse_unsigned(const char* data, size_t len, uint64_t& magnitude, bool& negative);
+        static bool parse_floating(const char* data, size_t len, long double& result);
+        bool convert(std::string&) const;
+
+        template<class T>
+        typename std::enable_if<std::is_arithmetic<T>::value, bool>::type
+        convert(T& t) const
+        {
+            type_descriptor::number n;
+            if (m_desc->to_number(get_value_ptr(), n))
+            {
+                t = n.get<T>();
+                return true;
+            }
+
+            const char* data;
+            size_t len;
+            if (is_character<T>::value || !get_text(data, len)) return false;
+
+            if (std::is_floating_point<T>::value)
+            {
+                long double f;
+                if (!parse_floating(data, len, f)) return false;
+                f = std::max<long double>(f, -std::numeric_limits<T>::max());
+                f = std::min<long double>(f, std::numeric_limits<T>::max());
+                t = static_cast<T>(f);
+            }
+            else if (std::is_same<T, bool>::value)
+            {
+                int64_t i;
+                if (!parse_signed(data, len, i)) return false;
+                t = (i != 0);
+            }
+            else if (std::is_signed<T>::value)
+            {
+                int64_t i;
+                if (!parse_signed(data, len, i)) return false;
+                i = std::max<int64_t>(i, static_cast<int64_t>(std::numeric_limits<T>::min()));
+                i = std::min<int64_t>(i, static_cast<int64_t>(std::numeric_limits<T>::max()));
+                t = static_cast<T>(i);
+            }
+            else
+            {
+                // a negative value is negated in the type, like with strtoul
+                uint64_t u;
+                bool negative;
+                if (!parse_unsigned(data, len, u, negative)) return false;
+                if (u > static_cast<uint64_t>(std::numeric_limits<T>::max())) t = std::numeric_limits<T>::max();
+                else t = negative ? static_cast<T>(0 - static_cast<T>(u)) : static_cast<T>(u);
+            }
+
+            return true;
+        }
+
+        template<class T>
+        typename std::enable_if<!std::is_arithmetic<T>::value, bool>::type
+        convert(T&) const
+        {
+            return false;
+        }
+
+        template<class T>
+        void check_type() const
+        {
+            if (m_desc == nullptr)
+                throw std::runtime_error("get() called on empty var");
+
+            const type_descriptor& d = descriptors<T>::value;
+            if (m_desc->value != &d && !m_desc->is_same(d))
+                throw std::runtime_error("var type mismatch");
+        }
+
+        template<class T, class... Args>
+        void create(Args&&... args)
+        {
+            descriptors<T>::ops::create(&m_storage, std::forward<Args>(args)...);
+            m_desc = &descriptors<T>::value;
+        }
 
     public:
         var();
@@ -82,69 +389,88 @@ namespace gg
         var(var&& v);
         ~var();
 
-        template<class T>
-        var(T t) : m_var(new var_impl<T>(t)) {}
+        template<class T, class = typename std::enable_if<!std::is_same<typename std::decay<T>::type, var>::value>::type>
+        var(T&& t) { create<typename std::decay<T>::type>(std::forward<T>(t)); }
 
         template<class T, class... Args>
-        var& construct(Args... args)
+        var& construct(Args&&... args)
         {
-            if (m_var != nullptr) delete m_var;
-            m_var = new var_impl<T>(std::forward<Args>(args)...);
+            destroy();
+            create<T>(std::forward<Args>(args)...);
             return *this;
         }
 
         template<class T>
         var& reference(T& t)
         {
-            if (m_var != nullptr) delete m_var;
-            m_var = new var_ref_impl<T>(t);
+            destroy();
+            *reinterpret_cast<T**>(&m_storage) = &t;
+            m_desc = &descriptors<T>::reference;
             return *this;
         }
 
         template<class T>
         var& const_reference(const T& t)
         {
-            if (m_var != nullptr) delete m_var;
-            m_var = new var_const_ref_impl<T>(t);
+            destroy();
+            *reinterpret_cast<const T**>(&m_storage) = &t;
+            m_desc = &descriptors<T>::const_reference;
             return *this;
         }
 
         template<class T>
         var& operator= (const T& t)
         {
-            if (m_var != nullptr) delete m_var;
-            m_var = new var_impl<T>(t);
+            destroy();
+            create<T>(t);
             return *this;
         }
 
         var& operator= (const var& v);
         var& operator= (var&& v);
         const std::type_info& get_type() const;
+        const type_descriptor& get_descriptor() const; // of owned values, even for references
         bool is_empty() const;
         void clear();
 
+        /*
+         * Moves the value into a refcounted immutable payload, so copies of the var
+         * only increment the refcount. A mutable get() makes a private copy again
+         * (or takes the value if there are no other owners). Scalars and references
+         * are left alone.
+         */
+        var& share();
+        bool is_shared() const;
+
+        template<class T>
+        static const type_descriptor& descriptor() { return descriptors<T>::value; }
+
+        template<class T>
+        bool is() const
+        {
+            return (m_desc != nullptr && (m_desc->value == &descriptors<T>::value || m_desc->is_same(descriptors<T>::value)));
+        }
+
         template<class T>
         T* get_ptr()
         {
-            if (m_var == nullptr)
-                throw std::runtime_error("get() called on empty var");
+            if (m_desc != nullptr && !is<T>()) materialize(descriptors<T>::value);
+            check_type<T>();
 
-            if (m_var->get_type() != typeid(T))
-                throw std::runtime_error("var type mismatch");
+            if (m_desc->kind == type_descriptor::stored_const_reference)
+                throw std::runtime_error("can't access const reference");
+
+            if (m_desc->kind == type_descriptor::stored_shared)
+                detach();
 
-            return static_cast<T*>(m_var->get_ptr());
+            return static_cast<T*>(get_value_ptr());
         }
 
         template<class T>
         const T* get_ptr() const
         {
-            if (m_var == nullptr)
-                throw std::runtime_error("get() called on empty var");
-
-            if (m_var->get_type() != typeid(T))
-                throw std::runtime_error("var type mismatch");
-
-            return static_cast<const T*>(m_var->get_ptr());
+            check_type<T>();
+            return static_cast<const T*>(get_value_ptr());
         }
 
         template<class T> T& get() { return *get_ptr<T>(); }
@@ -157,19 +483,26 @@ namespace gg
         template<class T, class = typename std::enable_if<!std::is_same<T, var>::value>::type>
         T cast() const
         {
-            if (m_var == nullptr)
+            if (m_desc == nullptr)
                 throw std::runtime_error("casting empty var");
 
-            if (m_var->get_type() == typeid(T))
-                return *static_cast<const T*>(m_var->get_ptr());
+            const type_descriptor& d = descriptors<T>::value;
+            if (m_desc->value == &d || m_desc->is_same(d))
+                return *static_cast<const T*>(get_value_ptr());
+
+            T result;
+            if (copy_view(result))
+                return result;
 
             if (!meta::has_extract_op<T>::value)
                 throw std::runtime_error("unable to cast");
 
-            T result;
+            if (convert(result))
+                return result;
+
             std::stringstream ss;
 
-            m_var->extract_to(ss);
+            m_desc->extract(ss, get_value_ptr());
             istream_extract(ss, result);
 
             return result;
@@ -192,6 +525,32 @@ namespace gg
     };
 
 
+    template<class T>
+    const type_descriptor var::descriptors<T>::value = {
+        &descriptors<T>::value, &var::type<T>, &var::hash<T>,
+        fits_inline<T>::value ? type_descriptor::stored_inline : type_descriptor::stored_allocated,
+        &ops::copy, &ops::move, &ops::destroy, &var::extract<T>, &arithmetic<T>::to_number,
+        std::is_scalar<T>::value ? nullptr : &shared_value<T>::template share<ops>, nullptr };
+
+    template<class T>
+    const type_descriptor var::descriptors<T>::shared = {
+        &descriptors<T>::value, &var::type<T>, &var::hash<T>, type_descriptor::stored_shared,
+        &shared_value<T>::copy, &shared_value<T>::move, &shared_value<T>::destroy, &var::extract<T>, &arithmetic<T>::to_number,
+        nullptr, &shared_value<T>::detach };
+
+    template<class T>
+    const type_descriptor var::descriptors<T>::reference = {
+        &descriptors<T>::value, &var::type<T>, &var::hash<T>, type_descriptor::stored_reference,
+        &referenced_value::copy, &referenced_value::move, &referenced_value::destroy, &var::extract<T>, &arithmetic<T>::to_number,
+        nullptr, nullptr };
+
+    template<class T>
+    const type_descriptor var::descriptors<T>::const_reference = {
+        &descriptors<T>::value, &var::type<T>, &var::hash<T>, type_descriptor::stored_const_reference,
+        &referenced_value::copy, &referenced_value::move, &referenced_value::destroy, &var::extract<T>, &arithmetic<T>::to_number,
+        nullptr, nullptr };
+
+
     typedef std::vector<var> varlist;
 
     std::ostream& operator<< (std::ostream& o, const varlist& vl);
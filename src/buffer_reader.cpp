@@ -0,0 +1,175 @@
+#include <algorithm>
+#include <cstring>
+#include "gg/buffer.hpp"
+
+using namespace gg;
+
+const size_t buffer_reader::max_spans;
+const size_t buffer_reader::window_size;
+
+
+buffer_reader::buffer_reader(buffer* buf)
+ : m_buf(buf)
+ , m_span_count(0)
+ , m_span(0)
+ , m_offset(0)
+ , m_spans_pos(0)
+ , m_pos(0)
+ , m_available((buf != nullptr) ? buf->available() : 0)
+{
+}
+
+buffer_reader::~buffer_reader()
+{
+}
+
+buffer* buffer_reader::get_buffer() const
+{
+    return m_buf;
+}
+
+size_t buffer_reader::position() const
+{
+    return m_pos;
+}
+
+size_t buffer_reader::remaining() const
+{
+    return (m_available - m_pos);
+}
+
+void buffer_reader::reset_spans()
+{
+    // the next read fetches the spans at the cursor
+    m_span_count = 0;
+    m_span = 0;
+    m_offset = 0;
+    m_spans_pos = m_pos;
+}
+
+void buffer_reader::rewind(size_t pos)
+{
+    if (pos > m_pos) return;
+
+    m_pos = pos;
+
+    if (pos < m_spans_pos)
+    {
+        reset_spans();
+        return;
+    }
+
+    // the position is still covered by the current spans
+    size_t offset = pos - m_spans_pos;
+    m_span = 0;
+
+    while (m_span < m_span_count && offset >= m_spans[m_span].size)
+    {
+        offset -= m_spans[m_span].size;
+        ++m_span;
+    }
+
+    m_offset = offset;
+}
+
+void buffer_reader::fetch(size_t len)
+{
+    if (m_pos == 0)
+    {
+        // the beginning of the buffer can be collected without allocating anything
+        m_span_count = m_buf->gather(m_spans, max_spans, remaining());
+    }
+    else
+    {
+        // views are walked from the buffer's first chunk, so a window is enough
+        buffer_view vw = m_buf->view(m_pos, std::min(std::max(len, window_size), remaining()));
+        m_span_count = std::min(vw.span_count(), max_spans);
+
+        for (size_t i = 0; i < m_span_count; ++i)
+            m_spans[i] = vw.get_span(i);
+    }
+
+    m_span = 0;
+    m_offset = 0;
+    m_spans_pos = m_pos;
+}
+
+bool buffer_reader::read(uint8_t* buf, size_t len)
+{
+    if (len > remaining()) return false;
+
+    while (len > 0)
+    {
+        if (m_span == m_span_count)
+        {
+            fetch(len);
+            if (m_span_count == 0) return false; // the buffer was consumed by someone else
+        }
+
+        const buffer_view::span& s = m_spans[m_span];
+        size_t n = std::min(len, s.size - m_offset);
+
+        std::memcpy(buf, s.data + m_offset, n);
+        buf += n;
+        len -= n;
+        m_pos += n;
+        m_offset += n;
+
+        if (m_offset == s.size)
+        {
+            ++m_span;
+            m_offset = 0;
+        }
+    }
+
+    return true;
+}
+
+bool buffer_reader::read(shared_view& vw, size_t len)
+{
+    if (len > remaining()) return false;
+
+    shared_view shared = m_buf->share(m_pos, len);
+    if (shared.size() != len) return false; // the buffer was consumed by someone else
+
+    skip(len);
+    vw = std::move(shared);
+    return true;
+}
+
+bool buffer_reader::skip(size_t len)
+{
+    if (len > remaining()) return false;
+
+    size_t left = len;
+    while (left > 0 && m_span < m_span_count)
+    {
+        size_t n = std::min(left, m_spans[m_span].size - m_offset);
+        left -= n;
+        m_offset += n;
+
+        if (m_offset == m_spans[m_span].size)
+        {
+            ++m_span;
+            m_offset = 0;
+        }
+    }
+
+    m_pos += len;
+
+    // skipped past the current spans
+    if (left > 0) reset_spans();
+
+    return true;
+}
+
+void buffer_reader::commit()
+{
+    if (m_pos == 0) return;
+
+    // the spans are invalidated by consuming the bytes
+    m_buf->advance(m_pos);
+    m_available -= m_pos;
+    m_pos = 0;
+    reset_spans();
+}
@@ -0,0 +1,335 @@
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <ostream>
+#include <stdexcept>
+#include "gg/buffer.hpp"
+#include "byte_search.hpp"
+
+using namespace gg;
+
+const size_t buffer_view::npos;
+
+
+buffer_view::buffer_view()
+ : m_single {nullptr, 0}
+ , m_size(0)
+{
+}
+
+buffer_view::buffer_view(const uint8_t* data, size_t size)
+ : m_single {data, size}
+ , m_size(size)
+{
+}
+
+buffer_view::buffer_view(std::vector<span> spans)
+ : m_single {nullptr, 0}
+ , m_size(0)
+{
+    // empty spans are not stored
+    spans.erase(std::remove_if(spans.begin(), spans.end(),
+                               [](const span& s) { return s.size == 0; }),
+                spans.end());
+
+    for (const span& s : spans) m_size += s.size;
+
+    if (spans.size() == 1) m_single = spans[0];
+    else if (spans.size() > 1) m_spans = std::move(spans);
+}
+
+buffer_view::buffer_view(const buffer_view& vw)
+ : m_single(vw.m_single)
+ , m_spans(vw.m_spans)
+ , m_size(vw.m_size)
+{
+}
+
+buffer_view::buffer_view(buffer_view&& vw)
+ : m_single(vw.m_single)
+ , m_spans(std::move(vw.m_spans))
+ , m_size(vw.m_size)
+{
+}
+
+buffer_view::~buffer_view()
+{
+}
+
+buffer_view& buffer_view::operator= (const buffer_view& vw)
+{
+    m_single = vw.m_single;
+    m_spans = vw.m_spans;
+    m_size = vw.m_size;
+    return *this;
+}
+
+buffer_view& buffer_view::operator= (buffer_view&& vw)
+{
+    m_single = vw.m_single;
+    m_spans = std::move(vw.m_spans);
+    m_size = vw.m_size;
+    return *this;
+}
+
+size_t buffer_view::size() const
+{
+    return m_size;
+}
+
+bool buffer_view::empty() const
+{
+    return (m_size == 0);
+}
+
+bool buffer_view::is_contiguous() const
+{
+    return m_spans.empty();
+}
+
+const uint8_t* buffer_view::data() const
+{
+    return (m_spans.empty() ? m_single.data : nullptr);
+}
+
+size_t buffer_view::span_count() const
+{
+    if (m_spans.empty()) return (m_size > 0 ? 1 : 0);
+    else return m_spans.size();
+}
+
+const buffer_view::span& buffer_view::get_span(size_t i) const
+{
+    if (m_spans.empty())
+    {
+        if (i > 0 || m_size == 0) throw std::out_of_range("buffer_view span index out of range");
+        return m_single;
+    }
+
+    return m_spans.at(i);
+}
+
+uint8_t buffer_view::operator[] (size_t pos) const
+{
+    if (pos >= m_size) throw std::out_of_range("buffer_view index out of range");
+
+    if (m_spans.empty()) return m_single.data[pos];
+
+    for (const span& s : m_spans)
+    {
+        if (pos < s.size) return s.data[pos];
+        pos -= s.size;
+    }
+
+    return 0; // unreachable
+}
+
+size_t buffer_view::copy(uint8_t* buf, size_t len, size_t start_pos) const
+{
+    if (buf == nullptr || start_pos >= m_size) return 0;
+
+    len = std::min(len, m_size - start_pos);
+
+    if (m_spans.empty())
+    {
+        std::memcpy(buf, m_single.data + start_pos, len);
+        return len;
+    }
+
+    size_t copied = 0;
+
+    for (const span& s : m_spans)
+    {
+        if (copied == len) break;
+
+        if (start_pos >= s.size)
+        {
+            start_pos -= s.size;
+            continue;
+        }
+
+        size_t n = std::min(len - copied, s.size - start_pos);
+        std::memcpy(buf + copied, s.data + start_pos, n);
+        copied += n;
+        start_pos = 0;
+    }
+
+    return copied;
+}
+
+buffer_view buffer_view::slice(size_t start_pos, size_t len) const
+{
+    if (start_pos >= m_size) return {};
+
+    len = std::min(len, m_size - start_pos);
+
+    if (m_spans.empty())
+        return buffer_view(m_single.data + start_pos, len);
+
+    std::vector<span> spans;
+
+    for (const span& s : m_spans)
+    {
+        if (len == 0) break;
+
+        if (start_pos >= s.size)
+        {
+            start_pos -= s.size;
+            continue;
+        }
+
+        size_t n = std::min(len, s.size - start_pos);
+        spans.push_back({s.data + start_pos, n});
+        len -= n;
+        start_pos = 0;
+    }
+
+    return buffer_view(std::move(spans));
+}
+
+size_t buffer_view::find(uint8_t byte, size_t start_pos) const
+{
+    if (start_pos >= m_size) return npos;
+
+    if (m_spans.empty())
+    {
+        const uint8_t* end = m_single.data + m_size;
+        const uint8_t* p = find_byte(m_single.data + start_pos, end, byte);
+        return (p != end) ? (p - m_single.data) : npos;
+    }
+
+    return find_byte(m_spans.begin(), m_spans.end(), start_pos, byte);
+}
+
+size_t buffer_view::find(const uint8_t* pattern, size_t len, size_t start_pos) const
+{
+    if (start_pos >= m_size || (pattern == nullptr && len > 0)) return npos;
+
+    if (m_spans.empty())
+        return find_pattern(&m_single, &m_single + 1, start_pos, pattern, len);
+    else
+        return find_pattern(m_spans.begin(), m_spans.end(), start_pos, pattern, len);
+}
+
+
+// the copy of a shared_view, stored right after the header in the same allocation
+class shared_block : public reference_counted
+{
+    shared_block() {}
+    ~shared_block() {}
+
+public:
+    static shared_block* create(size_t size)
+    {
+        return new (::operator new(sizeof(shared_block) + size)) shared_block();
+    }
+
+    static void operator delete(void* ptr) { ::operator delete(ptr); }
+
+    uint8_t* data() { return reinterpret_cast<uint8_t*>(this + 1); }
+};
+
+
+shared_view::shared_view()
+ : m_owner(nullptr)
+ , m_data(nullptr)
+ , m_size(0)
+{
+}
+
+shared_view::shared_view(const uint8_t* data, size_t size)
+ : shared_view(buffer_view(data, size))
+{
+}
+
+shared_view::shared_view(const buffer_view& vw)
+ : m_owner(nullptr)
+ , m_data(nullptr)
+ , m_size(vw.size())
+{
+    if (m_size == 0) return;
+
+    shared_block* block = shared_block::create(m_size);
+    vw.copy(block->data(), m_size);
+
+    m_owner = block;
+    m_data = block->data();
+}
+
+shared_view::shared_view(const reference_counted* owner, const uint8_t* data, size_t size)
+ : m_owner(owner)
+ , m_data(data)
+ , m_size(size)
+{
+    if (m_owner != nullptr) m_owner->grab();
+}
+
+shared_view::shared_view(const shared_view& vw)
+ : shared_view(vw.m_owner, vw.m_data, vw.m_size)
+{
+}
+
+shared_view::shared_view(shared_view&& vw) noexcept
+ : m_owner(vw.m_owner)
+ , m_data(vw.m_data)
+ , m_size(vw.m_size)
+{
+    vw.m_owner = nullptr;
+    vw.m_data = nullptr;
+    vw.m_size = 0;
+}
+
+shared_view::~shared_view()
+{
+    if (m_owner != nullptr) m_owner->drop();
+}
+
+shared_view& shared_view::operator= (const shared_view& vw)
+{
+    if (vw.m_owner != nullptr) vw.m_owner->grab();
+    if (m_owner != nullptr) m_owner->drop();
+
+    m_owner = vw.m_owner;
+    m_data = vw.m_data;
+    m_size = vw.m_size;
+    return *this;
+}
+
+shared_view& shared_view::operator= (shared_view&& vw) noexcept
+{
+    std::swap(m_owner, vw.m_owner);
+    std::swap(m_data, vw.m_data);
+    std::swap(m_size, vw.m_size);
+    return *this;
+}
+
+size_t shared_view::size() const
+{
+    return m_size;
+}
+
+bool shared_view::empty() const
+{
+    return (m_size == 0);
+}
+
+const uint8_t* shared_view::data() const
+{
+    return m_data;
+}
+
+std::string shared_view::to_string() const
+{
+    return std::string(reinterpret_cast<const char*>(m_data), m_size);
+}
+
+std::vector<uint8_t> shared_view::to_byte_array() const
+{
+    return std::vector<uint8_t>(m_data, m_data + m_size);
+}
+
+std::ostream& gg::operator<< (std::ostream& o, const shared_view& vw)
+{
+    o.write(reinterpret_cast<const char*>(vw.data()), vw.size());
+    return o;
+}
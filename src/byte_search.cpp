@@ -0,0 +1,91 @@
+#include <cstring>
+#include "byte_search.hpp"
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#   define GG_SIMD_SEARCH
+#   include <immintrin.h>
+#endif
+
+using namespace gg;
+
+typedef const uint8_t* (*find_byte_func)(const uint8_t*, const uint8_t*, uint8_t);
+
+
+static const uint8_t* find_byte_generic(const uint8_t* begin, const uint8_t* end, uint8_t byte)
+{
+    const void* p = std::memchr(begin, byte, end - begin);
+    return (p != nullptr) ? static_cast<const uint8_t*>(p) : end;
+}
+
+#ifdef GG_SIMD_SEARCH
+// the library is built for plain i486, so the vectorized versions are compiled
+// for their own instruction sets and only selected if the CPU supports them
+
+__attribute__((target("sse2")))
+static const uint8_t* find_byte_sse2(const uint8_t* begin, const uint8_t* end, uint8_t byte)
+{
+    const __m128i needle = _mm_set1_epi8(static_cast<char>(byte));
+    const uint8_t* p = begin;
+
+    for (; end - p >= 16; p += 16)
+    {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(block, needle)));
+        if (mask != 0) return p + __builtin_ctz(mask);
+    }
+
+    for (; p != end; ++p)
+    {
+        if (*p == byte) return p;
+    }
+
+    return end;
+}
+
+__attribute__((target("avx2")))
+static const uint8_t* find_byte_avx2(const uint8_t* begin, const uint8_t* end, uint8_t byte)
+{
+    const __m256i needle = _mm256_set1_epi8(static_cast<char>(byte));
+    const uint8_t* p = begin;
+
+    for (; end - p >= 32; p += 32)
+    {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle)));
+        if (mask != 0) return p + __builtin_ctz(mask);
+    }
+
+    return find_byte_sse2(p, end, byte);
+}
+
+static find_byte_func select_find_byte()
+{
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2")) return find_byte_avx2;
+    if (__builtin_cpu_supports("sse2")) return find_byte_sse2;
+    return find_byte_generic;
+}
+#endif // GG_SIMD_SEARCH
+
+
+const uint8_t* gg::find_byte(const uint8_t* begin, const uint8_t* end, uint8_t byte)
+{
+    if (end - begin < 16) // not worth the dispatch
+    {
+        for (const uint8_t* p = begin; p != end; ++p)
+        {
+            if (*p == byte) return p;
+        }
+
+        return end;
+    }
+
+#ifdef GG_SIMD_SEARCH
+    static const find_byte_func func = select_find_byte();
+#else
+    static const find_byte_func func = find_byte_generic;
+#endif
+
+    return func(begin, end, byte);
+}
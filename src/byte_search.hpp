@@ -0,0 +1,105 @@
+#ifndef BYTE_SEARCH_HPP_INCLUDED
+#define BYTE_SEARCH_HPP_INCLUDED
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include "gg/buffer.hpp"
+
+namespace gg
+{
+    // returns the first occurrence of 'byte' in [begin, end) or 'end' if there is none
+    // (uses SSE2 or AVX2 if the CPU supports them)
+    const uint8_t* find_byte(const uint8_t* begin, const uint8_t* end, uint8_t byte);
+
+    /*
+     * The following functions search a sequence of spans as if it was contiguous.
+     * 'It' is a forward iterator that dereferences to buffer_view::span, and both
+     * 'start_pos' and the returned position (or buffer_view::npos) are relative to
+     * the beginning of the first span.
+     */
+
+    template<class It>
+    size_t find_byte(It first, It last, size_t start_pos, uint8_t byte)
+    {
+        size_t pos = 0;
+
+        for (; first != last; ++first)
+        {
+            buffer_view::span s = *first;
+
+            if (start_pos < s.size)
+            {
+                const uint8_t* p = find_byte(s.data + start_pos, s.data + s.size, byte);
+                if (p != s.data + s.size) return pos + (p - s.data);
+                start_pos = 0;
+            }
+            else
+            {
+                start_pos -= s.size;
+            }
+
+            pos += s.size;
+        }
+
+        return buffer_view::npos;
+    }
+
+    template<class It>
+    bool match_pattern(It it, It last, size_t offset, const uint8_t* pattern, size_t len)
+    {
+        for (; it != last; ++it)
+        {
+            buffer_view::span s = *it;
+            size_t n = std::min(len, s.size - offset);
+            if (std::memcmp(s.data + offset, pattern, n) != 0) return false;
+
+            pattern += n;
+            len -= n;
+            offset = 0;
+
+            if (len == 0) return true;
+        }
+
+        return false; // the data ended before the pattern
+    }
+
+    template<class It>
+    size_t find_pattern(It first, It last, size_t start_pos, const uint8_t* pattern, size_t len)
+    {
+        size_t pos = 0;
+
+        // candidates are located by their first byte, so most of the data is only
+        // touched by the vectorized byte search
+        for (; first != last; ++first)
+        {
+            buffer_view::span s = *first;
+
+            if (start_pos >= s.size)
+            {
+                start_pos -= s.size;
+                pos += s.size;
+                continue;
+            }
+
+            if (len == 0) return pos + start_pos;
+
+            const uint8_t* end = s.data + s.size;
+
+            for (const uint8_t* p = find_byte(s.data + start_pos, end, pattern[0]);
+                 p != end;
+                 p = find_byte(p + 1, end, pattern[0]))
+            {
+                if (match_pattern(first, last, p - s.data, pattern, len))
+                    return pos + (p - s.data);
+            }
+
+            start_pos = 0;
+            pos += s.size;
+        }
+
+        return buffer_view::npos;
+    }
+};
+
+#endif // BYTE_SEARCH_HPP_INCLUDED
@@ -13,6 +13,7 @@
 using namespace gg;
 
 static const uint32_t gglib_magic_code = 0xdeadbeef;
+static const uint8_t compact_format_version = 2;
 
 
 class authentication
@@ -43,7 +44,7 @@ public:
 
     static bool serialize(const var& v, buffer* buf, const serializer* s)
     {
-        if (v.get_type() != typeid(authentication) || buf == nullptr || s == nullptr)
+        if (!v.is<authentication>() || buf == nullptr || s == nullptr)
             return false;
 
         const authentication& auth = v.get<authentication>();
@@ -73,6 +74,63 @@ public:
     }
 };
 
+/*
+ * Servers put the highest format version they support to the auth data of their
+ * authentication (older versions always leave it empty), then both ends send this
+ * as their last message in format v1. Everything after it uses the compact format
+ * with the type table it carries (see c_compact_serializer) in frames (TCP already
+ * checks the data, so they are sent without checksum).
+ */
+class wire_format
+{
+    uint8_t m_version;
+    std::vector<uint64_t> m_types;
+
+public:
+    wire_format(uint8_t version, std::vector<uint64_t> types)
+     : m_version(version), m_types(types) {}
+
+    wire_format(const wire_format& wf)
+     : m_version(wf.m_version), m_types(wf.m_types) {}
+
+    wire_format(wire_format&& wf)
+     : m_version(wf.m_version), m_types(std::move(wf.m_types)) {}
+
+    ~wire_format() {}
+
+    uint8_t get_version() const { return m_version; }
+    const std::vector<uint64_t>& get_type_table() const { return m_types; }
+
+    static bool serialize(const var& v, buffer* buf, const serializer* s)
+    {
+        if (!v.is<wire_format>() || buf == nullptr || s == nullptr)
+            return false;
+
+        const wire_format& wf = v.get<wire_format>();
+
+        buf->push(wf.get_version());
+        if (!write_length(buf, wf.get_type_table().size(), s)) return false;
+        buf->push(reinterpret_cast<const uint8_t*>(wf.get_type_table().data()), wf.get_type_table().size() * sizeof(uint64_t));
+
+        return true;
+    }
+
+    static optional<var> read(buffer_reader& rd, const serializer* s)
+    {
+        if (s == nullptr) return {};
+
+        uint8_t version;
+        size_t cnt;
+        if (!rd.read(version) || !read_length(rd, cnt, s) || rd.remaining() < cnt * sizeof(uint64_t))
+            return {};
+
+        std::vector<uint64_t> types(cnt);
+        rd.read(reinterpret_cast<uint8_t*>(types.data()), cnt * sizeof(uint64_t));
+
+        return wire_format(version, std::move(types));
+    }
+};
+
 template<bool is_request>
 class request_or_response
 {
@@ -97,7 +155,7 @@ public:
 
     static bool serialize(const var& v, buffer* buf, const serializer* s)
     {
-        if (v.get_type() != typeid(request_or_response) || buf == nullptr || s == nullptr)
+        if (!v.is<request_or_response>() || buf == nullptr || s == nullptr)
             return false;
 
         const request_or_response& req = v.get<request_or_response>();
@@ -141,7 +199,7 @@ public:
 
     static bool serialize(const var& v, buffer* buf, const serializer* s)
     {
-        if (v.get_type() != typeid(exec_request) || buf == nullptr || s == nullptr)
+        if (!v.is<exec_request>() || buf == nullptr || s == nullptr)
             return false;
 
         const exec_request& req = v.get<exec_request>();
@@ -182,7 +240,7 @@ public:
 
     static bool serialize(const var& v, buffer* buf, const serializer* s)
     {
-        if (v.get_type() != typeid(parse_and_exec_request) || buf == nullptr || s == nullptr)
+        if (!v.is<parse_and_exec_request>() || buf == nullptr || s == nullptr)
             return false;
 
         const parse_and_exec_request& req = v.get<parse_and_exec_request>();
@@ -223,7 +281,7 @@ public:
 
     static bool serialize(const var& v, buffer* buf, const serializer* s)
     {
-        if (v.get_type() != typeid(exec_response) || buf == nullptr || s == nullptr)
+        if (!v.is<exec_response>() || buf == nullptr || s == nullptr)
             return false;
 
         const exec_response& resp = v.get<exec_response>();
@@ -295,6 +353,9 @@ c_remote_application::c_remote_application(c_application* app, std::string addre
  , m_auth_data(auth_data)
  , m_err(c_logger::get_instance())
  , m_packet_err(0)
+ , m_output_format(nullptr)
+ , m_input_format(nullptr)
+ , m_incoming(nullptr)
 {
     m_app->application::grab();
     m_conn->set_packet_handler(this);
@@ -309,6 +370,9 @@ c_remote_application::c_remote_application(c_application* app, connection* conn)
  , m_remote_exec(true)
  , m_err(c_logger::get_instance())
  , m_packet_err(0)
+ , m_output_format(nullptr)
+ , m_input_format(nullptr)
+ , m_incoming(nullptr)
 {
     m_app->application::grab();
     m_conn->grab();
@@ -336,6 +400,9 @@ c_remote_application::~c_remote_application()
     disconnect();
     m_conn->drop();
     m_app->application::drop();
+    if (m_incoming != nullptr) m_incoming->drop();
+    delete m_output_format;
+    delete m_input_format;
 }
 
 application* c_remote_application::get_app() const
@@ -349,20 +416,62 @@ void c_remote_application::handle_packet(connection* conn)
 
     //tthread::lock_guard<tthread::recursive_mutex> guard(m_mutex);
 
-    optional<var> data = m_app->get_serializer()->deserialize(conn->get_input_buffer());
-    if (!data)
+    buffer* buf = conn->get_input_buffer();
+    bool handled = false;
+
+    // the packet can contain more messages, and the format can change between them
+    while (m_conn->is_opened() && buf->available() > 0)
     {
-        if (++m_packet_err > 3)
+        optional<var> data;
+
+        if (m_input_format != nullptr)
         {
-            *m_err << "Deserialization attempt failed 3 times.. dropping connection" << std::endl;
-            m_conn->close();
+            // compact messages are framed and decoded as they arrive (big strings and
+            // varlists don't have to be parsed again), but a broken one leaves the
+            // name dictionaries of the two ends out of sync
+            incremental_deserializer::status st = m_incoming->feed(buf);
+            if (st == incremental_deserializer::in_progress) return;
+
+            if (st == incremental_deserializer::broken)
+            {
+                *m_err << "Received a corrupt message.. dropping connection" << std::endl;
+                m_conn->close();
+                return;
+            }
+
+            data = m_incoming->get_result();
+            if (st == incremental_deserializer::failed)
+            {
+                if (++m_packet_err > 3)
+                {
+                    *m_err << "Deserialization attempt failed 3 times.. dropping connection" << std::endl;
+                    m_conn->close();
+                }
+                continue;
+            }
         }
-        return;
+        else
+        {
+            data = m_app->get_serializer()->deserialize(buf);
+            if (!data) break; // the rest hasn't arrived yet
+        }
+
+        m_packet_err = 0;
+        handled = true;
+        handle_message(*data);
     }
 
-    m_packet_err = 0;
+    // unframed messages can't tell an incomplete message from a broken one
+    if (!handled && m_input_format == nullptr && ++m_packet_err > 3)
+    {
+        *m_err << "Deserialization attempt failed 3 times.. dropping connection" << std::endl;
+        m_conn->close();
+    }
+}
 
-    if (data->get_type() == typeid(authentication))
+void c_remote_application::handle_message(var& data)
+{
+    if (data.is<authentication>())
     {
         if (m_auth_ok) // we are already authenticated
         {
@@ -372,7 +481,7 @@ void c_remote_application::handle_packet(connection* conn)
             return;
         }
 
-        authentication& auth = data->get<authentication>();
+        authentication& auth = data.get<authentication>();
 
         // magic code mismatch probably means different gglib protocol versions
         if (auth.get_magic_code() != gglib_magic_code)
@@ -401,12 +510,18 @@ void c_remote_application::handle_packet(connection* conn)
             m_auth_ok = true;
 
             // the remote end authenticated itself successfully, now it's our turn
-            send_var(authentication(gglib_magic_code, m_app->get_name(), {}));
+            send_var(authentication(gglib_magic_code, m_app->get_name(), compact_format_version));
         }
         else // client side
         {
+            // the server supports the compact format if it sent a version instead of auth data
+            var& auth_data = auth.get_auth_data();
+            bool compact = (auth_data.is<uint8_t>() && auth_data.get<uint8_t>() >= compact_format_version);
+
             m_name = std::move(auth.get_name());
-            m_auth_data = std::move(auth.get_auth_data());
+            m_auth_data = compact ? var() : std::move(auth_data);
+
+            if (compact) send_wire_format();
             m_auth_ok = true;
         }
 
@@ -420,7 +535,28 @@ void c_remote_application::handle_packet(connection* conn)
         m_conn->close();
         return;
     }
-    else if (data->get_type() == typeid(c_event))
+    else if (data.is<wire_format>())
+    {
+        wire_format& wf = data.get<wire_format>();
+
+        if (wf.get_version() != compact_format_version || m_input_format != nullptr)
+        {
+            *m_err << "Remote end sent an invalid wire format (" <<
+                m_conn->get_address() << ":" << m_conn->get_port() << ")" << std::endl;
+            m_conn->close();
+            return;
+        }
+
+        // the rest of the input is compact
+        c_serializer* srl = static_cast<c_serializer*>(m_app->get_serializer());
+        m_input_format = new c_compact_serializer(srl, wf.get_type_table());
+        m_incoming = m_input_format->create_incremental_deserializer(true);
+
+        // the server answers with its own type table (the client sent its one already)
+        send_wire_format();
+        return;
+    }
+    else if (data.is<c_event>())
     {
         c_event_manager* evtmgr = static_cast<c_event_manager*>(m_app->get_event_manager());
 
@@ -431,15 +567,15 @@ void c_remote_application::handle_packet(connection* conn)
             return;
         }
 
-        c_event evt = data->get<c_event>();
+        c_event evt = data.get<c_event>();
         evt.set_originator(this);
         evtmgr->push_event(std::move(evt));
 
         return;
     }
-    else if (data->get_type() == typeid(request))
+    else if (data.is<request>())
     {
-        request& req = data->get<request>();
+        request& req = data.get<request>();
 
         // if the request is handles..
         if (handle_request(req.get_data()))
@@ -450,9 +586,9 @@ void c_remote_application::handle_packet(connection* conn)
 
         return;
     }
-    else if (data->get_type() == typeid(response))
+    else if (data.is<response>())
     {
-        response& resp = data->get<response>();
+        response& resp = data.get<response>();
 
         tthread::lock_guard<tthread::recursive_mutex> guard(m_mutex);
 
@@ -496,12 +632,35 @@ void c_remote_application::handle_connection_close(connection* conn)
 bool c_remote_application::send_var(const var& data) const
 {
     if (!m_conn->is_opened()) return false;
-    return m_app->get_serializer()->serialize(data, m_conn->get_output_buffer());
+
+    tthread::lock_guard<tthread::mutex> guard(m_send_mutex);
+
+    if (m_output_format != nullptr)
+        return m_output_format->serialize_frame(data, m_conn->get_output_buffer(), false);
+    else
+        return m_app->get_serializer()->serialize(data, m_conn->get_output_buffer());
+}
+
+bool c_remote_application::send_wire_format()
+{
+    tthread::lock_guard<tthread::mutex> guard(m_send_mutex);
+
+    if (m_output_format != nullptr || !m_conn->is_opened()) return false;
+
+    // nothing is sent between the table and the switch to the compact format
+    c_serializer* srl = static_cast<c_serializer*>(m_app->get_serializer());
+    std::vector<uint64_t> types = srl->get_type_table();
+    var wf = wire_format(compact_format_version, types);
+
+    if (!m_app->get_serializer()->serialize(wf, m_conn->get_output_buffer())) return false;
+
+    m_output_format = new c_compact_serializer(srl, types);
+    return true;
 }
 
 bool c_remote_application::handle_request(var& data) const
 {
-    if (data.get_type() == typeid(exec_request))
+    if (data.is<exec_request>())
     {
         c_script_engine* se = static_cast<c_script_engine*>(m_app->get_script_engine());
 
@@ -523,7 +682,7 @@ bool c_remote_application::handle_request(var& data) const
         data = std::move( exec_response(std::move(*rv), ss) );
         return true;
     }
-    else if (data.get_type() == typeid(parse_and_exec_request))
+    else if (data.is<parse_and_exec_request>())
     {
         c_script_engine* se = static_cast<c_script_engine*>(m_app->get_script_engine());
 
@@ -735,13 +894,11 @@ void c_remote_application::push_event(event_type t, event::attribute_list al) co
 {
     if (!is_connected()) throw std::runtime_error("not connected to remote application");
 
-    serializer* srl = m_app->get_serializer();
-
     c_event e(nullptr, t, std::forward<event::attribute_list>(al));
     var v;
     v.reference(e);
 
-    if (!srl->serialize(v, m_conn->get_output_buffer()))
+    if (!send_var(v))
         throw std::runtime_error("event serialization error");
 }
 
@@ -811,6 +968,7 @@ c_application::c_application(std::string name)
     m_serializer->add_rule_ex(typeid(exec_request), &exec_request::serialize, &exec_request::deserialize);
     m_serializer->add_rule_ex(typeid(parse_and_exec_request), &parse_and_exec_request::serialize, &parse_and_exec_request::deserialize);
     m_serializer->add_rule_ex(typeid(exec_response), &exec_response::serialize, &exec_response::deserialize);
+    m_serializer->add_reader_rule(typeid(wire_format), &wire_format::serialize, &wire_format::read);
 
     if (sm_inst_cnt++ == 0) // first instance
     {
@@ -11,6 +11,8 @@
 namespace gg
 {
     class c_application;
+    class c_compact_serializer;
+    class incremental_deserializer;
 
     class c_remote_application : public remote_application, public packet_handler, public connection_handler
     {
@@ -27,9 +29,15 @@ namespace gg
         bool m_remote_exec;
         std::ostream* m_err;
         uint8_t m_packet_err;
+        mutable tthread::mutex m_send_mutex;
+        c_compact_serializer* m_output_format; // nullptr until the format is agreed on
+        c_compact_serializer* m_input_format;
+        incremental_deserializer* m_incoming; // decodes the compact input
 
     protected:
         bool send_var(const var& data) const;
+        bool send_wire_format();
+        void handle_message(var& data);
         bool handle_request(var& data) const;
         bool wait_for_authentication(uint32_t timeout) const;
 
@@ -1,40 +1,373 @@
+#include <algorithm>
+#include <cstring>
 #include <iomanip>
+#include <new>
 #include "c_buffer.hpp"
+#include "byte_search.hpp"
+#include "c_spsc_buffer.hpp"
+#include "c_buffer_pool.hpp"
+#include "c_buffer_registry.hpp"
+#include "c_mapped_buffer.hpp"
 
 using namespace gg;
 
+const size_t buffer::npos;
+const size_t c_buffer::chunk_size;
+const size_t c_buffer::min_shared_size;
+const size_t c_buffer::min_spliced_size;
 
-buffer* buffer::create()
+
+buffer* buffer::create(mode m)
+{
+    switch (m)
+    {
+        case mode::LOCK_FREE_SPSC:
+            return new c_spsc_buffer();
+
+        case mode::UNSYNCHRONIZED:
+            return new c_buffer(false);
+
+        case mode::SYNCHRONIZED:
+        default:
+            return new c_buffer(true);
+    }
+}
+
+
+buffer::pool_stats buffer::get_pool_stats()
+{
+    pool_stats stats = {0, 0, 0};
+    block_pool::chunks().get_stats(stats.hits, stats.misses, stats.bytes_retained);
+    block_pool::objects().get_stats(stats.hits, stats.misses, stats.bytes_retained);
+    return stats;
+}
+
+
+c_buffer::chunk* c_buffer::chunk::create(size_t capacity)
+{
+    block_pool& pool = block_pool::chunks();
+    chunk* c;
+
+    // chunks that fit into a pool block use the whole block
+    if (sizeof(chunk) + capacity <= pool.get_block_size())
+    {
+        c = static_cast<chunk*>(pool.allocate());
+        capacity = pool.get_block_size() - sizeof(chunk);
+    }
+    else
+    {
+        c = static_cast<chunk*>(::operator new(sizeof(chunk) + capacity));
+    }
+
+    c->m_next = nullptr;
+    c->m_capacity = capacity;
+    c->m_begin = 0;
+    c->m_end = 0;
+    c->m_file = nullptr;
+    c->m_offset = 0;
+    c->m_owner = nullptr;
+    return c;
+}
+
+c_buffer::chunk* c_buffer::chunk::create(c_spill_file* file)
+{
+    uint64_t offset;
+    chunk* c = static_cast<chunk*>(file->map_region(offset));
+
+    // the header of the chunk is stored in the mapped region too
+    file->grab();
+    c->m_next = nullptr;
+    c->m_capacity = c_spill_file::region_size - sizeof(chunk);
+    c->m_begin = 0;
+    c->m_end = 0;
+    c->m_file = file;
+    c->m_offset = offset;
+    c->m_owner = nullptr;
+    return c;
+}
+
+void c_buffer::chunk::destroy(chunk* c)
+{
+    block_pool& pool = block_pool::chunks();
+
+    if (c->m_file != nullptr)
+    {
+        c_spill_file* file = c->m_file;
+        file->unmap_region(c, c->m_offset);
+        file->drop();
+    }
+    else if (sizeof(chunk) + c->m_capacity == pool.get_block_size())
+    {
+        pool.release(c);
+    }
+    else
+    {
+        ::operator delete(static_cast<void*>(c));
+    }
+}
+
+
+void c_buffer::chunk::release(chunk* c)
+{
+    if (c->m_owner != nullptr) c->m_owner->drop();
+    else destroy(c);
+}
+
+bool c_buffer::chunk::is_shared() const
+{
+    return (m_owner != nullptr && m_owner->get_ref_count() > 1);
+}
+
+
+void* c_buffer::operator new(size_t size)
 {
-    return new c_buffer();
+    block_pool& pool = block_pool::objects();
+    if (size <= pool.get_block_size()) return pool.allocate();
+    else return ::operator new(size);
 }
 
-c_buffer::c_buffer()
+void c_buffer::operator delete(void* ptr, size_t size)
+{
+    block_pool& pool = block_pool::objects();
+    if (size <= pool.get_block_size()) pool.release(ptr);
+    else ::operator delete(ptr);
+}
+
+
+c_buffer::c_buffer(bool synchronized)
+ : m_synchronized(synchronized)
+ , m_head(nullptr)
+ , m_tail(nullptr)
+ , m_size(0)
+ , m_prepared(0)
+ , m_spill_threshold(0)
+ , m_spill_file(nullptr)
+ , m_usage(nullptr)
 {
 }
 
 c_buffer::~c_buffer()
 {
+    if (m_usage != nullptr) disable_tracking();
+    clear_unlocked();
+    if (m_spill_file != nullptr) m_spill_file->drop();
+}
+
+void c_buffer::update_usage(size_t pushed, size_t popped)
+{
+    m_usage->bytes_pushed += pushed;
+    m_usage->bytes_popped += popped;
+    m_usage->size = m_size;
+    m_usage->high_water_mark = std::max(m_usage->high_water_mark, m_size);
+}
+
+c_buffer::chunk* c_buffer::create_chunk(size_t capacity)
+{
+    // above the threshold new chunks are stored in a temporary file to save memory
+    if (m_spill_threshold > 0 && m_size >= m_spill_threshold &&
+        sizeof(chunk) + capacity <= c_spill_file::region_size)
+    {
+        if (m_spill_file == nullptr) m_spill_file = new c_spill_file();
+        return chunk::create(m_spill_file);
+    }
+
+    return chunk::create(capacity);
+}
+
+void c_buffer::push_unlocked(const uint8_t* buf, size_t len)
+{
+    for (size_t left = len; left > 0; )
+    {
+        if (m_tail == nullptr || m_tail->space() == 0)
+        {
+            chunk* c = create_chunk(chunk_size);
+            if (m_tail != nullptr) m_tail->m_next = c;
+            else m_head = c;
+            m_tail = c;
+        }
+
+        size_t n = std::min(left, m_tail->space());
+        std::memcpy(m_tail->end(), buf, n);
+        m_tail->m_end += n;
+        m_size += n;
+        buf += n;
+        left -= n;
+    }
+
+    track(len, 0);
+}
+
+size_t c_buffer::peek_unlocked(size_t start_pos, uint8_t* buf, size_t len) const
+{
+    if (start_pos >= m_size) return 0;
+
+    chunk* c = m_head;
+    size_t copied = 0;
+
+    // skipping the chunks before start_pos
+    while (start_pos >= c->size())
+    {
+        start_pos -= c->size();
+        c = c->m_next;
+    }
+
+    for (; c != nullptr && copied < len; c = c->m_next)
+    {
+        size_t n = std::min(len - copied, c->size() - start_pos);
+        std::memcpy(buf + copied, c->begin() + start_pos, n);
+        copied += n;
+        start_pos = 0;
+    }
+
+    return copied;
+}
+
+buffer_view c_buffer::view_unlocked(size_t start_pos, size_t len) const
+{
+    if (start_pos >= m_size) return {};
+
+    len = std::min(len, m_size - start_pos);
+    chunk* c = m_head;
+
+    while (start_pos >= c->size())
+    {
+        start_pos -= c->size();
+        c = c->m_next;
+    }
+
+    // the most common case is when the requested range fits into one chunk
+    if (c->size() - start_pos >= len)
+        return buffer_view(c->begin() + start_pos, len);
+
+    std::vector<buffer_view::span> spans;
+
+    for (; c != nullptr && len > 0; c = c->m_next)
+    {
+        size_t n = std::min(len, c->size() - start_pos);
+        spans.push_back({c->begin() + start_pos, n});
+        len -= n;
+        start_pos = 0;
+    }
+
+    return buffer_view(std::move(spans));
+}
+
+size_t c_buffer::find_unlocked(uint8_t byte, size_t start_pos) const
+{
+    if (start_pos >= m_size) return npos;
+
+    return find_byte(span_iterator {m_head}, span_iterator {nullptr}, start_pos, byte);
+}
+
+void c_buffer::advance_unlocked(size_t len)
+{
+    len = std::min(len, m_size);
+    m_size -= len;
+    track(0, len);
+
+    while (len > 0)
+    {
+        size_t n = std::min(len, m_head->size());
+        m_head->m_begin += n;
+        len -= n;
+
+        if (m_head->size() == 0)
+        {
+            if (m_head == m_tail)
+            {
+                // keeping the last chunk to avoid reallocation on next push, but it
+                // can only be rewound if nobody is writing or viewing it directly
+                if (m_prepared == 0 && !m_head->is_shared())
+                {
+                    m_head->m_begin = 0;
+                    m_head->m_end = 0;
+                }
+                break;
+            }
+
+            chunk* next = m_head->m_next;
+            chunk::release(m_head);
+            m_head = next;
+        }
+    }
+}
+
+void c_buffer::clear_unlocked()
+{
+    // the memory returned by prepare() has to stay valid until commit()
+    chunk* keep = (m_prepared > 0) ? m_tail : nullptr;
+
+    while (m_head != nullptr)
+    {
+        chunk* next = m_head->m_next;
+        if (m_head != keep) chunk::release(m_head);
+        m_head = next;
+    }
+
+    if (keep != nullptr)
+    {
+        keep->m_begin = keep->m_end;
+        m_head = keep;
+    }
+
+    size_t popped = m_size;
+    m_tail = keep;
+    m_size = 0;
+    track(0, popped);
+}
+
+bool c_buffer::is_synchronized() const
+{
+    return m_synchronized;
+}
+
+void c_buffer::truncate(size_t len)
+{
+    scoped_lock guard(this);
+
+    if (len >= m_size) return;
+
+    size_t removed = m_size - len;
+    chunk* c = m_head;
+
+    while (len > c->size())
+    {
+        len -= c->size();
+        c = c->m_next;
+    }
+
+    // the chunk of the cut is kept even if it becomes empty, the next push reuses it
+    c->m_end = c->m_begin + len;
+
+    for (chunk* next = c->m_next; next != nullptr; )
+    {
+        chunk* tmp = next->m_next;
+        chunk::release(next);
+        next = tmp;
+    }
+
+    c->m_next = nullptr;
+    m_tail = c;
+    m_size -= removed;
+    track(0, removed);
 }
 
 size_t c_buffer::available() const
 {
-    tthread::lock_guard<tthread::mutex> guard(m_mutex);
-    return m_data.size();
+    scoped_lock guard(this);
+    return m_size;
 }
 
 void c_buffer::advance(size_t len)
 {
-    tthread::lock_guard<tthread::mutex> guard(m_mutex);
-
-    auto it_begin = m_data.begin(), it_end = std::next(it_begin, len);
-    m_data.erase(it_begin, it_end);
+    scoped_lock guard(this);
+    advance_unlocked(len);
 }
 
 void c_buffer::clear()
 {
-    tthread::lock_guard<tthread::mutex> guard(m_mutex);
-    m_data.clear();
+    scoped_lock guard(this);
+    clear_unlocked();
 }
 
 buffer::byte_array c_buffer::peek(size_t len) const
@@ -44,12 +377,12 @@ buffer::byte_array c_buffer::peek(size_t len) const
 
 buffer::byte_array c_buffer::peek(size_t start_pos, size_t len) const
 {
-    tthread::lock_guard<tthread::mutex> guard(m_mutex);
+    scoped_lock guard(this);
 
-    byte_array r;
+    if (start_pos >= m_size) return {};
 
-    auto it_begin = std::next(m_data.begin(), start_pos), it_end = std::next(it_begin, len);
-    r.insert(r.begin(), it_begin, it_end);
+    byte_array r(std::min(len, m_size - start_pos));
+    peek_unlocked(start_pos, r.data(), r.size());
 
     return std::move(r);
 }
@@ -58,103 +391,158 @@ size_t c_buffer::peek(uint8_t* buf, size_t len) const
 {
     if (buf == nullptr || len == 0) return 0;
 
-    tthread::lock_guard<tthread::mutex> guard(m_mutex);
-
-    auto it = m_data.begin(), end = m_data.end();
-    size_t i = 0;
-
-    for (; it != end && i < len; ++it, ++i)
-    {
-        buf[i] = *it;
-    }
-
-    return i;
+    scoped_lock guard(this);
+    return peek_unlocked(0, buf, len);
 }
 
 size_t c_buffer::peek(size_t start_pos, uint8_t* buf, size_t len) const
 {
     if (buf == nullptr || len == 0) return 0;
 
-    tthread::lock_guard<tthread::mutex> guard(m_mutex);
-
-    if (start_pos > m_data.size()) return 0;
-
-    auto it = std::next(m_data.begin(), start_pos), end = m_data.end();
-    size_t i = 0;
+    scoped_lock guard(this);
+    return peek_unlocked(start_pos, buf, len);
+}
 
-    for (; it != end && i < len; ++it, ++i)
-    {
-        buf[i] = *it;
-    }
+buffer_view c_buffer::view(size_t len) const
+{
+    scoped_lock guard(this);
+    return view_unlocked(0, len);
+}
 
-    return i;
+buffer_view c_buffer::view(size_t start_pos, size_t len) const
+{
+    scoped_lock guard(this);
+    return view_unlocked(start_pos, len);
 }
 
 void c_buffer::push(uint8_t byte)
 {
-    m_data.push_back(byte);
+    scoped_lock guard(this);
+    push_unlocked(&byte, 1);
 }
 
 void c_buffer::push(const uint8_t* buf, size_t len)
 {
-    tthread::lock_guard<tthread::mutex> guard(m_mutex);
+    if (buf == nullptr || len == 0) return;
 
-    for(size_t i = 0; i < len; ++i)
-        m_data.push_back(buf[i]);
+    scoped_lock guard(this);
+    push_unlocked(buf, len);
 }
 
 void c_buffer::push(const byte_array& buf)
 {
-    tthread::lock_guard<tthread::mutex> guard(m_mutex);
-    m_data.insert(m_data.end(), buf.begin(), buf.end());
+    scoped_lock guard(this);
+    push_unlocked(buf.data(), buf.size());
 }
 
 void c_buffer::push(const buffer* _buf)
 {
-    const c_buffer* buf = static_cast<const c_buffer*>(_buf);
-    if (buf == nullptr) return;
+    if (_buf == nullptr) return;
+
+    grab_guard bufgrab(_buf);
+    const c_buffer* buf = dynamic_cast<const c_buffer*>(_buf);
+
+    if (buf == nullptr) // not our implementation, copying through a view
+    {
+        buffer_view vw = _buf->view(_buf->available());
+
+        scoped_lock guard(this);
+        for (size_t i = 0, spans = vw.span_count(); i < spans; ++i)
+            push_unlocked(vw.get_span(i).data, vw.get_span(i).size);
 
-    grab_guard bufgrab(buf);
-    tthread::lock_guard<tthread::mutex> guard1(m_mutex);
-    tthread::lock_guard<tthread::mutex> guard2(buf->m_mutex);
+        return;
+    }
+
+    scoped_lock guard1(this);
+    scoped_lock guard2(buf);
 
-    m_data.insert(m_data.end(), buf->m_data.begin(), buf->m_data.end());
+    for (chunk* c = buf->m_head; c != nullptr; c = c->m_next)
+        push_unlocked(c->begin(), c->size());
 }
 
 void c_buffer::merge(buffer* _buf)
 {
-    c_buffer* buf = static_cast<c_buffer*>(_buf);
-    if (buf == nullptr) return;
+    if (_buf == nullptr) return;
+
+    grab_guard bufgrab(_buf);
+    c_buffer* buf = dynamic_cast<c_buffer*>(_buf);
+
+    if (buf == nullptr) // not our implementation, falling back to copy
+    {
+        buffer_view vw = _buf->view(_buf->available());
+
+        {
+            scoped_lock guard(this);
+            for (size_t i = 0, spans = vw.span_count(); i < spans; ++i)
+                push_unlocked(vw.get_span(i).data, vw.get_span(i).size);
+        }
+
+        // only dropping what was copied, the other buffer might be written meanwhile
+        _buf->advance(vw.size());
+        return;
+    }
+
+    scoped_lock guard1(this);
+    scoped_lock guard2(buf);
 
-    grab_guard bufgrab(buf);
-    tthread::lock_guard<tthread::mutex> guard1(m_mutex);
-    tthread::lock_guard<tthread::mutex> guard2(buf->m_mutex);
+    if (buf->m_size == 0) return;
 
-    m_data.insert(m_data.end(),
-                  std::make_move_iterator(buf->m_data.begin()),
-                  std::make_move_iterator(buf->m_data.end()));
+    // the memory returned by prepare() has to stay valid until commit(), so that chunk stays there
+    chunk* keep = (buf->m_prepared > 0) ? buf->m_tail : nullptr;
+    size_t moved = buf->m_size;
+
+    for (chunk* c = buf->m_head; c != nullptr; )
+    {
+        chunk* next = c->m_next;
+
+        if (c == keep || c->size() < min_spliced_size || (m_tail != nullptr && c->size() <= m_tail->space()))
+        {
+            // copying the bytes of a mostly empty chunk, so small merges don't pin whole chunks
+            push_unlocked(c->begin(), c->size());
+            if (c == keep) c->m_begin = c->m_end;
+            else chunk::release(c);
+        }
+        else
+        {
+            // handing over the chunk instead of copying its bytes
+            if (m_size == 0) clear_unlocked();
+
+            c->m_next = nullptr;
+            if (m_tail != nullptr) m_tail->m_next = c;
+            else m_head = c;
+
+            m_tail = c;
+            m_size += c->size();
+            track(c->size(), 0);
+        }
+
+        c = next;
+    }
+
+    buf->m_head = keep;
+    buf->m_tail = keep;
+    buf->m_size = 0;
+    buf->track(0, moved);
 }
 
 optional<uint8_t> c_buffer::pop()
 {
-    tthread::lock_guard<tthread::mutex> guard(m_mutex);
+    scoped_lock guard(this);
 
-    if (m_data.empty()) return {};
+    if (m_size == 0) return {};
 
-    uint8_t r = m_data.front();
-    m_data.pop_front();
+    uint8_t r = *m_head->begin();
+    advance_unlocked(1);
     return r;
 }
 
 buffer::byte_array c_buffer::pop(size_t len)
 {
-    tthread::lock_guard<tthread::mutex> guard(m_mutex);
-
-    byte_array r;
+    scoped_lock guard(this);
 
-    auto it_begin = m_data.begin(), it_end = std::next(it_begin, len);
-    r.insert(r.begin(), it_begin, it_end);
-    m_data.erase(it_begin, it_end);
+    byte_array r(std::min(len, m_size));
+    peek_unlocked(0, r.data(), r.size());
+    advance_unlocked(r.size());
 
     return std::move(r);
 }
@@ -163,33 +551,190 @@ size_t c_buffer::pop(uint8_t* buf, size_t len)
 {
     if (buf == nullptr || len == 0) return 0;
 
-    tthread::lock_guard<tthread::mutex> guard(m_mutex);
+    scoped_lock guard(this);
+
+    len = peek_unlocked(0, buf, len);
+    advance_unlocked(len);
+
+    return len;
+}
+
+size_t c_buffer::find(uint8_t byte, size_t start_pos) const
+{
+    scoped_lock guard(this);
+    return find_unlocked(byte, start_pos);
+}
+
+size_t c_buffer::find(const uint8_t* pattern, size_t len, size_t start_pos) const
+{
+    if (pattern == nullptr && len > 0) return npos;
+
+    scoped_lock guard(this);
+
+    if (start_pos >= m_size || len > m_size - start_pos) return npos;
+
+    return find_pattern(span_iterator {m_head}, span_iterator {nullptr}, start_pos, pattern, len);
+}
+
+buffer::byte_array c_buffer::pop_until(uint8_t delim)
+{
+    scoped_lock guard(this);
 
-    auto it = m_data.begin(), end = m_data.end();
-    size_t i = 0;
+    size_t pos = find_unlocked(delim, 0);
+    if (pos == npos) return {};
 
-    for (; it != end && i < len; ++it, ++i)
+    byte_array r(pos + 1);
+    peek_unlocked(0, r.data(), r.size());
+    advance_unlocked(r.size());
+
+    return r;
+}
+
+uint8_t* c_buffer::prepare(size_t len)
+{
+    scoped_lock guard(this);
+
+    if (m_tail == nullptr || m_tail->space() < len)
     {
-        buf[i] = *it;
+        chunk* c = create_chunk(std::max(len, chunk_size));
+
+        if (m_size == 0)
+        {
+            m_prepared = 0;
+            clear_unlocked();
+            m_head = c;
+        }
+        else
+        {
+            m_tail->m_next = c;
+        }
+
+        m_tail = c;
     }
 
-    m_data.erase(m_data.begin(), it);
+    m_prepared = m_tail->space();
+    return m_tail->end();
+}
+
+void c_buffer::commit(size_t len)
+{
+    scoped_lock guard(this);
+
+    // without prepare() there might not be a tail chunk at all
+    if (m_prepared == 0) return;
+
+    len = std::min(len, m_prepared);
+    m_tail->m_end += len;
+    m_size += len;
+    m_prepared = 0;
+    track(len, 0);
+}
+
+buffer_view::span c_buffer::data() const
+{
+    scoped_lock guard(this);
 
-    return i;
+    if (m_size == 0) return {nullptr, 0};
+    else return {m_head->begin(), m_head->size()};
 }
 
+shared_view c_buffer::share(size_t start_pos, size_t len) const
+{
+    scoped_lock guard(this);
+
+    if (start_pos >= m_size) return {};
+
+    len = std::min(len, m_size - start_pos);
+    chunk* c = m_head;
+    size_t offset = start_pos;
+
+    while (offset >= c->size())
+    {
+        offset -= c->size();
+        c = c->m_next;
+    }
+
+    // spilled chunks are unmapped with the buffer's file, so they are never shared
+    if (len < min_shared_size || c->m_file != nullptr || c->size() - offset < len)
+        return shared_view(view_unlocked(start_pos, len));
 
-std::ostream& gg::operator<< (std::ostream& o, const buffer& _buf)
+    if (c->m_owner == nullptr) c->m_owner = new chunk_owner(c);
+    return shared_view(c->m_owner, c->begin() + offset, len);
+}
+
+size_t c_buffer::gather(buffer_view::span* spans, size_t max_spans, size_t len) const
+{
+    if (spans == nullptr) return 0;
+
+    scoped_lock guard(this);
+
+    size_t cnt = 0;
+    len = std::min(len, m_size);
+
+    for (chunk* c = m_head; c != nullptr && cnt < max_spans && len > 0; c = c->m_next)
+    {
+        size_t n = std::min(len, c->size());
+        if (n == 0) continue;
+
+        spans[cnt++] = {c->begin(), n};
+        len -= n;
+    }
+
+    return cnt;
+}
+
+void c_buffer::set_spill_threshold(size_t threshold)
+{
+    scoped_lock guard(this);
+    m_spill_threshold = threshold;
+}
+
+void c_buffer::enable_tracking(std::string owner)
+{
+    {
+        scoped_lock guard(this);
+
+        if (m_usage == nullptr) m_usage = new usage_stats {{}, 0, 0, m_size, m_size, 0};
+        m_usage->owner = owner;
+    }
+
+    c_buffer_registry::get_instance().add(this);
+}
+
+void c_buffer::disable_tracking()
+{
+    c_buffer_registry::get_instance().remove(this);
+
+    scoped_lock guard(this);
+
+    delete m_usage;
+    m_usage = nullptr;
+}
+
+buffer::usage_stats c_buffer::get_usage_stats() const
+{
+    scoped_lock guard(this);
+
+    if (m_usage != nullptr) return *m_usage;
+    else return {};
+}
+
+
+std::ostream& gg::operator<< (std::ostream& o, const buffer& buf)
 {
     std::ios state(NULL);
-    const c_buffer* buf = static_cast<const c_buffer*>(&_buf);
+    buffer_view vw = buf.view(buf.available());
     int i = 0;
 
     state.copyfmt(o);
     o << std::setfill('0') << std::hex;
-    for (uint8_t c : buf->m_data)
-        o << std::setw(2) << (int)c
-          << ((++i % 8 == 0) ? "\n" : " ");
+    for (size_t s = 0, spans = vw.span_count(); s < spans; ++s)
+    {
+        const buffer_view::span& sp = vw.get_span(s);
+        for (const uint8_t* p = sp.data; p != sp.data + sp.size; ++p)
+            o << std::setw(2) << (int)*p
+              << ((++i % 8 == 0) ? "\n" : " ");
+    }
     o.copyfmt(state);
 
     return o;
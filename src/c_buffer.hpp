@@ -1,21 +1,113 @@
 #ifndef C_BUFFER_HPP_INCLUDED
 #define C_BUFFER_HPP_INCLUDED
 
-#include <deque>
 #include "tinythread.h"
 #include "gg/buffer.hpp"
 
 namespace gg
 {
+    class c_spill_file;
+
     class c_buffer : public buffer
     {
+        class chunk_owner;
+
+        struct chunk
+        {
+            chunk* m_next;
+            size_t m_capacity;
+            size_t m_begin;
+            size_t m_end;
+            c_spill_file* m_file; // only set if the chunk is stored in a file
+            uint64_t m_offset;
+            chunk_owner* m_owner; // only set once the chunk is shared (see share)
+
+            uint8_t* begin() { return reinterpret_cast<uint8_t*>(this + 1) + m_begin; }
+            uint8_t* end() { return reinterpret_cast<uint8_t*>(this + 1) + m_end; }
+            size_t size() const { return m_end - m_begin; }
+            size_t space() const { return m_capacity - m_end; }
+
+            static chunk* create(size_t capacity);
+            static chunk* create(c_spill_file*);
+            static void destroy(chunk*);
+            static void release(chunk*); // destroys the chunk once it's not shared anymore
+            bool is_shared() const;
+        };
+
+        // shared_views keep the chunk alive with this, while the buffer holds one reference
+        class chunk_owner : public reference_counted
+        {
+            chunk* m_chunk;
+
+        public:
+            chunk_owner(chunk* c) : m_chunk(c) {}
+            ~chunk_owner() { chunk::destroy(m_chunk); }
+        };
+
+        // walks the readable bytes of the chunks for the search functions
+        struct span_iterator
+        {
+            chunk* m_chunk;
+
+            buffer_view::span operator* () const { return {m_chunk->begin(), m_chunk->size()}; }
+            span_iterator& operator++ () { m_chunk = m_chunk->m_next; return *this; }
+            bool operator!= (const span_iterator& it) const { return m_chunk != it.m_chunk; }
+        };
+
+        // locks the buffer's mutex unless the buffer is unsynchronized
+        class scoped_lock
+        {
+            tthread::mutex* m_mutex;
+
+        public:
+            scoped_lock(const c_buffer* buf) : m_mutex(buf->m_synchronized ? &buf->m_mutex : nullptr)
+            {
+                if (m_mutex == nullptr) return;
+                m_mutex->lock();
+                if (buf->m_usage != nullptr) ++buf->m_usage->lock_count;
+            }
+            scoped_lock(const scoped_lock&) = delete;
+            ~scoped_lock() { if (m_mutex) m_mutex->unlock(); }
+        };
+
+        static const size_t chunk_size = 4096;
+        static const size_t min_shared_size = 256; // shorter ranges are copied by share()
+        static const size_t min_spliced_size = chunk_size / 4; // merge() copies chunks with less data
+
         mutable tthread::mutex m_mutex;
-        std::deque<uint8_t> m_data;
+        bool m_synchronized;
+        chunk* m_head;
+        chunk* m_tail;
+        size_t m_size;
+        size_t m_prepared;
+        size_t m_spill_threshold;
+        c_spill_file* m_spill_file;
+        usage_stats* m_usage; // only allocated if tracking is enabled
+
+        void track(size_t pushed, size_t popped) { if (m_usage != nullptr) update_usage(pushed, popped); }
+        void update_usage(size_t pushed, size_t popped);
+        chunk* create_chunk(size_t capacity);
+        void push_unlocked(const uint8_t* buf, size_t len);
+        size_t peek_unlocked(size_t start_pos, uint8_t* buf, size_t len) const;
+        buffer_view view_unlocked(size_t start_pos, size_t len) const;
+        size_t find_unlocked(uint8_t byte, size_t start_pos) const;
+        void advance_unlocked(size_t len);
+        void clear_unlocked();
 
     public:
-        c_buffer();
+        c_buffer(bool synchronized = true);
+        c_buffer(const c_buffer&) = delete;
+        c_buffer(c_buffer&&) = delete;
         ~c_buffer();
 
+        bool is_synchronized() const;
+        // drops the bytes after the first 'len' ones (used to undo a failed write,
+        // so nothing else may use the buffer between the write and the truncation)
+        void truncate(size_t len);
+
+        static void* operator new(size_t size);
+        static void operator delete(void* ptr, size_t size);
+
         size_t available() const;
         void advance(size_t len);
         void clear();
@@ -25,6 +117,9 @@ namespace gg
         size_t peek(uint8_t* buf, size_t len) const;
         size_t peek(size_t start_pos, uint8_t* buf, size_t len) const;
 
+        buffer_view view(size_t len) const;
+        buffer_view view(size_t start_pos, size_t len) const;
+
         void push(uint8_t byte);
         void push(const uint8_t* buf, size_t len);
         void push(const byte_array& buf);
@@ -35,8 +130,21 @@ namespace gg
         byte_array pop(size_t len);
         size_t pop(uint8_t* buf, size_t len);
 
-        friend std::ostream& operator<< (std::ostream&, const buffer&);
-        friend std::ostream& operator<< (std::ostream&, const buffer*);
+        size_t find(uint8_t byte, size_t start_pos = 0) const;
+        size_t find(const uint8_t* pattern, size_t len, size_t start_pos = 0) const;
+        byte_array pop_until(uint8_t delim);
+
+        uint8_t* prepare(size_t len);
+        void commit(size_t len);
+        buffer_view::span data() const;
+        shared_view share(size_t start_pos, size_t len) const;
+        size_t gather(buffer_view::span* spans, size_t max_spans, size_t len) const;
+
+        void set_spill_threshold(size_t threshold);
+
+        void enable_tracking(std::string owner);
+        void disable_tracking();
+        usage_stats get_usage_stats() const;
     };
 };
 
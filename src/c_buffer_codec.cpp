@@ -0,0 +1,390 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include "c_buffer_codec.hpp"
+
+using namespace gg;
+using namespace std::chrono;
+
+const size_t buffer_codec::max_block_size;
+const int buffer_codec::min_level;
+const int buffer_codec::max_level;
+const size_t c_lz_codec::header_size;
+const uint32_t c_lz_codec::stored_flag;
+thread_local std::vector<uint32_t> c_lz_codec::sm_table;
+thread_local std::vector<uint8_t> c_lz_codec::sm_block;
+
+static const size_t min_match = 4;
+static const size_t last_literals = 5;   // the last bytes of a block are always literals
+static const size_t match_limit = 12;    // the last match has to start this far from the end
+static const size_t max_offset = 65535;
+static const uint32_t no_pos = 0xFFFFFFFF;
+
+
+static uint32_t read32(const uint8_t* p)
+{
+    uint32_t val;
+    std::memcpy(&val, p, sizeof(uint32_t));
+    return val;
+}
+
+static uint32_t read_le32(const uint8_t* p)
+{
+    return (p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24));
+}
+
+static void write_le32(uint8_t* p, uint32_t val)
+{
+    p[0] = val & 0xFF;
+    p[1] = (val >> 8) & 0xFF;
+    p[2] = (val >> 16) & 0xFF;
+    p[3] = (val >> 24) & 0xFF;
+}
+
+static size_t compress_bound(size_t len)
+{
+    return (len + len / 255 + 16);
+}
+
+static uint8_t* write_length(uint8_t* op, size_t len)
+{
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = static_cast<uint8_t>(len);
+    return op;
+}
+
+static uint8_t* write_sequence(uint8_t* op, const uint8_t* literals, size_t lit_len, size_t offset, size_t match_len)
+{
+    uint8_t* token = op++;
+    size_t ml = match_len - min_match;
+
+    *token = static_cast<uint8_t>((std::min<size_t>(lit_len, 15) << 4) | std::min<size_t>(ml, 15));
+    if (lit_len >= 15) op = write_length(op, lit_len - 15);
+
+    std::memcpy(op, literals, lit_len);
+    op += lit_len;
+
+    *op++ = offset & 0xFF;
+    *op++ = (offset >> 8) & 0xFF;
+
+    if (ml >= 15) op = write_length(op, ml - 15);
+    return op;
+}
+
+/*
+ * Greedy LZ77 with a bucketed hash table: every bucket remembers the last 'ways'
+ * positions of a 4 byte sequence (most recent first) and the longest of them wins.
+ * If nothing matches for a while, the scan starts skipping bytes, which keeps
+ * incompressible data cheap. Returns the size of the sequences written to 'dest',
+ * which needs room for compress_bound(len) bytes.
+ */
+static size_t compress(const uint8_t* src, size_t len, uint8_t* dest, std::vector<uint32_t>& table, size_t ways)
+{
+    const uint8_t* ip = src;
+    const uint8_t* anchor = src;
+    uint8_t* op = dest;
+
+    if (len > match_limit)
+    {
+        const uint8_t* ilimit = src + len - match_limit;
+        const uint8_t* mlimit = src + len - last_literals;
+
+        // smaller blocks use a smaller part of the table, so it's faster to reset
+        unsigned hash_bits = 8;
+        while (hash_bits < 12 && ((size_t)1 << hash_bits) < len / 4) ++hash_bits;
+
+        std::fill(table.begin(), table.begin() + (ways << hash_bits), no_pos);
+
+        auto get_bucket = [&](const uint8_t* p)
+        {
+            return &table[((read32(p) * 2654435761U) >> (32 - hash_bits)) * ways];
+        };
+
+        auto insert = [&](uint32_t* bucket, const uint8_t* p)
+        {
+            std::memmove(bucket + 1, bucket, (ways - 1) * sizeof(uint32_t));
+            bucket[0] = p - src;
+        };
+
+        size_t misses = 0;
+
+        while (ip < ilimit)
+        {
+            uint32_t* bucket = get_bucket(ip);
+            const uint8_t* match = nullptr;
+            size_t match_len = 0;
+
+            for (size_t i = 0; i < ways && bucket[i] != no_pos; ++i)
+            {
+                const uint8_t* cand = src + bucket[i];
+                if ((size_t)(ip - cand) > max_offset) break; // the older ones are even further
+                if (read32(cand) != read32(ip)) continue;
+
+                const uint8_t* p = ip + min_match;
+                const uint8_t* q = cand + min_match;
+                while (p < mlimit && *p == *q) { ++p; ++q; }
+
+                if ((size_t)(p - ip) > match_len)
+                {
+                    match = cand;
+                    match_len = p - ip;
+                }
+            }
+
+            insert(bucket, ip);
+
+            if (match == nullptr)
+            {
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+
+            // extending the match backwards into the pending literals
+            while (ip > anchor && match > src && ip[-1] == match[-1])
+            {
+                --ip;
+                --match;
+                ++match_len;
+            }
+
+            op = write_sequence(op, anchor, ip - anchor, ip - match, match_len);
+            ip += match_len;
+            anchor = ip;
+            misses = 0;
+
+            if (ip < ilimit) insert(get_bucket(ip - 2), ip - 2);
+        }
+    }
+
+    // remaining literals
+    size_t lit_len = src + len - anchor;
+    *op++ = static_cast<uint8_t>(std::min<size_t>(lit_len, 15) << 4);
+    if (lit_len >= 15) op = write_length(op, lit_len - 15);
+    std::memcpy(op, anchor, lit_len);
+    op += lit_len;
+
+    return (op - dest);
+}
+
+static bool read_length(const uint8_t*& ip, const uint8_t* iend, size_t& len)
+{
+    uint8_t b;
+
+    do
+    {
+        if (ip == iend) return false;
+        b = *ip++;
+        len += b;
+    }
+    while (b == 255);
+
+    return true;
+}
+
+// every offset and length is checked, so corrupt data can't write outside of 'dest'
+static bool decompress(const uint8_t* src, size_t len, uint8_t* dest, size_t raw_len)
+{
+    const uint8_t* ip = src;
+    const uint8_t* iend = src + len;
+    uint8_t* op = dest;
+    uint8_t* oend = dest + raw_len;
+
+    for (;;)
+    {
+        if (ip == iend) return false;
+
+        uint8_t token = *ip++;
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && !read_length(ip, iend, lit_len)) return false;
+        if (lit_len > (size_t)(iend - ip) || lit_len > (size_t)(oend - op)) return false;
+
+        std::memcpy(op, ip, lit_len);
+        op += lit_len;
+        ip += lit_len;
+
+        if (ip == iend) break; // the last sequence has no match
+        if (iend - ip < 2) return false;
+
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dest)) return false;
+
+        size_t match_len = token & 15;
+        if (match_len == 15 && !read_length(ip, iend, match_len)) return false;
+        match_len += min_match;
+        if (match_len > (size_t)(oend - op)) return false;
+
+        // an overlapping match repeats the last 'offset' bytes, so it's copied in steps
+        // that don't overlap (any multiple of the offset works as a distance)
+        while (match_len > 0)
+        {
+            size_t n = std::min(offset, match_len);
+            std::memcpy(op, op - offset, n);
+            op += n;
+            match_len -= n;
+            if (offset < 4096) offset *= 2;
+        }
+    }
+
+    return (op == oend);
+}
+
+
+buffer_codec* buffer_codec::create(size_t block_size, int level)
+{
+    return new c_lz_codec(block_size, level);
+}
+
+
+c_lz_codec::c_lz_codec(size_t block_size, int level)
+ : m_block_size(std::min(std::max(block_size, (size_t)1024), max_block_size))
+ , m_level(std::min(std::max(level, min_level), max_level))
+ , m_stats {}
+{
+}
+
+c_lz_codec::~c_lz_codec()
+{
+}
+
+size_t c_lz_codec::get_block_size() const
+{
+    return m_block_size;
+}
+
+int c_lz_codec::get_level() const
+{
+    return m_level;
+}
+
+size_t c_lz_codec::encode(buffer* src, buffer* dest)
+{
+    if (src == nullptr || dest == nullptr || src->available() == 0) return 0;
+
+    auto start = steady_clock::now();
+    std::vector<uint8_t>& block = sm_block;
+    std::vector<uint32_t>& table = sm_table;
+    size_t input = 0;
+    size_t output = 0;
+    size_t blocks = 0;
+
+    if (table.size() < ((size_t)m_level << 12))
+        table.resize((size_t)m_level << 12);
+
+    while (size_t len = std::min(src->available(), m_block_size))
+    {
+        // the block has to be contiguous, it's only copied if it spans multiple chunks
+        buffer_view::span sp = src->data();
+        const uint8_t* raw = sp.data;
+        if (sp.size < len)
+        {
+            block.resize(len);
+            src->peek(block.data(), len);
+            raw = block.data();
+        }
+
+        uint8_t* out = dest->prepare(header_size + compress_bound(len));
+        size_t enc_len = compress(raw, len, out + header_size, table, m_level);
+        uint32_t flags = 0;
+
+        if (enc_len >= len) // not worth it
+        {
+            std::memcpy(out + header_size, raw, len);
+            enc_len = len;
+            flags = stored_flag;
+        }
+
+        write_le32(out, enc_len | flags);
+        write_le32(out + 4, len);
+        dest->commit(header_size + enc_len);
+        src->consume(len);
+
+        input += len;
+        output += header_size + enc_len;
+        ++blocks;
+    }
+
+    uint64_t elapsed = duration_cast<microseconds>(steady_clock::now() - start).count();
+
+    tthread::lock_guard<tthread::mutex> guard(m_mutex);
+    m_stats.encoded_blocks += blocks;
+    m_stats.encode_input += input;
+    m_stats.encode_output += output;
+    m_stats.encode_time_us += elapsed;
+
+    return output;
+}
+
+size_t c_lz_codec::decode(buffer* src, buffer* dest)
+{
+    if (src == nullptr || dest == nullptr) return 0;
+
+    auto start = steady_clock::now();
+    std::vector<uint8_t> block;
+    size_t input = 0;
+    size_t output = 0;
+    size_t blocks = 0;
+
+    while (src->available() >= header_size)
+    {
+        uint8_t header[header_size];
+        src->peek(header, header_size);
+
+        uint32_t enc_len = read_le32(header);
+        uint32_t raw_len = read_le32(header + 4);
+        bool stored = (enc_len & stored_flag);
+        enc_len &= ~stored_flag;
+
+        if (raw_len == 0 || raw_len > max_block_size || enc_len > compress_bound(raw_len) ||
+            (stored && enc_len != raw_len))
+            throw std::runtime_error("corrupt compressed block header");
+
+        if (src->available() < header_size + enc_len) break; // the rest hasn't arrived yet
+
+        buffer_view vw = src->view(header_size, enc_len);
+        const uint8_t* in = vw.data();
+        if (in == nullptr)
+        {
+            block.resize(enc_len);
+            vw.copy(block.data(), enc_len);
+            in = block.data();
+        }
+
+        uint8_t* out = dest->prepare(raw_len);
+
+        if (stored)
+        {
+            std::memcpy(out, in, raw_len);
+        }
+        else if (!decompress(in, enc_len, out, raw_len))
+        {
+            dest->commit(0);
+            throw std::runtime_error("corrupt compressed block");
+        }
+
+        dest->commit(raw_len);
+        src->consume(header_size + enc_len);
+
+        input += header_size + enc_len;
+        output += raw_len;
+        ++blocks;
+    }
+
+    uint64_t elapsed = duration_cast<microseconds>(steady_clock::now() - start).count();
+
+    tthread::lock_guard<tthread::mutex> guard(m_mutex);
+    m_stats.decoded_blocks += blocks;
+    m_stats.decode_input += input;
+    m_stats.decode_output += output;
+    m_stats.decode_time_us += elapsed;
+
+    return output;
+}
+
+buffer_codec::stats c_lz_codec::get_stats() const
+{
+    tthread::lock_guard<tthread::mutex> guard(m_mutex);
+    return m_stats;
+}
@@ -0,0 +1,43 @@
+#ifndef C_BUFFER_CODEC_HPP_INCLUDED
+#define C_BUFFER_CODEC_HPP_INCLUDED
+
+#include <vector>
+#include "tinythread.h"
+#include "gg/buffer.hpp"
+
+namespace gg
+{
+    /*
+     * Block layout: 4 bytes encoded size (the highest bit is set if the block is
+     * stored uncompressed), 4 bytes raw size, then the LZ4 sequences of the block.
+     * Blocks don't reference each other, so the codec itself is stateless apart
+     * from the statistics and can be used by multiple threads. The scratch memory
+     * of encode() belongs to the thread and is reused by every codec.
+     */
+    class c_lz_codec : public buffer_codec
+    {
+        static const size_t header_size = 8;
+        static const uint32_t stored_flag = 0x80000000;
+        static thread_local std::vector<uint32_t> sm_table; // match finder, reset for every block
+        static thread_local std::vector<uint8_t> sm_block;  // blocks that span multiple chunks
+
+        mutable tthread::mutex m_mutex;
+        size_t m_block_size;
+        int m_level;
+        stats m_stats;
+
+    public:
+        c_lz_codec(size_t block_size, int level);
+        c_lz_codec(const c_lz_codec&) = delete;
+        c_lz_codec(c_lz_codec&&) = delete;
+        ~c_lz_codec();
+
+        size_t get_block_size() const;
+        int get_level() const;
+        size_t encode(buffer* src, buffer* dest);
+        size_t decode(buffer* src, buffer* dest);
+        stats get_stats() const;
+    };
+};
+
+#endif // C_BUFFER_CODEC_HPP_INCLUDED
@@ -0,0 +1,249 @@
+#include <algorithm>
+#include <new>
+#include <stdexcept>
+#include "c_buffer_pool.hpp"
+
+using namespace gg;
+
+const size_t block_pool::max_pools;
+thread_local block_pool::thread_cache* block_pool::sm_caches[block_pool::max_pools];
+thread_local block_pool::cache_reaper block_pool::sm_reaper;
+thread_local bool block_pool::sm_reaped = false;
+atomic<size_t> block_pool::sm_pool_cnt(0);
+
+
+block_pool::thread_cache::thread_cache(block_pool* pool)
+ : m_pool(pool)
+ , m_blocks(nullptr)
+ , m_count(0)
+ , m_hits(0)
+ , m_misses(0)
+ , m_prev(nullptr)
+ , m_next(nullptr)
+{
+}
+
+block_pool::cache_reaper::~cache_reaper()
+{
+    for (size_t i = 0; i < max_pools; ++i)
+    {
+        if (sm_caches[i] != nullptr)
+        {
+            sm_caches[i]->m_pool->detach(sm_caches[i]);
+            sm_caches[i] = nullptr;
+        }
+    }
+
+    sm_reaped = true;
+}
+
+
+block_pool::block_pool(size_t block_size, size_t thread_limit, size_t global_limit)
+ : m_index(sm_pool_cnt++)
+ , m_block_size(std::max(block_size, sizeof(free_block)))
+ , m_thread_limit(thread_limit)
+ , m_global_limit(global_limit)
+ , m_blocks(nullptr)
+ , m_count(0)
+ , m_hits(0)
+ , m_misses(0)
+ , m_caches(nullptr)
+{
+    if (m_index >= max_pools)
+        throw std::runtime_error("too many block pools");
+}
+
+block_pool::~block_pool()
+{
+    while (m_blocks != nullptr)
+    {
+        free_block* next = m_blocks->m_next;
+        ::operator delete(static_cast<void*>(m_blocks));
+        m_blocks = next;
+    }
+}
+
+block_pool::thread_cache* block_pool::get_cache()
+{
+    thread_cache* cache = sm_caches[m_index];
+    if (cache != nullptr) return cache;
+
+    // the thread has already finished its cleanup, the global free list is used directly
+    if (sm_reaped) return nullptr;
+
+    (void)&sm_reaper; // making sure the reaper is constructed for this thread
+
+    cache = new thread_cache(this);
+
+    tthread::lock_guard<tthread::mutex> guard(m_mutex);
+    cache->m_next = m_caches;
+    if (m_caches != nullptr) m_caches->m_prev = cache;
+    m_caches = cache;
+
+    sm_caches[m_index] = cache;
+    return cache;
+}
+
+void block_pool::detach(thread_cache* cache)
+{
+    tthread::lock_guard<tthread::mutex> guard(m_mutex);
+
+    while (cache->m_blocks != nullptr)
+    {
+        free_block* next = cache->m_blocks->m_next;
+        release_unlocked(cache->m_blocks);
+        cache->m_blocks = next;
+    }
+
+    m_hits += cache->m_hits.load();
+    m_misses += cache->m_misses.load();
+
+    if (cache->m_prev != nullptr) cache->m_prev->m_next = cache->m_next;
+    else m_caches = cache->m_next;
+    if (cache->m_next != nullptr) cache->m_next->m_prev = cache->m_prev;
+
+    delete cache;
+}
+
+void block_pool::flush(thread_cache* cache, size_t keep)
+{
+    tthread::lock_guard<tthread::mutex> guard(m_mutex);
+
+    size_t cnt = cache->m_count.load();
+    for (; cnt > keep; --cnt)
+    {
+        free_block* next = cache->m_blocks->m_next;
+        release_unlocked(cache->m_blocks);
+        cache->m_blocks = next;
+    }
+
+    cache->m_count.store(cnt);
+}
+
+void block_pool::refill(thread_cache* cache)
+{
+    tthread::lock_guard<tthread::mutex> guard(m_mutex);
+
+    size_t cnt = cache->m_count.load();
+    for (; m_blocks != nullptr && cnt < m_thread_limit / 2; ++cnt)
+    {
+        free_block* block = m_blocks;
+        m_blocks = block->m_next;
+        --m_count;
+
+        block->m_next = cache->m_blocks;
+        cache->m_blocks = block;
+    }
+
+    cache->m_count.store(cnt);
+}
+
+void block_pool::release_unlocked(free_block* block)
+{
+    if (m_count < m_global_limit)
+    {
+        block->m_next = m_blocks;
+        m_blocks = block;
+        ++m_count;
+    }
+    else
+    {
+        ::operator delete(static_cast<void*>(block));
+    }
+}
+
+size_t block_pool::get_block_size() const
+{
+    return m_block_size;
+}
+
+void* block_pool::allocate()
+{
+    thread_cache* cache = get_cache();
+
+    if (cache == nullptr)
+    {
+        tthread::lock_guard<tthread::mutex> guard(m_mutex);
+
+        if (m_blocks != nullptr)
+        {
+            free_block* block = m_blocks;
+            m_blocks = block->m_next;
+            --m_count;
+            ++m_hits;
+            return block;
+        }
+
+        ++m_misses;
+    }
+    else
+    {
+        if (cache->m_blocks == nullptr) refill(cache);
+
+        if (cache->m_blocks != nullptr)
+        {
+            free_block* block = cache->m_blocks;
+            cache->m_blocks = block->m_next;
+            cache->m_count.store(cache->m_count.load() - 1);
+            cache->m_hits.store(cache->m_hits.load() + 1);
+            return block;
+        }
+
+        cache->m_misses.store(cache->m_misses.load() + 1);
+    }
+
+    return ::operator new(m_block_size);
+}
+
+void block_pool::release(void* ptr)
+{
+    if (ptr == nullptr) return;
+
+    free_block* block = static_cast<free_block*>(ptr);
+    thread_cache* cache = get_cache();
+
+    if (cache == nullptr)
+    {
+        tthread::lock_guard<tthread::mutex> guard(m_mutex);
+        release_unlocked(block);
+        return;
+    }
+
+    block->m_next = cache->m_blocks;
+    cache->m_blocks = block;
+    cache->m_count.store(cache->m_count.load() + 1);
+
+    if (cache->m_count.load() > m_thread_limit)
+        flush(cache, m_thread_limit / 2);
+}
+
+void block_pool::get_stats(size_t& hits, size_t& misses, size_t& bytes_retained)
+{
+    tthread::lock_guard<tthread::mutex> guard(m_mutex);
+
+    size_t blocks = m_count;
+    hits += m_hits;
+    misses += m_misses;
+
+    for (thread_cache* cache = m_caches; cache != nullptr; cache = cache->m_next)
+    {
+        blocks += cache->m_count.load();
+        hits += cache->m_hits.load();
+        misses += cache->m_misses.load();
+    }
+
+    bytes_retained += blocks * m_block_size;
+}
+
+block_pool& block_pool::chunks()
+{
+    // 4 KB of data per block plus room for the header of the chunk
+    static block_pool* pool = new block_pool(4096 + 64, 64, 256);
+    return *pool;
+}
+
+block_pool& block_pool::objects()
+{
+    static block_pool* pool = new block_pool(256, 64, 256);
+    return *pool;
+}
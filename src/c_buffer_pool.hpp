@@ -0,0 +1,82 @@
+#ifndef C_BUFFER_POOL_HPP_INCLUDED
+#define C_BUFFER_POOL_HPP_INCLUDED
+
+#include "tinythread.h"
+#include "gg/atomic.hpp"
+
+namespace gg
+{
+    /*
+     * Recycles memory blocks of a fixed size. Every thread has its own free list,
+     * so allocation and release don't need locking. If a thread's free list grows
+     * too long, half of it is moved to the global free list (or back to the heap if
+     * the global list is full too), and an empty thread free list is refilled from
+     * the global one. The pools themselves are never destroyed, because threads can
+     * return their blocks even after main() has finished.
+     */
+    class block_pool
+    {
+        struct free_block
+        {
+            free_block* m_next;
+        };
+
+        struct thread_cache
+        {
+            block_pool* m_pool;
+            free_block* m_blocks;
+            atomic<size_t> m_count;
+            atomic<size_t> m_hits;
+            atomic<size_t> m_misses;
+            thread_cache* m_prev;
+            thread_cache* m_next;
+
+            thread_cache(block_pool*);
+        };
+
+        // detaches the thread's caches from their pools when the thread finishes
+        struct cache_reaper
+        {
+            ~cache_reaper();
+        };
+
+        static const size_t max_pools = 4;
+        static thread_local thread_cache* sm_caches[max_pools];
+        static thread_local cache_reaper sm_reaper;
+        static thread_local bool sm_reaped;
+        static atomic<size_t> sm_pool_cnt;
+
+        tthread::mutex m_mutex;
+        const size_t m_index;
+        const size_t m_block_size;
+        const size_t m_thread_limit;
+        const size_t m_global_limit;
+        free_block* m_blocks;
+        size_t m_count;
+        size_t m_hits;
+        size_t m_misses;
+        thread_cache* m_caches;
+
+        thread_cache* get_cache();
+        void detach(thread_cache*);
+        void flush(thread_cache*, size_t keep);
+        void refill(thread_cache*);
+        void release_unlocked(free_block*);
+
+    public:
+        block_pool(size_t block_size, size_t thread_limit, size_t global_limit);
+        block_pool(const block_pool&) = delete;
+        block_pool(block_pool&&) = delete;
+        ~block_pool();
+
+        size_t get_block_size() const;
+        void* allocate();
+        void release(void*);
+        void get_stats(size_t& hits, size_t& misses, size_t& bytes_retained);
+
+        static block_pool& chunks();  // memory of buffer contents
+        static block_pool& objects(); // buffer objects themselves
+    };
+};
+
+#endif // C_BUFFER_POOL_HPP_INCLUDED
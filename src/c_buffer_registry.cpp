@@ -0,0 +1,59 @@
+#include <algorithm>
+#include <iostream>
+#include "c_buffer_registry.hpp"
+
+using namespace gg;
+
+
+std::vector<buffer::usage_stats> buffer::get_tracked_buffers()
+{
+    return c_buffer_registry::get_instance().get_usage_stats();
+}
+
+void buffer::dump_tracked_buffers(std::ostream& o)
+{
+    for (const usage_stats& u : get_tracked_buffers())
+    {
+        o << u.owner << ": size " << u.size
+          << ", high water mark " << u.high_water_mark
+          << ", pushed " << u.bytes_pushed
+          << ", popped " << u.bytes_popped
+          << ", locks " << u.lock_count << std::endl;
+    }
+}
+
+
+c_buffer_registry& c_buffer_registry::get_instance()
+{
+    // never destroyed, buffers can be released after main() has finished
+    static c_buffer_registry* registry = new c_buffer_registry();
+    return *registry;
+}
+
+void c_buffer_registry::add(const buffer* buf)
+{
+    tthread::lock_guard<tthread::mutex> guard(m_mutex);
+    m_buffers.insert(buf);
+}
+
+void c_buffer_registry::remove(const buffer* buf)
+{
+    tthread::lock_guard<tthread::mutex> guard(m_mutex);
+    m_buffers.erase(buf);
+}
+
+std::vector<buffer::usage_stats> c_buffer_registry::get_usage_stats()
+{
+    tthread::lock_guard<tthread::mutex> guard(m_mutex);
+
+    std::vector<buffer::usage_stats> stats;
+    stats.reserve(m_buffers.size());
+
+    for (const buffer* buf : m_buffers)
+        stats.push_back(buf->get_usage_stats());
+
+    std::sort(stats.begin(), stats.end(),
+              [](const buffer::usage_stats& a, const buffer::usage_stats& b) { return a.owner < b.owner; });
+
+    return stats;
+}
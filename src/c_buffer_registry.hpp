@@ -0,0 +1,32 @@
+#ifndef C_BUFFER_REGISTRY_HPP_INCLUDED
+#define C_BUFFER_REGISTRY_HPP_INCLUDED
+
+#include <set>
+#include "tinythread.h"
+#include "gg/buffer.hpp"
+
+namespace gg
+{
+    /*
+     * Keeps track of the buffers with tracking enabled. A buffer has to be removed
+     * before it's destroyed, and it can't hold its own lock while being added or
+     * removed, because get_tracked_buffers() locks the buffers while holding the
+     * lock of the registry.
+     */
+    class c_buffer_registry
+    {
+        tthread::mutex m_mutex;
+        std::set<const buffer*> m_buffers;
+
+        c_buffer_registry() = default;
+
+    public:
+        static c_buffer_registry& get_instance();
+
+        void add(const buffer*);
+        void remove(const buffer*);
+        std::vector<buffer::usage_stats> get_usage_stats();
+    };
+};
+
+#endif // C_BUFFER_REGISTRY_HPP_INCLUDED
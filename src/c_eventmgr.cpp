@@ -49,30 +49,62 @@ public:
 };
 
 
-bool serialize_event_type(const var& v, buffer* buf)
+bool serialize_event_type(const var& v, buffer* buf, const serializer* s)
 {
-    if (buf == nullptr || v.get_type() != typeid(event_type))
+    if (buf == nullptr || !v.is<event_type>())
         return false;
 
     const event_type& e = v.get<event_type>();
     size_t hash_code = e.get_hash();
 
+    // the hash is calculated from the name, so format v2 only sends it without one
+    if (s != nullptr && s->get_format_version() >= 2)
+    {
+        std::string name = e.get_name();
+        if (!write_name(buf, name, s)) return false;
+
+        if (name.empty())
+        {
+            uint64_t hash64 = hash_code;
+            buf->push(reinterpret_cast<const uint8_t*>(&hash64), sizeof(uint64_t));
+        }
+
+        return true;
+    }
+
     buf->push(reinterpret_cast<const uint8_t*>(&hash_code), sizeof(size_t));
-    if (!serialize_string(e.get_name(), buf)) return false;
+    if (!write_name(buf, e.get_name(), s)) return false;
 
     return true;
 }
 
-optional<var> deserialize_event_type(buffer* buf)
+optional<var> read_event_type(buffer_reader& rd, const serializer* s)
 {
-    if (buf == nullptr || buf->available() == 0) return {};
+    size_t start = rd.position();
+    std::string name;
+
+    if (s != nullptr && s->get_format_version() >= 2)
+    {
+        if (read_name(rd, name, s))
+        {
+            if (!name.empty()) return event_type(name);
+
+            uint64_t hash64;
+            if (rd.read(hash64)) return event_type(static_cast<size_t>(hash64));
+        }
+
+        rd.rewind(start);
+        return {};
+    }
 
     size_t hash_code;
-    if (buf->pop(reinterpret_cast<uint8_t*>(&hash_code), sizeof(size_t)) != sizeof(size_t)) return {};
+    if (!rd.read(hash_code)) return {};
 
-    optional<var> opt_name = deserialize_string(buf);
-    if (!opt_name || opt_name->get_type() != typeid(std::string)) return {};
-    std::string name = opt_name->get<std::string>();
+    if (!read_name(rd, name, s))
+    {
+        rd.rewind(start);
+        return {};
+    }
 
     if (name.empty()) return event_type(hash_code);
     else return event_type(name);
@@ -80,21 +112,21 @@ optional<var> deserialize_event_type(buffer* buf)
 
 bool serialize_event(const var& v, buffer* buf, const serializer* s)
 {
-    if (buf == nullptr || s == nullptr || v.get_type() != typeid(c_event))
+    if (buf == nullptr || s == nullptr || !v.is<c_event>())
         return false;
 
     const c_event& e = v.get<c_event>();
     return e.serialize(buf, s);
 }
 
-optional<var> deserialize_event(buffer* buf, const serializer* s)
+optional<var> read_event(buffer_reader& rd, const serializer* s)
 {
-    if (buf == nullptr || buf->available() == 0 || s == nullptr) return {};
+    if (s == nullptr) return {};
 
     try
     {
         var v;
-        v.construct<c_event>(nullptr, buf, s);
+        v.construct<c_event>(nullptr, rd, s);
         return std::move(v);
     }
     catch (std::exception& e)
@@ -107,9 +139,12 @@ optional<var> deserialize_event(buffer* buf, const serializer* s)
 c_event::c_event(remote_application* orig, event_type t, event::attribute_list&& al)
  : m_orig(orig)
  , m_type(t)
- , m_attributes(al)
+ , m_attributes(std::move(al))
 {
     if (m_orig != nullptr) m_orig->grab();
+
+    // copies of the event (listeners, event tasks, peers) share the attribute values
+    for (auto& attr : m_attributes) attr.second.share();
 }
 
 c_event::c_event(const c_event& e)
@@ -117,6 +152,7 @@ c_event::c_event(const c_event& e)
  , m_type(e.m_type)
  , m_attributes(e.m_attributes)
 {
+    if (m_orig != nullptr) m_orig->grab();
 }
 
 c_event::c_event(c_event&& e)
@@ -124,6 +160,7 @@ c_event::c_event(c_event&& e)
  , m_type(std::move(e.m_type))
  , m_attributes(std::move(e.m_attributes))
 {
+    e.m_orig = nullptr;
 }
 
 c_event::~c_event()
@@ -131,42 +168,40 @@ c_event::~c_event()
     if (m_orig != nullptr) m_orig->drop();
 }
 
-c_event::c_event(remote_application* orig, buffer* buf, const serializer* s) // deserialize
+c_event::c_event(remote_application* orig, buffer_reader& rd, const serializer* s) // deserialize
  : m_orig(orig)
  , m_type(static_cast<size_t>(0))
 {
-    if (buf == nullptr || buf->available() == 0 || s == nullptr)
+    if (s == nullptr)
         throw std::runtime_error("unable to deserialize event");
 
-    grab_guard bufgrab(buf);
-
     /*size_t hash_code;
     if (buf->pop(reinterpret_cast<uint8_t*>(&hash_code), sizeof(size_t)) != sizeof(size_t))
         throw std::runtime_error("unable to deserialize event");
 
     m_type = event_type(hash_code);*/
 
-    optional<var> opt_event_type = deserialize_event_type(buf);
-    if (!opt_event_type || opt_event_type->get_type() != typeid(event_type))
+    optional<var> opt_event_type = read_event_type(rd, s);
+    if (!opt_event_type || !opt_event_type->is<event_type>())
         throw std::runtime_error("unable to deserialize event");
 
     m_type = opt_event_type->get<event_type>();
 
-    optional<uint8_t> attrcnt = buf->pop();
-    if (!attrcnt)
+    uint8_t attr_count;
+    if (!rd.read(attr_count))
         throw std::runtime_error("unable to deserialize event");
 
-    uint8_t attr_count = attrcnt.get();
-
     for (uint8_t i = 0; i < attr_count; ++i)
     {
-        optional<var> attr = deserialize_string(buf);
-        optional<var> val = s->deserialize(buf);
+        std::string attr;
+        if (!read_name(rd, attr, s))
+            throw std::runtime_error("unable to deserialize event");
 
-        if (!attr || !val || attr->get_type() != typeid(std::string))
+        optional<var> val = s->deserialize(rd);
+        if (!val)
             throw std::runtime_error("unable to deserialize event");
 
-        add(std::move(attr->get<std::string>()), std::move(*val));
+        add(std::move(attr), std::move(*val));
     }
 }
 
@@ -178,7 +213,7 @@ bool c_event::serialize(buffer* buf, const serializer* s) const
 
     //size_t hash_code = m_type.get_hash();
     //buf->push(reinterpret_cast<uint8_t*>(&hash_code), sizeof(size_t));
-    if (!serialize_event_type(m_type, buf)) return false;
+    if (!serialize_event_type(m_type, buf, s)) return false;
 
     uint8_t attr_count = m_attributes.size();
     buf->push(attr_count);
@@ -186,7 +221,7 @@ bool c_event::serialize(buffer* buf, const serializer* s) const
     auto it = m_attributes.begin(), end = m_attributes.end();
     for (; it != end; ++it)
     {
-        if (!serialize_string(it->first, buf)) return false;
+        if (!write_name(buf, it->first, s)) return false;
         if (!s->serialize(it->second, buf)) return false;
     }
 
@@ -212,7 +247,9 @@ event_type c_event::get_type() const
 
 void c_event::add(std::string addr, var val)
 {
-    m_attributes[addr] = val;
+    var& attr = m_attributes[addr];
+    attr = std::move(val);
+    attr.share();
 }
 
 const var& c_event::operator[] (std::string attr) const
@@ -338,8 +375,8 @@ c_event_manager::c_event_manager(application* app)
  : m_app(app)
  , m_thread("event manager")
 {
-    m_app->get_serializer()->add_rule<event_type>(serialize_event_type, deserialize_event_type);
-    m_app->get_serializer()->add_rule_ex<c_event>(serialize_event, deserialize_event);
+    m_app->get_serializer()->add_reader_rule<event_type>(serialize_event_type, read_event_type);
+    m_app->get_serializer()->add_reader_rule<c_event>(serialize_event, read_event);
 }
 
 c_event_manager::~c_event_manager()
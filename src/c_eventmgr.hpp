@@ -17,7 +17,7 @@ namespace gg
 
     public:
         c_event(remote_application*, event_type, event::attribute_list&& = {});
-        c_event(remote_application*, buffer*, const serializer*); // deserialize
+        c_event(remote_application*, buffer_reader&, const serializer*); // deserialize
         c_event(const c_event&);
         c_event(c_event&&);
         ~c_event();
@@ -69,9 +69,9 @@ bool id::comparator::operator() (const id& a, const id& b) const
     return (static_cast<uint32_t>(a) < static_cast<uint32_t>(b));
 }
 
-bool serialize_id(const var& v, buffer* buf)
+bool serialize_id(const var& v, buffer* buf, const serializer*)
 {
-    if (buf == nullptr || v.get_type() != typeid(id))
+    if (buf == nullptr || !v.is<id>())
         return false;
 
     uint32_t _id = static_cast<uint32_t>(v.get<id>());
@@ -80,12 +80,10 @@ bool serialize_id(const var& v, buffer* buf)
     return true;
 }
 
-optional<var> deserialize_id(buffer* buf)
+optional<var> read_id(buffer_reader& rd, const serializer*)
 {
-    if (buf == nullptr || buf->available() < sizeof(uint32_t)) return {};
-
     uint32_t _id;
-    buf->pop(reinterpret_cast<uint8_t*>(&_id), sizeof(uint32_t));
+    if (!rd.read(_id)) return {};
 
     return var(id(_id));
 }
@@ -96,7 +94,7 @@ c_id_manager::c_id_manager(application* app)
  //, m_gen(m_rd())
  , m_dis(0, UINT_MAX)
 {
-    m_app->get_serializer()->add_rule<id>(serialize_id, deserialize_id);
+    m_app->get_serializer()->add_reader_rule<id>(serialize_id, read_id);
 }
 
 c_id_manager::~c_id_manager()
@@ -0,0 +1,484 @@
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include "c_mapped_buffer.hpp"
+#include "byte_search.hpp"
+#include "c_buffer_registry.hpp"
+
+using namespace gg;
+
+const size_t c_mapped_buffer::min_capacity;
+const size_t c_spill_file::region_size;
+
+
+buffer* buffer::create_mapped(std::string path, size_t size)
+{
+    return new c_mapped_buffer(path, size);
+}
+
+
+c_mapped_buffer::c_mapped_buffer(std::string path, size_t size)
+ : m_path(path)
+ , m_read_only(false)
+ , m_file(INVALID_HANDLE_VALUE)
+ , m_mapping(NULL)
+ , m_data(nullptr)
+ , m_capacity(0)
+ , m_begin(0)
+ , m_end(0)
+ , m_prepared(0)
+ , m_usage(nullptr)
+{
+    open(size);
+}
+
+c_mapped_buffer::~c_mapped_buffer()
+{
+    if (m_usage != nullptr) disable_tracking();
+
+    unmap();
+
+    if (!m_read_only)
+    {
+        // cutting off the unused part of the mapping
+        LARGE_INTEGER pos;
+        pos.QuadPart = m_end;
+        SetFilePointerEx(m_file, pos, NULL, FILE_BEGIN);
+        SetEndOfFile(m_file);
+    }
+
+    CloseHandle(m_file);
+}
+
+void c_mapped_buffer::open(size_t size)
+{
+    m_file = CreateFile(m_path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS,
+                        FILE_ATTRIBUTE_NORMAL, NULL);
+
+    if (m_file == INVALID_HANDLE_VALUE) // maybe we can still read it
+    {
+        m_file = CreateFile(m_path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                            FILE_ATTRIBUTE_NORMAL, NULL);
+        m_read_only = true;
+    }
+
+    if (m_file == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("unable to open file: " + m_path);
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(m_file, &file_size))
+    {
+        CloseHandle(m_file);
+        throw std::runtime_error("unable to get file size: " + m_path);
+    }
+
+    // the existing contents of the file are readable
+    m_end = file_size.QuadPart;
+
+    try
+    {
+        if (m_read_only) map(m_end);
+        else map(std::max(std::max(size, m_end), min_capacity));
+    }
+    catch (...)
+    {
+        CloseHandle(m_file);
+        throw;
+    }
+}
+
+void c_mapped_buffer::map(size_t capacity)
+{
+    if (capacity == 0) return; // empty read-only file, nothing to map
+
+    uint64_t size = capacity;
+    m_mapping = CreateFileMapping(m_file, NULL, m_read_only ? PAGE_READONLY : PAGE_READWRITE,
+                                  (DWORD)(size >> 32), (DWORD)(size & 0xFFFFFFFF), NULL);
+    if (m_mapping == NULL)
+        throw std::runtime_error("unable to create file mapping: " + m_path);
+
+    m_data = static_cast<uint8_t*>(MapViewOfFile(m_mapping, m_read_only ? FILE_MAP_READ : FILE_MAP_WRITE, 0, 0, capacity));
+    if (m_data == nullptr)
+    {
+        CloseHandle(m_mapping);
+        m_mapping = NULL;
+        throw std::runtime_error("unable to map file: " + m_path);
+    }
+
+    m_capacity = capacity;
+}
+
+void c_mapped_buffer::unmap()
+{
+    if (m_data != nullptr) UnmapViewOfFile(m_data);
+    if (m_mapping != NULL) CloseHandle(m_mapping);
+
+    m_data = nullptr;
+    m_mapping = NULL;
+    m_capacity = 0;
+}
+
+void c_mapped_buffer::reserve_unlocked(size_t len)
+{
+    if (m_read_only)
+        throw std::runtime_error("buffer is read-only: " + m_path);
+
+    if (m_capacity - m_end >= len) return;
+
+    size_t capacity = std::max(m_capacity, min_capacity);
+    while (capacity - m_end < len) capacity *= 2;
+
+    unmap();
+    map(capacity);
+}
+
+void c_mapped_buffer::advance_unlocked(size_t len)
+{
+    len = std::min(len, m_end - m_begin);
+    m_begin += len;
+    track(0, len);
+}
+
+void c_mapped_buffer::track(size_t pushed, size_t popped)
+{
+    if (m_usage == nullptr) return;
+
+    m_usage->bytes_pushed += pushed;
+    m_usage->bytes_popped += popped;
+    m_usage->size = m_end - m_begin;
+    m_usage->high_water_mark = std::max(m_usage->high_water_mark, m_usage->size);
+}
+
+std::string c_mapped_buffer::get_path() const
+{
+    return m_path;
+}
+
+size_t c_mapped_buffer::available() const
+{
+    scoped_lock guard(this);
+    return (m_end - m_begin);
+}
+
+void c_mapped_buffer::advance(size_t len)
+{
+    scoped_lock guard(this);
+    advance_unlocked(len);
+}
+
+void c_mapped_buffer::clear()
+{
+    scoped_lock guard(this);
+    advance_unlocked(m_end - m_begin);
+}
+
+buffer::byte_array c_mapped_buffer::peek(size_t len) const
+{
+    return peek((size_t)0, len);
+}
+
+buffer::byte_array c_mapped_buffer::peek(size_t start_pos, size_t len) const
+{
+    scoped_lock guard(this);
+
+    if (start_pos >= m_end - m_begin) return {};
+
+    const uint8_t* p = m_data + m_begin + start_pos;
+    return byte_array(p, p + std::min(len, m_end - m_begin - start_pos));
+}
+
+size_t c_mapped_buffer::peek(uint8_t* buf, size_t len) const
+{
+    return peek((size_t)0, buf, len);
+}
+
+size_t c_mapped_buffer::peek(size_t start_pos, uint8_t* buf, size_t len) const
+{
+    if (buf == nullptr || len == 0) return 0;
+
+    scoped_lock guard(this);
+
+    if (start_pos >= m_end - m_begin) return 0;
+
+    len = std::min(len, m_end - m_begin - start_pos);
+    std::memcpy(buf, m_data + m_begin + start_pos, len);
+    return len;
+}
+
+buffer_view c_mapped_buffer::view(size_t len) const
+{
+    return view((size_t)0, len);
+}
+
+buffer_view c_mapped_buffer::view(size_t start_pos, size_t len) const
+{
+    scoped_lock guard(this);
+
+    if (start_pos >= m_end - m_begin) return {};
+
+    return buffer_view(m_data + m_begin + start_pos, std::min(len, m_end - m_begin - start_pos));
+}
+
+void c_mapped_buffer::push(uint8_t byte)
+{
+    push(&byte, 1);
+}
+
+void c_mapped_buffer::push(const uint8_t* buf, size_t len)
+{
+    if (buf == nullptr || len == 0) return;
+
+    scoped_lock guard(this);
+
+    reserve_unlocked(len);
+    std::memcpy(m_data + m_end, buf, len);
+    m_end += len;
+    track(len, 0);
+}
+
+void c_mapped_buffer::push(const byte_array& buf)
+{
+    push(buf.data(), buf.size());
+}
+
+void c_mapped_buffer::push(const buffer* buf)
+{
+    if (buf == nullptr) return;
+
+    grab_guard bufgrab(buf);
+    buffer_view vw = buf->view(buf->available());
+
+    scoped_lock guard(this);
+
+    reserve_unlocked(vw.size());
+    m_end += vw.copy(m_data + m_end, vw.size());
+    track(vw.size(), 0);
+}
+
+void c_mapped_buffer::merge(buffer* buf)
+{
+    if (buf == nullptr) return;
+
+    grab_guard bufgrab(buf);
+    buffer_view vw = buf->view(buf->available());
+
+    {
+        scoped_lock guard(this);
+
+        reserve_unlocked(vw.size());
+        m_end += vw.copy(m_data + m_end, vw.size());
+        track(vw.size(), 0);
+    }
+
+    buf->advance(vw.size());
+}
+
+optional<uint8_t> c_mapped_buffer::pop()
+{
+    scoped_lock guard(this);
+
+    if (m_begin == m_end) return {};
+
+    uint8_t r = m_data[m_begin];
+    advance_unlocked(1);
+    return r;
+}
+
+buffer::byte_array c_mapped_buffer::pop(size_t len)
+{
+    scoped_lock guard(this);
+
+    const uint8_t* p = m_data + m_begin;
+    byte_array r(p, p + std::min(len, m_end - m_begin));
+    advance_unlocked(r.size());
+
+    return r;
+}
+
+size_t c_mapped_buffer::pop(uint8_t* buf, size_t len)
+{
+    if (buf == nullptr || len == 0) return 0;
+
+    scoped_lock guard(this);
+
+    len = std::min(len, m_end - m_begin);
+    std::memcpy(buf, m_data + m_begin, len);
+    advance_unlocked(len);
+
+    return len;
+}
+
+size_t c_mapped_buffer::find(uint8_t byte, size_t start_pos) const
+{
+    scoped_lock guard(this);
+
+    if (start_pos >= m_end - m_begin) return npos;
+
+    const uint8_t* p = find_byte(m_data + m_begin + start_pos, m_data + m_end, byte);
+    return (p != m_data + m_end) ? (p - m_data - m_begin) : npos;
+}
+
+size_t c_mapped_buffer::find(const uint8_t* pattern, size_t len, size_t start_pos) const
+{
+    scoped_lock guard(this);
+
+    if (m_begin == m_end) return npos;
+
+    return buffer_view(m_data + m_begin, m_end - m_begin).find(pattern, len, start_pos);
+}
+
+buffer::byte_array c_mapped_buffer::pop_until(uint8_t delim)
+{
+    scoped_lock guard(this);
+
+    const uint8_t* p = m_data + m_begin;
+    const uint8_t* delim_pos = find_byte(p, m_data + m_end, delim);
+    if (delim_pos == m_data + m_end) return {};
+
+    byte_array r(p, delim_pos + 1);
+    advance_unlocked(r.size());
+
+    return r;
+}
+
+uint8_t* c_mapped_buffer::prepare(size_t len)
+{
+    scoped_lock guard(this);
+
+    reserve_unlocked(len);
+    m_prepared = m_capacity - m_end;
+    return (m_data + m_end);
+}
+
+void c_mapped_buffer::commit(size_t len)
+{
+    scoped_lock guard(this);
+
+    len = std::min(len, m_prepared);
+    m_end += len;
+    m_prepared = 0;
+    track(len, 0);
+}
+
+buffer_view::span c_mapped_buffer::data() const
+{
+    scoped_lock guard(this);
+
+    if (m_begin == m_end) return {nullptr, 0};
+    else return {m_data + m_begin, m_end - m_begin};
+}
+
+size_t c_mapped_buffer::gather(buffer_view::span* spans, size_t max_spans, size_t len) const
+{
+    if (spans == nullptr || max_spans == 0) return 0;
+
+    scoped_lock guard(this);
+
+    if (m_begin == m_end || len == 0) return 0;
+
+    spans[0] = {m_data + m_begin, std::min(len, m_end - m_begin)};
+    return 1;
+}
+
+void c_mapped_buffer::set_spill_threshold(size_t)
+{
+    // already stored in a file
+}
+
+void c_mapped_buffer::enable_tracking(std::string owner)
+{
+    {
+        scoped_lock guard(this);
+
+        if (m_usage == nullptr) m_usage = new usage_stats {{}, 0, 0, m_end - m_begin, m_end - m_begin, 0};
+        m_usage->owner = owner;
+    }
+
+    c_buffer_registry::get_instance().add(this);
+}
+
+void c_mapped_buffer::disable_tracking()
+{
+    c_buffer_registry::get_instance().remove(this);
+
+    scoped_lock guard(this);
+
+    delete m_usage;
+    m_usage = nullptr;
+}
+
+buffer::usage_stats c_mapped_buffer::get_usage_stats() const
+{
+    scoped_lock guard(this);
+
+    if (m_usage != nullptr) return *m_usage;
+    else return {};
+}
+
+
+c_spill_file::c_spill_file()
+ : m_size(0)
+{
+    char dir[MAX_PATH];
+    char path[MAX_PATH];
+
+    if (GetTempPath(MAX_PATH, dir) == 0 || GetTempFileName(dir, "ggb", 0, path) == 0)
+        throw std::runtime_error("unable to create temporary file name");
+
+    m_file = CreateFile(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                        FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+
+    if (m_file == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("unable to create temporary file: " + std::string(path));
+}
+
+c_spill_file::~c_spill_file()
+{
+    CloseHandle(m_file);
+}
+
+void* c_spill_file::map_region(uint64_t& offset)
+{
+    tthread::lock_guard<tthread::mutex> guard(m_mutex);
+
+    bool new_region = m_free_regions.empty();
+
+    if (new_region)
+    {
+        offset = m_size;
+    }
+    else
+    {
+        offset = m_free_regions.back();
+        m_free_regions.pop_back();
+    }
+
+    // the mapping object can be closed right away, the view keeps it alive
+    uint64_t size = std::max(m_size, offset + region_size);
+    HANDLE mapping = CreateFileMapping(m_file, NULL, PAGE_READWRITE,
+                                       (DWORD)(size >> 32), (DWORD)(size & 0xFFFFFFFF), NULL);
+    void* ptr = nullptr;
+
+    if (mapping != NULL)
+    {
+        ptr = MapViewOfFile(mapping, FILE_MAP_WRITE, (DWORD)(offset >> 32), (DWORD)(offset & 0xFFFFFFFF), region_size);
+        CloseHandle(mapping);
+    }
+
+    if (ptr == nullptr)
+    {
+        if (!new_region) m_free_regions.push_back(offset);
+        throw std::runtime_error("unable to map temporary file");
+    }
+
+    m_size = size;
+    return ptr;
+}
+
+void c_spill_file::unmap_region(void* ptr, uint64_t offset)
+{
+    UnmapViewOfFile(ptr);
+
+    tthread::lock_guard<tthread::mutex> guard(m_mutex);
+    m_free_regions.push_back(offset);
+}
@@ -0,0 +1,124 @@
+#ifndef C_MAPPED_BUFFER_HPP_INCLUDED
+#define C_MAPPED_BUFFER_HPP_INCLUDED
+
+#include <string>
+#include <vector>
+#include <windows.h>
+#include "tinythread.h"
+#include "gg/buffer.hpp"
+
+namespace gg
+{
+    /*
+     * Buffer stored in a memory mapped file. The readable bytes are the range
+     * [m_begin, m_end) of the mapping, and the mapping is enlarged (remapped) if
+     * a write doesn't fit into it, which invalidates the views of the buffer.
+     * An existing file's contents are readable right after opening, and the file
+     * is truncated to the written size when the buffer is destroyed.
+     */
+    class c_mapped_buffer : public buffer
+    {
+        // locks the buffer's mutex and counts it if tracking is enabled
+        class scoped_lock
+        {
+            tthread::lock_guard<tthread::mutex> m_guard;
+
+        public:
+            scoped_lock(const c_mapped_buffer* buf) : m_guard(buf->m_mutex) { if (buf->m_usage) ++buf->m_usage->lock_count; }
+        };
+
+        static const size_t min_capacity = 64 * 1024;
+
+        mutable tthread::mutex m_mutex;
+        std::string m_path;
+        bool m_read_only;
+        HANDLE m_file;
+        HANDLE m_mapping;
+        uint8_t* m_data;
+        size_t m_capacity;
+        size_t m_begin;
+        size_t m_end;
+        size_t m_prepared;
+        usage_stats* m_usage; // only allocated if tracking is enabled
+
+        void track(size_t pushed, size_t popped);
+        void open(size_t size);
+        void map(size_t capacity);
+        void unmap();
+        void reserve_unlocked(size_t len);
+        void advance_unlocked(size_t len);
+
+    public:
+        c_mapped_buffer(std::string path, size_t size);
+        c_mapped_buffer(const c_mapped_buffer&) = delete;
+        c_mapped_buffer(c_mapped_buffer&&) = delete;
+        ~c_mapped_buffer();
+
+        std::string get_path() const;
+
+        size_t available() const;
+        void advance(size_t len);
+        void clear();
+
+        byte_array peek(size_t len) const;
+        byte_array peek(size_t start_pos, size_t len) const;
+        size_t peek(uint8_t* buf, size_t len) const;
+        size_t peek(size_t start_pos, uint8_t* buf, size_t len) const;
+
+        buffer_view view(size_t len) const;
+        buffer_view view(size_t start_pos, size_t len) const;
+
+        void push(uint8_t byte);
+        void push(const uint8_t* buf, size_t len);
+        void push(const byte_array& buf);
+        void push(const buffer* buf);
+        void merge(buffer* buf);
+
+        optional<uint8_t> pop();
+        byte_array pop(size_t len);
+        size_t pop(uint8_t* buf, size_t len);
+
+        size_t find(uint8_t byte, size_t start_pos = 0) const;
+        size_t find(const uint8_t* pattern, size_t len, size_t start_pos = 0) const;
+        byte_array pop_until(uint8_t delim);
+
+        uint8_t* prepare(size_t len);
+        void commit(size_t len);
+        buffer_view::span data() const;
+        size_t gather(buffer_view::span* spans, size_t max_spans, size_t len) const;
+
+        void set_spill_threshold(size_t threshold);
+
+        void enable_tracking(std::string owner);
+        void disable_tracking();
+        usage_stats get_usage_stats() const;
+    };
+
+    /*
+     * Temporary file that provides memory for the chunks of a buffer exceeding its
+     * spill threshold. Every region of the file is mapped separately, so the memory
+     * of existing chunks never moves. The chunks hold a reference to the file,
+     * and it's deleted when the last reference is dropped.
+     */
+    class c_spill_file : public reference_counted
+    {
+        tthread::mutex m_mutex;
+        HANDLE m_file;
+        uint64_t m_size;
+        std::vector<uint64_t> m_free_regions;
+
+    protected:
+        ~c_spill_file();
+
+    public:
+        static const size_t region_size = 64 * 1024; // allocation granularity of views
+
+        c_spill_file();
+        c_spill_file(const c_spill_file&) = delete;
+        c_spill_file(c_spill_file&&) = delete;
+        void* map_region(uint64_t& offset);
+        void unmap_region(void* ptr, uint64_t offset);
+    };
+};
+
+#endif // C_MAPPED_BUFFER_HPP_INCLUDED
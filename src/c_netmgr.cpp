@@ -1,15 +1,21 @@
 #define _WIN32_WINNT 0x0501
 #include <ws2tcpip.h>
+#include <algorithm>
 #include <cstring>
 #include <cstdio>
 #include <stdexcept>
 #include "c_netmgr.hpp"
 #include "c_logger.hpp"
-#include "c_buffer.hpp"
 
 using namespace gg;
 
 
+static const size_t min_recv_size = 2048;
+static const size_t max_datagram_size = 65536;
+static const size_t udp_send_size = 2048;
+static const size_t max_send_spans = 16;
+
+
 static uint16_t get_port_from_sockaddr(SOCKADDR_STORAGE* sockaddr)
 {
     switch (sockaddr->ss_family)
@@ -23,6 +29,13 @@ static uint16_t get_port_from_sockaddr(SOCKADDR_STORAGE* sockaddr)
     }
 }
 
+static size_t get_pending_bytes(SOCKET sock)
+{
+    u_long pending = 0;
+    if (ioctlsocket(sock, FIONREAD, &pending) == SOCKET_ERROR) return 0;
+    else return pending;
+}
+
 static std::string get_addr_from_sockaddr(SOCKADDR_STORAGE* sockaddr)
 {
     /*char str[INET6_ADDRSTRLEN];
@@ -47,6 +60,12 @@ static std::string get_addr_from_sockaddr(SOCKADDR_STORAGE* sockaddr)
 }
 
 
+static std::string get_buffer_owner(const connection* conn, const char* buffer_name)
+{
+    return "connection " + conn->get_address() + ":" + std::to_string(conn->get_port()) + " " + buffer_name;
+}
+
+
 class wsa_init
 {
     WSADATA m_wsaData;
@@ -104,6 +123,7 @@ c_listener::c_listener(uint16_t port, bool is_tcp)
  , m_socket(INVALID_SOCKET)
  , m_port(port)
  , m_handler(nullptr)
+ , m_datagram_buf(buffer::create(buffer::mode::UNSYNCHRONIZED))
  , m_open(false)
  , m_tcp(is_tcp)
  , m_thread("listener thread")
@@ -115,6 +135,7 @@ c_listener::~c_listener()
 {
     close();
     if (m_handler != nullptr) m_handler->drop();
+    m_datagram_buf->drop();
 }
 
 uint16_t c_listener::get_port() const
@@ -296,8 +317,12 @@ bool c_listener::run(uint32_t)
     }
     else // we are UDP
     {
-        char buf[2048];
-        int rc = recvfrom(m_socket, buf, sizeof(buf), 0, reinterpret_cast<struct sockaddr*>(&addr), &addrlen);
+        // receiving the datagram right into a buffer that can be handed over to the connection
+        size_t len = std::min(std::max(get_pending_bytes(m_socket), min_recv_size), max_datagram_size);
+        uint8_t* buf = m_datagram_buf->prepare(len);
+        int rc = recvfrom(m_socket, reinterpret_cast<char*>(buf), len, 0, reinterpret_cast<struct sockaddr*>(&addr), &addrlen);
+        m_datagram_buf->commit((rc > 0) ? rc : 0);
+
         if (rc == SOCKET_ERROR)
         {
             *m_err << "recvfrom error: " << WSAGetLastError() << std::endl;
@@ -315,7 +340,7 @@ bool c_listener::run(uint32_t)
                 packet_handler* ph = conn->get_packet_handler();
                 if (ph != nullptr)
                 {
-                    conn->get_input_buffer()->push(reinterpret_cast<uint8_t*>(buf), rc);
+                    conn->get_input_buffer()->merge(m_datagram_buf);
                     ph->handle_packet(conn);
                 }
                 // faking connection drop
@@ -324,6 +349,8 @@ bool c_listener::run(uint32_t)
             }
             catch (std::exception& e) { *m_err << e.what() << std::endl; }
             catch (...) {}
+
+            m_datagram_buf->clear();
         }
     }
 
@@ -342,8 +369,11 @@ c_connection::c_connection(std::string address, uint16_t port, bool is_tcp)
  , m_listener(nullptr)
  , m_address(address)
  , m_port(port)
- , m_input_buf(new c_buffer())
- , m_output_buf(new c_buffer())
+ , m_input_buf(buffer::create(is_tcp ? buffer::mode::LOCK_FREE_SPSC : buffer::mode::SYNCHRONIZED))
+ , m_output_buf(buffer::create())
+ , m_codec(nullptr)
+ , m_encoded_input_buf(nullptr)
+ , m_encoded_output_buf(nullptr)
  , m_packet_handler(nullptr)
  , m_conn_handler(nullptr)
  , m_open(false)
@@ -351,6 +381,8 @@ c_connection::c_connection(std::string address, uint16_t port, bool is_tcp)
  , m_thread("connection thread")
  , m_err(c_logger::get_instance())
 {
+    m_input_buf->enable_tracking(get_buffer_owner(this, "input"));
+    m_output_buf->enable_tracking(get_buffer_owner(this, "output"));
 }
 
 c_connection::c_connection(c_listener* l, SOCKET sock, SOCKADDR_STORAGE* addr, bool is_tcp)
@@ -358,8 +390,11 @@ c_connection::c_connection(c_listener* l, SOCKET sock, SOCKADDR_STORAGE* addr, b
  , m_listener(l)
  , m_socket(sock)
  , m_sockaddr(*addr)
- , m_input_buf(new c_buffer())
- , m_output_buf(new c_buffer())
+ , m_input_buf(buffer::create(is_tcp ? buffer::mode::LOCK_FREE_SPSC : buffer::mode::SYNCHRONIZED))
+ , m_output_buf(buffer::create())
+ , m_codec(nullptr)
+ , m_encoded_input_buf(nullptr)
+ , m_encoded_output_buf(nullptr)
  , m_packet_handler(nullptr)
  , m_conn_handler(nullptr)
  , m_open(true)
@@ -374,6 +409,9 @@ c_connection::c_connection(c_listener* l, SOCKET sock, SOCKADDR_STORAGE* addr, b
     m_address = get_addr_from_sockaddr(&m_sockaddr);
     m_port = get_port_from_sockaddr(&m_sockaddr);
 
+    m_input_buf->enable_tracking(get_buffer_owner(this, "input"));
+    m_output_buf->enable_tracking(get_buffer_owner(this, "output"));
+
     if (m_listener && m_listener->get_connection_handler() != nullptr)
         m_listener->get_connection_handler()->handle_connection_open(this);
 
@@ -385,6 +423,9 @@ c_connection::~c_connection()
     close();
     if (m_packet_handler != nullptr) m_packet_handler->drop();
     if (m_conn_handler != nullptr) m_conn_handler->drop();
+    if (m_codec != nullptr) m_codec->drop();
+    if (m_encoded_input_buf != nullptr) m_encoded_input_buf->drop();
+    if (m_encoded_output_buf != nullptr) m_encoded_output_buf->drop();
     // we need to wait a bit to let the networking thread finish
     tthread::this_thread::sleep_for(tthread::chrono::milliseconds(100));
 }
@@ -462,6 +503,32 @@ connection_handler* c_connection::get_connection_handler() const
     return m_conn_handler;
 }
 
+void c_connection::set_codec(buffer_codec* codec)
+{
+    if (!m_tcp && codec != nullptr)
+        throw std::runtime_error("codecs are only supported on TCP connections");
+
+    tthread::lock_guard<tthread::recursive_mutex> guard(m_mutex);
+
+    if (m_codec != nullptr) m_codec->drop();
+    if (codec != nullptr) codec->grab();
+    m_codec = codec;
+
+    // both buffers are only touched by the connection thread (under the mutex)
+    if (m_codec != nullptr && m_encoded_input_buf == nullptr)
+    {
+        m_encoded_input_buf = buffer::create(buffer::mode::UNSYNCHRONIZED);
+        m_encoded_output_buf = buffer::create(buffer::mode::UNSYNCHRONIZED);
+        m_encoded_input_buf->enable_tracking(get_buffer_owner(this, "encoded input"));
+        m_encoded_output_buf->enable_tracking(get_buffer_owner(this, "encoded output"));
+    }
+}
+
+buffer_codec* c_connection::get_codec() const
+{
+    return m_codec;
+}
+
 bool c_connection::is_opened() const
 {
     return m_open;
@@ -582,34 +649,50 @@ void c_connection::error_close()
 
 bool c_connection::flush_output_buffer()
 {
-    if (m_open && m_output_buf->available())
+    if (!m_open) return true;
+
+    buffer* out = m_output_buf;
+
+    // everything queued so far is compressed (encoded data left over from
+    // a codec that was switched off since then is still sent first)
+    if (m_codec != nullptr)
+        m_codec->encode(m_output_buf, m_encoded_output_buf);
+
+    if (m_encoded_output_buf != nullptr && (m_codec != nullptr || m_encoded_output_buf->available()))
+        out = m_encoded_output_buf;
+
+    if (out->available())
     {
-        // sending data queued in output buffer
+        // sending the queued blocks of the output buffer with one call without copying them
+        buffer_view::span spans[max_send_spans];
+        WSABUF wsabufs[max_send_spans];
+        size_t len = m_tcp ? out->available() : udp_send_size;
+        size_t cnt = out->gather(spans, max_send_spans, len);
+        DWORD bytes_sent = 0;
         int rc;
-        size_t len = m_output_buf->available();
-        char buf[2048];
-        len = m_output_buf->pop(reinterpret_cast<uint8_t*>(buf), (len > sizeof(buf)) ? sizeof(buf) : len);
-        size_t bytes_sent = 0;
 
-        for (; bytes_sent < len;)
+        for (size_t i = 0; i < cnt; ++i)
         {
-            if (m_tcp)
-                rc = ::send(m_socket, &buf[bytes_sent], len, 0);
-            else
-                rc = ::sendto(m_socket, &buf[bytes_sent], len, 0,
-                              reinterpret_cast<struct sockaddr*>(&m_sockaddr),
-                              sizeof(SOCKADDR_STORAGE));
-
-            if (rc == SOCKET_ERROR)
-            {
-                *m_err << "send error: " << WSAGetLastError() << std::endl;
-                error_close();
-                return false;
-            }
+            wsabufs[i].buf = reinterpret_cast<char*>(const_cast<uint8_t*>(spans[i].data));
+            wsabufs[i].len = spans[i].size;
+        }
+
+        if (m_tcp)
+            rc = WSASend(m_socket, wsabufs, cnt, &bytes_sent, 0, NULL, NULL);
+        else
+            rc = WSASendTo(m_socket, wsabufs, cnt, &bytes_sent, 0,
+                           reinterpret_cast<struct sockaddr*>(&m_sockaddr),
+                           sizeof(SOCKADDR_STORAGE), NULL, NULL);
 
-            len -= rc;
-            bytes_sent += rc;
+        if (rc == SOCKET_ERROR)
+        {
+            *m_err << "send error: " << WSAGetLastError() << std::endl;
+            error_close();
+            return false;
         }
+
+        // partially sent data stays in the buffer for the next tick
+        out->consume(bytes_sent);
     }
 
     return true;
@@ -644,8 +727,13 @@ bool c_connection::run(uint32_t)
             return false; // skipping recv
         }
 
-        char buf[2048];
-        rc = recv(m_socket, buf, sizeof(buf), 0);
+        // receiving directly into the input buffer, as much as the socket has
+        buffer* recv_buf = (m_codec != nullptr) ? m_encoded_input_buf : m_input_buf;
+        size_t len = std::max(get_pending_bytes(m_socket), min_recv_size);
+        uint8_t* buf = recv_buf->prepare(len);
+        rc = recv(m_socket, reinterpret_cast<char*>(buf), len, 0);
+        recv_buf->commit((rc > 0) ? rc : 0);
+
         if (rc == SOCKET_ERROR)
         {
             *m_err << "recv error: " << WSAGetLastError() << std::endl;
@@ -660,8 +748,22 @@ bool c_connection::run(uint32_t)
         }
         else
         {
+            if (m_codec != nullptr)
+            {
+                try
+                {
+                    // a partially received block stays in the encoded buffer
+                    if (m_codec->decode(m_encoded_input_buf, m_input_buf) == 0) return false;
+                }
+                catch (std::exception& e)
+                {
+                    *m_err << e.what() << std::endl;
+                    error_close();
+                    return true;
+                }
+            }
+
             // incoming data
-            m_input_buf->push(reinterpret_cast<uint8_t*>(buf), rc);
             if (m_packet_handler != nullptr) m_packet_handler->handle_packet(this);
         }
     }
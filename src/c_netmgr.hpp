@@ -18,6 +18,7 @@ namespace gg
         uint16_t m_port;
         std::set<connection*> m_conns;
         connection_handler* m_handler;
+        buffer* m_datagram_buf;
         volatile bool m_open;
         bool m_tcp;
         c_thread m_thread;
@@ -55,6 +56,9 @@ namespace gg
         uint16_t m_port;
         buffer* m_input_buf;
         buffer* m_output_buf;
+        buffer_codec* m_codec;
+        buffer* m_encoded_input_buf;  // only used with a codec
+        buffer* m_encoded_output_buf; // only used with a codec
         packet_handler* m_packet_handler;
         connection_handler* m_conn_handler;
         volatile bool m_open;
@@ -83,6 +87,8 @@ namespace gg
         packet_handler* get_packet_handler() const;
         void set_connection_handler(connection_handler*);
         connection_handler* get_connection_handler() const;
+        void set_codec(buffer_codec*);
+        buffer_codec* get_codec() const;
         bool is_opened() const;
         bool open();
         void close();
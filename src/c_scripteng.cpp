@@ -4,6 +4,7 @@
 #include "c_logger.hpp"
 #include "scope_callback.hpp"
 #include "gg/application.hpp"
+#include "gg/buffer.hpp"
 #include "gg/stringutil.hpp"
 
 using namespace gg;
@@ -87,6 +88,8 @@ c_script_engine::c_script_engine(application* app)
             },
             true);
 
+    eng->add_function("dump_buffers", [] { buffer::dump_tracked_buffers(std::cout); }, true);
+
     eng->add_function("show_hidden", [&] { this->show_hidden_functions(); }, true);
     eng->add_function("hide_hidden", [&] { this->hide_hidden_functions(); }, true);
 
@@ -1,87 +1,394 @@
+#include <algorithm>
+#include <cstring>
+#include <limits>
 #include <string>
 #include "c_serializer.hpp"
-#include "c_buffer.hpp"
 
 using namespace gg;
 
 
-class safe_buffer : public buffer
+// exposes a buffer_reader to the deserializers of add_rule_ex() and add_rule():
+// reading moves the cursor, writing goes to the underlying buffer
+class reader_buffer : public buffer
 {
+    buffer_reader& m_rd;
     buffer* m_buf;
-    size_t m_pos;
 
 public:
-    safe_buffer(buffer* buf) : m_buf(buf), m_pos(0) {}
-    ~safe_buffer() {}
+    reader_buffer(buffer_reader& rd) : m_rd(rd), m_buf(rd.get_buffer()) {}
+    ~reader_buffer() {}
 
-    void clear() { m_pos = 0; m_buf->clear(); }
+    buffer_reader& get_reader() { return m_rd; }
+
+    void clear() { m_rd.skip(m_rd.remaining()); }
     void push(uint8_t byte) { m_buf->push(byte); }
     void push(const uint8_t* buf, size_t len) { m_buf->push(buf, len); }
     void push(const byte_array& buf) { m_buf->push(buf); }
     void push(const buffer* buf) { m_buf->push(buf); }
     void merge(buffer* buf) { m_buf->merge(buf); }
+    uint8_t* prepare(size_t len) { return m_buf->prepare(len); }
+    void commit(size_t len) { m_buf->commit(len); }
+    void set_spill_threshold(size_t threshold) { m_buf->set_spill_threshold(threshold); }
+    void enable_tracking(std::string owner) { m_buf->enable_tracking(owner); }
+    void disable_tracking() { m_buf->disable_tracking(); }
+    usage_stats get_usage_stats() const { return m_buf->get_usage_stats(); }
 
     size_t available() const
     {
-        return m_buf->available() - m_pos;
+        return m_rd.remaining();
     }
 
     void advance(size_t len)
     {
-        m_pos += len;
+        m_rd.skip(std::min(len, m_rd.remaining()));
     }
 
+    // the cursor's position is relative to the beginning of the underlying buffer,
+    // since nothing is consumed from it until the deserialization succeeds
+
     byte_array peek(size_t len) const
     {
-        return std::move(m_buf->peek(m_pos, len));
+        return peek((size_t)0, len);
     }
 
     byte_array peek(size_t start_pos, size_t len) const
     {
-        return std::move(m_buf->peek(start_pos + m_pos, len));
+        if (start_pos >= available()) return {};
+        return m_buf->peek(start_pos + m_rd.position(), std::min(len, available() - start_pos));
     }
 
     size_t peek(uint8_t* buf, size_t len) const
     {
-        return m_buf->peek(m_pos, buf, len);
+        return peek((size_t)0, buf, len);
     }
 
     size_t peek(size_t start_pos, uint8_t* buf, size_t len) const
     {
-        return m_buf->peek(start_pos + m_pos, buf, len);
+        if (start_pos >= available()) return 0;
+        return m_buf->peek(start_pos + m_rd.position(), buf, std::min(len, available() - start_pos));
+    }
+
+    buffer_view view(size_t len) const
+    {
+        return view((size_t)0, len);
+    }
+
+    buffer_view view(size_t start_pos, size_t len) const
+    {
+        if (start_pos >= available()) return {};
+        return m_buf->view(start_pos + m_rd.position(), std::min(len, available() - start_pos));
+    }
+
+    buffer_view::span data() const
+    {
+        buffer_view vw = view(available());
+        if (vw.empty()) return {nullptr, 0};
+        else return vw.get_span(0);
+    }
+
+    size_t gather(buffer_view::span* spans, size_t max_spans, size_t len) const
+    {
+        if (spans == nullptr) return 0;
+
+        buffer_view vw = view(len);
+        size_t cnt = std::min(max_spans, vw.span_count());
+        for (size_t i = 0; i < cnt; ++i) spans[i] = vw.get_span(i);
+        return cnt;
     }
 
     optional<uint8_t> pop()
     {
-        auto v = m_buf->peek(m_pos++, 1);
-        if (!v.empty()) return v[0];
-        else return {};
+        uint8_t byte;
+        if (!m_rd.read(byte)) return {};
+        return byte;
     }
 
     byte_array pop(size_t len)
     {
-        m_pos += len;
-        return std::move(m_buf->peek(m_pos - len, len));
+        byte_array r(std::min(len, available()));
+        m_rd.read(r.data(), r.size());
+        return r;
     }
 
     size_t pop(uint8_t* buf, size_t len)
     {
-        size_t rc = m_buf->peek(m_pos, buf, len);
-        m_pos += len;
-        return rc;
+        len = std::min(len, available());
+        m_rd.read(buf, len);
+        return len;
+    }
+
+    size_t find(uint8_t byte, size_t start_pos) const
+    {
+        size_t pos = m_buf->find(byte, start_pos + m_rd.position());
+        return (pos != npos && pos - m_rd.position() < available()) ? (pos - m_rd.position()) : npos;
+    }
+
+    size_t find(const uint8_t* pattern, size_t len, size_t start_pos) const
+    {
+        size_t pos = m_buf->find(pattern, len, start_pos + m_rd.position());
+        return (pos != npos && pos - m_rd.position() + len <= available()) ? (pos - m_rd.position()) : npos;
     }
 
-    void finalize()
+    byte_array pop_until(uint8_t delim)
     {
-        m_buf->advance(m_pos);
-        m_pos = 0;
+        size_t pos = find(delim, 0);
+        if (pos == npos) return {};
+
+        return pop(pos + 1);
     }
 };
 
 
+// nested deserializers called with a reader_buffer continue on its cursor (and rewind it
+// on failure) instead of creating another reader on top of the adapter
+template<class F>
+static optional<var> read_from(buffer* buf, F read)
+{
+    reader_buffer* rbuf = dynamic_cast<reader_buffer*>(buf);
+    if (rbuf != nullptr)
+    {
+        buffer_reader& rd = rbuf->get_reader();
+        size_t start = rd.position();
+
+        optional<var> v = read(rd);
+        if (!v) rd.rewind(start);
+
+        return v;
+    }
+
+    grab_guard bufgrab(buf);
+    buffer_reader rd(buf);
+
+    optional<var> v = read(rd);
+    if (v) rd.commit();
+
+    return v;
+}
+
+
+void gg::write_varint(buffer* buf, uint64_t value)
+{
+    if (buf == nullptr) return;
+
+    uint8_t bytes[10];
+    size_t len = 0;
+
+    for (; value >= 0x80; value >>= 7)
+        bytes[len++] = static_cast<uint8_t>(value | 0x80);
+    bytes[len++] = static_cast<uint8_t>(value);
+
+    buf->push(bytes, len);
+}
+
+bool gg::read_varint(buffer_reader& rd, uint64_t& value)
+{
+    size_t start = rd.position();
+    uint64_t result = 0;
+
+    for (unsigned shift = 0; shift < 64; shift += 7)
+    {
+        uint8_t byte;
+        if (!rd.read(byte)) break;
+
+        result |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            value = result;
+            return true;
+        }
+    }
+
+    rd.rewind(start); // incomplete or longer than 10 bytes
+    return false;
+}
+
+void gg::write_signed_varint(buffer* buf, int64_t value)
+{
+    write_varint(buf, (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63));
+}
+
+bool gg::read_signed_varint(buffer_reader& rd, int64_t& value)
+{
+    uint64_t zigzag;
+    if (!read_varint(rd, zigzag)) return false;
+
+    value = static_cast<int64_t>((zigzag >> 1) ^ (~(zigzag & 1) + 1));
+    return true;
+}
+
+bool gg::write_length(buffer* buf, size_t len, const serializer* s)
+{
+    if (buf == nullptr) return false;
+
+    if (s != nullptr && s->get_format_version() >= 2)
+    {
+        write_varint(buf, len);
+        return true;
+    }
+
+    if (len > 0xFFFF) return false;
+
+    uint16_t len16 = len;
+    buf->push(reinterpret_cast<const uint8_t*>(&len16), sizeof(uint16_t));
+    return true;
+}
+
+bool gg::read_length(buffer_reader& rd, size_t& len, const serializer* s)
+{
+    if (s != nullptr && s->get_format_version() >= 2)
+    {
+        uint64_t len64;
+        if (!read_varint(rd, len64) || len64 > std::numeric_limits<size_t>::max()) return false;
+
+        len = len64;
+        return true;
+    }
+
+    uint16_t len16;
+    if (!rd.read(len16)) return false;
+
+    len = len16;
+    return true;
+}
+
+
+bool gg::write_name(buffer* buf, const std::string& name, const serializer* s)
+{
+    if (buf == nullptr) return false;
+
+    const c_compact_serializer* cs = dynamic_cast<const c_compact_serializer*>(s);
+    if (cs != nullptr)
+    {
+        cs->write_name(name, buf);
+        return true;
+    }
+
+    if (!write_length(buf, name.length(), s)) return false;
+
+    buf->push(reinterpret_cast<const uint8_t*>(name.c_str()), name.length());
+    return true;
+}
+
+bool gg::read_name(buffer_reader& rd, std::string& name, const serializer* s)
+{
+    const c_compact_serializer* cs = dynamic_cast<const c_compact_serializer*>(s);
+    if (cs != nullptr) return cs->read_name(rd, name);
+
+    size_t start = rd.position();
+    size_t len;
+
+    if (!read_length(rd, len, s) || rd.remaining() < len)
+    {
+        rd.rewind(start);
+        return false;
+    }
+
+    name.assign(len, '\0');
+    rd.read(reinterpret_cast<uint8_t*>(&name[0]), len);
+    return true;
+}
+
+
+// frames
+
+static const uint32_t frame_checksum_flag = 0x80000000;
+static const size_t max_frame_length = 0x7FFFFFFF;
+
+static uint32_t read_le32(const uint8_t* p)
+{
+    return (p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24));
+}
+
+static void write_le32(uint8_t* p, uint32_t val)
+{
+    p[0] = val & 0xFF;
+    p[1] = (val >> 8) & 0xFF;
+    p[2] = (val >> 16) & 0xFF;
+    p[3] = (val >> 24) & 0xFF;
+}
+
+// CRC32 (the one of zlib) of the bytes in the view, 'crc' continues a previous result
+static uint32_t crc32(const buffer_view& vw, uint32_t crc = 0)
+{
+    static const struct crc_table
+    {
+        uint32_t m_entries[256];
+
+        crc_table()
+        {
+            for (uint32_t i = 0; i < 256; ++i)
+            {
+                uint32_t c = i;
+                for (int k = 0; k < 8; ++k) c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+                m_entries[i] = c;
+            }
+        }
+    } table;
+
+    crc ^= 0xFFFFFFFF;
+
+    for (size_t i = 0; i < vw.span_count(); ++i)
+    {
+        buffer_view::span sp = vw.get_span(i);
+        for (size_t j = 0; j < sp.size; ++j)
+            crc = table.m_entries[(crc ^ sp.data[j]) & 0xFF] ^ (crc >> 8);
+    }
+
+    return (crc ^ 0xFFFFFFFF);
+}
+
+size_t gg::get_frame_size(const buffer* buf)
+{
+    if (buf == nullptr) return 0;
+
+    uint8_t header[4];
+    if (buf->peek(header, 4) < 4) return 0;
+
+    uint32_t len = read_le32(header);
+    size_t size = 4 + (len & max_frame_length) + ((len & frame_checksum_flag) ? 4 : 0);
+
+    return (buf->available() >= size) ? size : 0;
+}
+
+// 'read' gets a cursor over the message of a complete frame, which is consumed either way
+template<class F>
+static optional<var> read_frame(buffer* buf, F read)
+{
+    size_t frame_size = get_frame_size(buf);
+    if (frame_size == 0) return {};
+
+    grab_guard bufgrab(buf);
+    optional<var> v;
+
+    {
+        buffer_reader rd(buf);
+        uint8_t header[4];
+        uint32_t checksum = 0;
+
+        rd.read(header, 4);
+        uint32_t len = read_le32(header);
+
+        if (len & frame_checksum_flag)
+        {
+            rd.read(header, 4);
+            checksum = read_le32(header);
+        }
+
+        if (!(len & frame_checksum_flag) || crc32(buf->view(rd.position(), frame_size - rd.position())) == checksum)
+        {
+            v = read(rd);
+            if (rd.position() != frame_size) v = optional<var>(); // the message has to fill the frame
+        }
+    }
+
+    buf->advance(frame_size);
+    return v;
+}
+
+
 bool gg::serialize_varlist(const var& v, buffer* buf, const serializer* s)
 {
-    if (buf == nullptr || s == nullptr || v.get_type() != typeid(varlist)) return false;
+    if (buf == nullptr || s == nullptr || !v.is<varlist>()) return false;
 
     const varlist& vl = v.get<varlist>();
     uint16_t vlsize = vl.size();
@@ -98,16 +405,24 @@ bool gg::serialize_varlist(const var& v, buffer* buf, const serializer* s)
 
 optional<var> gg::deserialize_varlist(buffer* buf, const serializer* s)
 {
-    if (buf == nullptr || s == nullptr || buf->available() < 2) return {};
+    if (buf == nullptr) return {};
+    return read_from(buf, [&](buffer_reader& rd) { return read_varlist(rd, s); });
+}
+
+optional<var> gg::read_varlist(buffer_reader& rd, const serializer* s)
+{
+    if (s == nullptr) return {};
 
     varlist vl;
     uint16_t vlsize;
 
-    buf->pop(reinterpret_cast<uint8_t*>(&vlsize), sizeof(uint16_t));
+    if (!rd.read(vlsize)) return {};
+
+    vl.reserve(vlsize);
 
     for (uint16_t i = 0; i < vlsize; ++i)
     {
-        optional<var> v = s->deserialize(buf);
+        optional<var> v = s->deserialize(rd);
         if (!v) return {};
         vl.push_back(std::move(*v));
     }
@@ -118,7 +433,7 @@ optional<var> gg::deserialize_varlist(buffer* buf, const serializer* s)
 
 bool gg::serialize_string(const var& v, buffer* buf)
 {
-    if (buf == nullptr || v.get_type() != typeid(std::string)) return false;
+    if (buf == nullptr || !v.is<std::string>()) return false;
 
     grab_guard bufgrab(buf);
     const std::string& str = v.get<std::string>();
@@ -132,30 +447,62 @@ bool gg::serialize_string(const var& v, buffer* buf)
 
 optional<var> gg::deserialize_string(buffer* buf)
 {
-    if (buf == nullptr || buf->available() < 2) return {};
+    if (buf == nullptr) return {};
+    return read_from(buf, [&](buffer_reader& rd) { return read_string(rd); });
+}
 
-    grab_guard bufgrab(buf);
+optional<var> gg::read_string(buffer_reader& rd)
+{
+    uint16_t len;
+    if (!rd.read(len) || rd.remaining() < len) return {};
+
+    // copying straight from the buffer's memory to the string
+    std::string str(len, '\0');
+    rd.read(reinterpret_cast<uint8_t*>(&str[0]), len);
+
+    return std::move(str);
+}
+
+// shared views have the layout of strings, and both are read as views if the serializer wants it
+
+static bool serialize_shared_view(const var& v, buffer* buf, const serializer* s)
+{
+    if (buf == nullptr || !v.is<shared_view>()) return false;
 
+    const shared_view& vw = v.get<shared_view>();
+    if (!write_length(buf, vw.size(), s)) return false;
+
+    buf->push(vw.data(), vw.size());
+    return true;
+}
+
+static optional<var> read_text(buffer_reader& rd, const serializer* s)
+{
+    if (s == nullptr || !s->get_string_views()) return read_string(rd);
+
+    size_t start = rd.position();
     uint16_t len;
-    buf->pop(reinterpret_cast<uint8_t*>(&len), sizeof(uint16_t));
+    shared_view vw;
 
-    if (buf->available() < len) return {};
+    if (!rd.read(len) || !rd.read(vw, len))
+    {
+        rd.rewind(start);
+        return {};
+    }
 
-    auto data = buf->pop(len);
-    return std::move( std::string(data.begin(), data.end()) );
+    return std::move(vw);
 }
 
 
 static bool serialize_void(const var& v, buffer* buf)
 {
-    if (buf == nullptr || v.get_type() != typeid(void)) return false;
+    if (buf == nullptr || !v.is_empty()) return false;
     else return true;
 }
 
-static optional<var> deserialize_void(buffer* buf)
+static optional<var> read_void(buffer_reader&, const serializer*)
 {
-    if (buf == nullptr) return {};
-    else return var();
+    return var();
 }
 
 
@@ -221,7 +568,7 @@ static long double unpack754(uint64_t i, unsigned bits, unsigned expbits)
 
 bool gg::serialize_float(const var& v, buffer* buf)
 {
-    if (buf == nullptr || v.get_type() != typeid(float))
+    if (buf == nullptr || !v.is<float>())
         return false;
 
     uint64_t data = pack754_32(v.get<float>());
@@ -232,11 +579,14 @@ bool gg::serialize_float(const var& v, buffer* buf)
 
 optional<var> gg::deserialize_float(buffer* buf)
 {
-    if (buf == nullptr || buf->available() < sizeof(uint64_t))
-        return {};
+    if (buf == nullptr) return {};
+    return read_from(buf, [&](buffer_reader& rd) { return read_float(rd); });
+}
 
+optional<var> gg::read_float(buffer_reader& rd)
+{
     uint64_t data;
-    buf->pop(reinterpret_cast<uint8_t*>(&data), sizeof(uint64_t));
+    if (!rd.read(data)) return {};
 
     float f = unpack754_32(data);
     return f;
@@ -244,7 +594,7 @@ optional<var> gg::deserialize_float(buffer* buf)
 
 bool gg::serialize_double(const var& v, buffer* buf)
 {
-    if (buf == nullptr || v.get_type() != typeid(double))
+    if (buf == nullptr || !v.is<double>())
         return false;
 
     uint64_t data = pack754_64(v.get<double>());
@@ -255,140 +605,1360 @@ bool gg::serialize_double(const var& v, buffer* buf)
 
 optional<var> gg::deserialize_double(buffer* buf)
 {
-    if (buf == nullptr || buf->available() < sizeof(uint64_t))
-        return {};
+    if (buf == nullptr) return {};
+    return read_from(buf, [&](buffer_reader& rd) { return read_double(rd); });
+}
 
+optional<var> gg::read_double(buffer_reader& rd)
+{
     uint64_t data;
-    buf->pop(reinterpret_cast<uint8_t*>(&data), sizeof(uint64_t));
+    if (!rd.read(data)) return {};
 
     double d = unpack754_64(data);
     return d;
 }
 
 
-c_serializer::c_serializer(application* app)
- : m_app(app)
+// arrays of numbers
+
+static bool is_little_endian()
 {
-    add_trivial_rule<int8_t>();
-    add_trivial_rule<uint8_t>();
-    add_trivial_rule<int16_t>();
-    add_trivial_rule<uint16_t>();
-    add_trivial_rule<int32_t>();
-    add_trivial_rule<uint32_t>();
-    add_trivial_rule<int64_t>();
-    add_trivial_rule<uint64_t>();
-    //add_trivial_rule<float>();
-    //add_trivial_rule<double>();
-    add_rule_ex(typeid(varlist), serialize_varlist, deserialize_varlist);
-    add_rule(typeid(std::string), serialize_string, deserialize_string);
-    add_rule(typeid(void), serialize_void, deserialize_void);
-    add_rule(typeid(float), serialize_float, deserialize_float);
-    add_rule(typeid(double), serialize_double, deserialize_double);
+    const uint16_t one = 1;
+    return (*reinterpret_cast<const uint8_t*>(&one) == 1);
 }
 
-c_serializer::~c_serializer()
+// array elements are little endian on the wire, so big endian hosts swap them in place
+// (the elements are independent, which lets the compiler vectorize the loop)
+template<size_t N>
+static void convert_little_endian(uint8_t* data, size_t count)
 {
+    if (N == 1 || is_little_endian()) return;
+
+    for (uint8_t* p = data, * end = data + N * count; p != end; p += N)
+        std::reverse(p, p + N);
 }
 
-application* c_serializer::get_app() const
+// element counts are uint32 in format v1, since arrays easily outgrow write_length()
+static bool write_count(buffer* buf, size_t count, const serializer* s)
 {
-    return m_app;
+    if (s != nullptr && s->get_format_version() >= 2)
+        return write_length(buf, count, s);
+
+    if (count > 0xFFFFFFFF) return false;
+
+    uint32_t count32 = count;
+    buf->push(reinterpret_cast<const uint8_t*>(&count32), sizeof(uint32_t));
+    return true;
 }
 
-void c_serializer::add_rule_ex(typeinfo ti, serializer_func_ex sfunc, deserializer_func_ex dfunc)
+static bool read_count(buffer_reader& rd, size_t& count, const serializer* s)
 {
-    if (m_rules.count(ti.get_hash()) > 0)
-        throw std::runtime_error("rule already added");
+    if (s != nullptr && s->get_format_version() >= 2)
+        return read_length(rd, count, s);
 
-    tthread::lock_guard<tthread::recursive_mutex> guard(m_mutex);
+    uint32_t count32;
+    if (!rd.read(count32)) return false;
 
-    auto r = m_rules.insert( std::make_pair(ti.get_hash(), rule {ti, sfunc, dfunc}) );
-
-    if (!r.second)
-        throw std::runtime_error("failed to add rule");
+    count = count32;
+    return true;
 }
 
-void c_serializer::add_rule(typeinfo ti, serializer_func sfunc, deserializer_func dfunc)
+// writes 'count' elements from 'src' as one block
+template<class T>
+static void write_block(buffer* buf, const T* src, size_t count)
 {
-    add_rule_ex(ti,
-        [=](const var& v, buffer* buf, const serializer*)->bool { return sfunc(v, buf); },
-        [=](buffer* buf, const serializer*)->var { return dfunc(buf); });
+    if (count == 0) return;
+
+    size_t len = count * sizeof(T);
+    uint8_t* p = buf->prepare(len);
+    std::memcpy(p, src, len);
+    convert_little_endian<sizeof(T)>(p, count);
+    buf->commit(len);
 }
 
-void c_serializer::remove_rule(typeinfo ti)
+template<class T>
+static bool read_block(buffer_reader& rd, T* dest, size_t count)
 {
-    tthread::lock_guard<tthread::recursive_mutex> guard(m_mutex);
+    if (!rd.read(reinterpret_cast<uint8_t*>(dest), count * sizeof(T))) return false;
 
-    auto pos = m_rules.find(ti.get_hash());
-    if (pos != m_rules.end())
-    {
-        m_rules.erase(pos);
-    }
+    convert_little_endian<sizeof(T)>(reinterpret_cast<uint8_t*>(dest), count);
+    return true;
 }
 
-bool c_serializer::serialize(const var& v, buffer* buf) const
+template<class T>
+static bool serialize_array(const var& v, buffer* buf, const serializer* s)
 {
-    if (buf == nullptr) return false;
+    if (buf == nullptr || !v.is<std::vector<T>>()) return false;
 
-    size_t hash = typeinfo(v.get_type()).get_hash();
+    const std::vector<T>& arr = v.get<std::vector<T>>();
+    if (!write_count(buf, arr.size(), s)) return false;
 
-    grab_guard bufgrab(buf);
-    tthread::lock_guard<tthread::recursive_mutex> guard(m_mutex);
+    write_block(buf, arr.data(), arr.size());
+    return true;
+}
 
-    c_buffer tmpbuf;
+template<class T>
+static optional<var> read_array(buffer_reader& rd, const serializer* s)
+{
+    size_t start = rd.position();
+    size_t count;
 
-    auto rule = m_rules.find(hash);
-    if (rule != m_rules.end())
+    if (read_count(rd, count, s) && count <= rd.remaining() / sizeof(T))
     {
-        tmpbuf.push(reinterpret_cast<const uint8_t*>(&hash), sizeof(size_t));
-        if (rule->second.m_sfunc(v, &tmpbuf, this)) // successful serialization
+        // byte arrays don't need any conversion, so they can be views
+        if (std::is_same<T, uint8_t>::value && s != nullptr && s->get_string_views())
         {
-            buf->merge(&tmpbuf);
-            return true;
+            shared_view vw;
+            if (rd.read(vw, count)) return std::move(vw);
         }
+
+        std::vector<T> arr(count);
+        if (read_block(rd, arr.data(), count)) return std::move(arr);
     }
 
-    return false;
+    rd.rewind(start);
+    return {};
 }
 
-optional<var> c_serializer::deserialize(buffer* buf) const
+
+// encodings of the built-in types in format v2
+
+template<class T>
+static bool write_compact_signed(const var& v, buffer* buf, const serializer*)
 {
-    if (buf == nullptr || buf->available() < sizeof(size_t)) return {};
+    write_signed_varint(buf, v.get<T>());
+    return true;
+}
 
-    grab_guard bufgrab(buf);
-    tthread::lock_guard<tthread::recursive_mutex> guard(m_mutex);
+template<class T>
+static optional<var> read_compact_signed(buffer_reader& rd, const serializer*)
+{
+    size_t start = rd.position();
+    int64_t i;
 
-    safe_buffer sbuf(buf);
+    if (read_signed_varint(rd, i) && i >= std::numeric_limits<T>::min() && i <= std::numeric_limits<T>::max())
+        return static_cast<T>(i);
 
-    size_t hash;
-    auto v = sbuf.pop(sizeof(size_t));
-    std::memcpy(&hash, v.data(), sizeof(size_t));
+    rd.rewind(start);
+    return {};
+}
 
-    auto rule = m_rules.find(hash);
-    if (rule != m_rules.end())
-    {
-        optional<var> v = std::move(rule->second.m_dfunc(&sbuf, this));
-        if (v)
-        {
-            sbuf.finalize();
-            return std::move(*v);
-        }
-    }
+template<class T>
+static bool write_compact_unsigned(const var& v, buffer* buf, const serializer*)
+{
+    write_varint(buf, v.get<T>());
+    return true;
+}
 
+template<class T>
+static optional<var> read_compact_unsigned(buffer_reader& rd, const serializer*)
+{
+    size_t start = rd.position();
+    uint64_t u;
+
+    if (read_varint(rd, u) && u <= std::numeric_limits<T>::max())
+        return static_cast<T>(u);
+
+    rd.rewind(start);
     return {};
 }
 
-varlist c_serializer::deserialize_all(buffer* buf) const
+// floating point numbers are sent as they are (like the trivial rules do with integers)
+template<class T>
+static bool write_compact_float(const var& v, buffer* buf, const serializer*)
 {
-    grab_guard bufgrab(buf);
-    varlist vl;
+    buf->push(reinterpret_cast<const uint8_t*>(v.get_ptr<T>()), sizeof(T));
+    return true;
+}
 
-    for(;;)
-    {
-        optional<var> v = std::move(deserialize(buf));
-        if (v) vl.push_back( std::move(*v) );
-        else break;
-    }
+template<class T>
+static optional<var> read_compact_float(buffer_reader& rd, const serializer*)
+{
+    T t;
+    if (!rd.read(t)) return {};
+    return t;
+}
 
-    return std::move(vl);
+static bool write_compact_string(const var& v, buffer* buf, const serializer*)
+{
+    const std::string& str = v.get<std::string>();
+
+    write_varint(buf, str.length());
+    buf->push(reinterpret_cast<const uint8_t*>(str.c_str()), str.length());
+    return true;
+}
+
+static bool write_compact_view(const var& v, buffer* buf, const serializer*)
+{
+    const shared_view& vw = v.get<shared_view>();
+
+    write_varint(buf, vw.size());
+    buf->push(vw.data(), vw.size());
+    return true;
+}
+
+static optional<var> read_compact_string(buffer_reader& rd, const serializer* s)
+{
+    size_t start = rd.position();
+    uint64_t len;
+
+    if (!read_varint(rd, len) || rd.remaining() < len)
+    {
+        rd.rewind(start);
+        return {};
+    }
+
+    if (s->get_string_views())
+    {
+        shared_view vw;
+        rd.read(vw, len);
+        return std::move(vw);
+    }
+
+    std::string str(len, '\0');
+    rd.read(reinterpret_cast<uint8_t*>(&str[0]), len);
+
+    return std::move(str);
+}
+
+// columns of homogeneous varlists (shorter lists are cheap enough element by element,
+// and their varints are often smaller than the fixed size values)
+
+static const size_t min_column_size = 16;
+
+template<class T>
+static void write_column(const varlist& vl, buffer* buf)
+{
+    size_t len = vl.size() * sizeof(T);
+    uint8_t* p = buf->prepare(len);
+
+    for (size_t i = 0; i < vl.size(); ++i)
+    {
+        T t = vl[i].get<T>();
+        std::memcpy(p + i * sizeof(T), &t, sizeof(T));
+    }
+
+    convert_little_endian<sizeof(T)>(p, vl.size());
+    buf->commit(len);
+}
+
+template<class T>
+static bool read_column(buffer_reader& rd, size_t count, varlist& vl)
+{
+    if (count > rd.remaining() / sizeof(T)) return false;
+
+    std::vector<T> column(count);
+    if (!read_block(rd, column.data(), count)) return false;
+
+    vl.reserve(count);
+    for (const T& t : column) vl.emplace_back(t);
+
+    return true;
+}
+
+static bool write_compact_void(const var&, buffer*, const serializer*)
+{
+    return true;
+}
+
+
+thread_local c_serializer::scratch_guard::scratch c_serializer::scratch_guard::sm_scratch;
+
+c_serializer::scratch_guard::scratch_guard()
+ : m_acquired(!sm_scratch.in_use)
+{
+    sm_scratch.in_use = true;
+}
+
+c_serializer::scratch_guard::~scratch_guard()
+{
+    if (m_acquired) sm_scratch.in_use = false;
+}
+
+bool c_serializer::scratch_guard::acquired() const
+{
+    return m_acquired;
+}
+
+c_buffer* c_serializer::scratch_guard::get()
+{
+    return &sm_scratch.buf;
+}
+
+
+c_serializer::rule_table::rule_table(const std::map<size_t, const rule*>& rules)
+{
+    // at most half of the slots are used, so probe sequences stay short
+    size_t size = 16;
+    while (size < rules.size() * 2) size *= 2;
+
+    m_slots.resize(size, slot {0, nullptr});
+    m_mask = size - 1;
+
+    for (auto& r : rules)
+    {
+        size_t i = r.first & m_mask;
+        while (m_slots[i].m_rule != nullptr) i = (i + 1) & m_mask;
+        m_slots[i] = slot {r.first, r.second};
+    }
+}
+
+const c_serializer::rule* c_serializer::rule_table::find(size_t hash) const
+{
+    for (size_t i = hash & m_mask; m_slots[i].m_rule != nullptr; i = (i + 1) & m_mask)
+    {
+        if (m_slots[i].m_hash == hash) return m_slots[i].m_rule;
+    }
+
+    return nullptr;
+}
+
+
+c_serializer::c_serializer(application* app)
+ : m_app(app)
+ , m_table(nullptr)
+ , m_string_views(false)
+{
+    publish_rules();
+
+    add_trivial_rule<int8_t>();
+    add_trivial_rule<uint8_t>();
+    add_trivial_rule<int16_t>();
+    add_trivial_rule<uint16_t>();
+    add_trivial_rule<int32_t>();
+    add_trivial_rule<uint32_t>();
+    add_trivial_rule<int64_t>();
+    add_trivial_rule<uint64_t>();
+    //add_trivial_rule<float>();
+    //add_trivial_rule<double>();
+    add_reader_rule(typeid(varlist), serialize_varlist, read_varlist);
+    add_reader_rule(typeid(std::string),
+        [](const var& v, buffer* buf, const serializer*) { return serialize_string(v, buf); },
+        read_text);
+    add_reader_rule(typeid(shared_view), serialize_shared_view, read_text);
+    add_reader_rule(typeid(void),
+        [](const var& v, buffer* buf, const serializer*) { return serialize_void(v, buf); },
+        read_void);
+    add_reader_rule(typeid(float),
+        [](const var& v, buffer* buf, const serializer*) { return serialize_float(v, buf); },
+        [](buffer_reader& rd, const serializer*) { return read_float(rd); });
+    add_reader_rule(typeid(double),
+        [](const var& v, buffer* buf, const serializer*) { return serialize_double(v, buf); },
+        [](buffer_reader& rd, const serializer*) { return read_double(rd); });
+
+    add_array_rule<int8_t>();
+    add_array_rule<uint8_t>();
+    add_array_rule<int16_t>();
+    add_array_rule<uint16_t>();
+    add_array_rule<int32_t>();
+    add_array_rule<uint32_t>();
+    add_array_rule<int64_t>();
+    add_array_rule<uint64_t>();
+    add_array_rule<float>();
+    add_array_rule<double>();
+}
+
+c_serializer::~c_serializer()
+{
+}
+
+application* c_serializer::get_app() const
+{
+    return m_app;
+}
+
+unsigned c_serializer::get_format_version() const
+{
+    return 1;
+}
+
+void c_serializer::set_string_views(bool enabled)
+{
+    m_string_views.store(enabled);
+}
+
+bool c_serializer::get_string_views() const
+{
+    return m_string_views.load();
+}
+
+std::vector<uint64_t> c_serializer::get_type_table() const
+{
+    tthread::lock_guard<tthread::mutex> guard(m_mutex);
+
+    std::vector<uint64_t> types;
+    types.reserve(m_rules.size());
+    for (auto& r : m_rules) types.push_back(r.first);
+
+    return types;
+}
+
+void c_serializer::add_rule_ex(typeinfo ti, serializer_func_ex sfunc, deserializer_func_ex dfunc)
+{
+    insert_rule(new rule {ti, sfunc, dfunc, nullptr});
+}
+
+void c_serializer::add_reader_rule(typeinfo ti, serializer_func_ex sfunc, reader_func rfunc)
+{
+    insert_rule(new rule {ti, sfunc, nullptr, rfunc});
+}
+
+void c_serializer::add_rule(typeinfo ti, serializer_func sfunc, deserializer_func dfunc)
+{
+    add_rule_ex(ti,
+        [=](const var& v, buffer* buf, const serializer*)->bool { return sfunc(v, buf); },
+        [=](buffer* buf, const serializer*)->optional<var> { return dfunc(buf); });
+}
+
+void c_serializer::remove_rule(typeinfo ti)
+{
+    tthread::lock_guard<tthread::mutex> guard(m_mutex);
+
+    auto pos = m_rules.find(ti.get_hash());
+    if (pos != m_rules.end())
+    {
+        m_rules.erase(pos);
+        m_replaceable_rules.erase(ti.get_hash());
+        publish_rules();
+    }
+}
+
+// user code could have rules for the arrays before they were built in, those are kept working
+template<class T>
+void c_serializer::add_array_rule()
+{
+    add_reader_rule(typeid(std::vector<T>), serialize_array<T>, read_array<T>);
+    m_replaceable_rules.insert(typeinfo(typeid(std::vector<T>)).get_hash());
+}
+
+void c_serializer::insert_rule(const rule* r)
+{
+    std::unique_ptr<const rule> new_rule(r);
+    size_t hash = r->m_type.get_hash();
+
+    tthread::lock_guard<tthread::mutex> guard(m_mutex);
+
+    if (m_rules.count(hash) > 0 && m_replaceable_rules.erase(hash) == 0)
+        throw std::runtime_error("rule already added");
+
+    m_rule_storage.push_back(std::move(new_rule));
+    m_rules[hash] = r;
+
+    publish_rules();
+}
+
+void c_serializer::publish_rules()
+{
+    m_table_storage.emplace_back(new rule_table(m_rules));
+    m_table.store(m_table_storage.back().get());
+}
+
+const c_serializer::rule* c_serializer::find_rule(size_t hash) const
+{
+    return m_table.load()->find(hash);
+}
+
+bool c_serializer::serialize_in_place(const rule* r, size_t hash, const var& v, c_buffer* buf) const
+{
+    size_t mark = buf->available();
+
+    buf->push(reinterpret_cast<const uint8_t*>(&hash), sizeof(size_t));
+    if (r->m_sfunc(v, buf, this)) // successful serialization
+        return true;
+
+    buf->truncate(mark);
+    return false;
+}
+
+optional<var> c_serializer::read_with_rule(const rule* r, buffer_reader& rd, const serializer* s)
+{
+    if (r->m_rfunc) return r->m_rfunc(rd, s);
+
+    reader_buffer rbuf(rd);
+    return r->m_dfunc(&rbuf, s);
+}
+
+template<class F>
+bool c_serializer::write_message(buffer* buf, F write)
+{
+    grab_guard bufgrab(buf);
+
+    // an unsynchronized buffer is only used by this thread, so the message can be
+    // written in place (nested rules get here too, as they write to the same buffer)
+    c_buffer* dest = dynamic_cast<c_buffer*>(buf);
+    if (dest != nullptr && !dest->is_synchronized())
+        return write(dest);
+
+    // shared buffers have to receive the message at once, so it's assembled in the
+    // scratch buffer of the thread (unless a rule serializes to a shared buffer too)
+    c_buffer tmpbuf(false);
+    scratch_guard scratch;
+    c_buffer* msg = scratch.acquired() ? scratch.get() : &tmpbuf;
+
+    bool result = write(msg);
+    if (result) buf->push(msg);
+
+    msg->advance(msg->available()); // keeps the last chunk for the next message
+    return result;
+}
+
+// the header is reserved at the beginning of the scratch buffer and filled when the
+// length is known (the scratch buffer never spills, so the header stays in memory)
+template<class F>
+bool c_serializer::write_frame(buffer* buf, bool checksum, F write)
+{
+    grab_guard bufgrab(buf);
+
+    c_buffer tmpbuf(false);
+    scratch_guard scratch;
+    c_buffer* msg = scratch.acquired() ? scratch.get() : &tmpbuf;
+
+    size_t header_len = checksum ? 8 : 4;
+    uint8_t* header = msg->prepare(header_len);
+    msg->commit(header_len);
+
+    bool result = write(msg);
+    size_t len = msg->available() - header_len;
+
+    if (result && len <= max_frame_length)
+    {
+        if (checksum)
+        {
+            write_le32(header, len | frame_checksum_flag);
+            write_le32(header + 4, crc32(msg->view(header_len, len)));
+        }
+        else
+        {
+            write_le32(header, len);
+        }
+
+        buf->push(msg);
+    }
+    else
+    {
+        result = false;
+    }
+
+    msg->advance(msg->available()); // keeps the last chunk for the next message
+    return result;
+}
+
+bool c_serializer::serialize(const var& v, buffer* buf) const
+{
+    if (buf == nullptr) return false;
+
+    size_t hash = v.get_descriptor().hash();
+
+    const rule* r = find_rule(hash);
+    if (r == nullptr) return false;
+
+    return write_message(buf, [&](c_buffer* dest) { return serialize_in_place(r, hash, v, dest); });
+}
+
+optional<var> c_serializer::deserialize(buffer* buf) const
+{
+    if (buf == nullptr) return {};
+    return read_from(buf, [this](buffer_reader& rd) { return deserialize(rd); });
+}
+
+optional<var> c_serializer::deserialize(buffer_reader& rd) const
+{
+    size_t start = rd.position();
+    size_t hash;
+
+    if (!rd.read(hash)) return {};
+
+    const rule* r = find_rule(hash);
+    if (r != nullptr)
+    {
+        optional<var> v = read_with_rule(r, rd, this);
+        if (v) return std::move(*v);
+    }
+
+    rd.rewind(start);
+    return {};
+}
+
+bool c_serializer::serialize_frame(const var& v, buffer* buf, bool checksum) const
+{
+    if (buf == nullptr) return false;
+
+    size_t hash = v.get_descriptor().hash();
+
+    const rule* r = find_rule(hash);
+    if (r == nullptr) return false;
+
+    return write_frame(buf, checksum, [&](c_buffer* dest) { return serialize_in_place(r, hash, v, dest); });
+}
+
+optional<var> c_serializer::deserialize_frame(buffer* buf) const
+{
+    return read_frame(buf, [this](buffer_reader& rd) { return deserialize(rd); });
+}
+
+incremental_deserializer* c_serializer::create_incremental_deserializer(bool framed) const
+{
+    return new c_incremental_deserializer(this, this, nullptr, framed);
+}
+
+varlist c_serializer::deserialize_all(buffer* buf) const
+{
+    if (buf == nullptr) return {};
+
+    grab_guard bufgrab(buf);
+    buffer_reader rd(buf);
+    varlist vl;
+
+    for(;;)
+    {
+        optional<var> v = deserialize(rd);
+        if (v) vl.push_back( std::move(*v) );
+        else break;
+    }
+
+    rd.commit();
+    return vl;
+}
+
+
+const size_t c_compact_serializer::name_dictionary::max_names;
+const size_t c_compact_serializer::name_dictionary::max_name_length;
+const size_t c_compact_serializer::name_dictionary::npos;
+
+size_t c_compact_serializer::name_dictionary::size() const
+{
+    return m_names.size();
+}
+
+size_t c_compact_serializer::name_dictionary::find(const std::string& name) const
+{
+    auto it = m_ids.find(name);
+    return (it != m_ids.end()) ? it->second : npos;
+}
+
+const std::string* c_compact_serializer::name_dictionary::get(size_t id) const
+{
+    return (id < m_names.size()) ? &m_names[id] : nullptr;
+}
+
+void c_compact_serializer::name_dictionary::add(const std::string& name)
+{
+    if (m_names.size() >= max_names || name.length() > max_name_length) return;
+
+    m_ids.insert( std::make_pair(name, m_names.size()) );
+    m_names.push_back(name);
+}
+
+void c_compact_serializer::name_dictionary::truncate(size_t size)
+{
+    while (m_names.size() > size)
+    {
+        auto it = m_ids.find(m_names.back());
+        if (it != m_ids.end() && it->second == m_names.size() - 1) m_ids.erase(it);
+        m_names.pop_back();
+    }
+}
+
+
+c_compact_serializer::c_compact_serializer(c_serializer* base, const std::vector<uint64_t>& type_table)
+ : m_base(base)
+ , m_types(type_table.begin(), type_table.end())
+{
+    for (size_t i = 0; i < m_types.size(); ++i)
+        m_tags.insert( std::make_pair(m_types[i], i + 1) );
+}
+
+c_compact_serializer::~c_compact_serializer()
+{
+}
+
+const std::unordered_map<size_t, c_compact_serializer::codec>& c_compact_serializer::get_codecs()
+{
+    static const std::unordered_map<size_t, codec> codecs =
+    {
+        { typeinfo(typeid(int8_t)).get_hash(),      { write_compact_signed<int8_t>, read_compact_signed<int8_t> } },
+        { typeinfo(typeid(uint8_t)).get_hash(),     { write_compact_unsigned<uint8_t>, read_compact_unsigned<uint8_t> } },
+        { typeinfo(typeid(int16_t)).get_hash(),     { write_compact_signed<int16_t>, read_compact_signed<int16_t> } },
+        { typeinfo(typeid(uint16_t)).get_hash(),    { write_compact_unsigned<uint16_t>, read_compact_unsigned<uint16_t> } },
+        { typeinfo(typeid(int32_t)).get_hash(),     { write_compact_signed<int32_t>, read_compact_signed<int32_t> } },
+        { typeinfo(typeid(uint32_t)).get_hash(),    { write_compact_unsigned<uint32_t>, read_compact_unsigned<uint32_t> } },
+        { typeinfo(typeid(int64_t)).get_hash(),     { write_compact_signed<int64_t>, read_compact_signed<int64_t> } },
+        { typeinfo(typeid(uint64_t)).get_hash(),    { write_compact_unsigned<uint64_t>, read_compact_unsigned<uint64_t> } },
+        { typeinfo(typeid(float)).get_hash(),       { write_compact_float<float>, read_compact_float<float> } },
+        { typeinfo(typeid(double)).get_hash(),      { write_compact_float<double>, read_compact_float<double> } },
+        { typeinfo(typeid(std::string)).get_hash(), { write_compact_string, read_compact_string } },
+        { typeinfo(typeid(shared_view)).get_hash(), { write_compact_view, read_compact_string } },
+        { typeinfo(typeid(varlist)).get_hash(),     { write_varlist, read_varlist } },
+        { typeinfo(typeid(void)).get_hash(),        { write_compact_void, read_void } }
+    };
+
+    return codecs;
+}
+
+const std::unordered_map<size_t, c_compact_serializer::column_codec>& c_compact_serializer::get_column_codecs()
+{
+    static const std::unordered_map<size_t, column_codec> codecs =
+    {
+        { typeinfo(typeid(int8_t)).get_hash(),   { write_column<int8_t>, read_column<int8_t> } },
+        { typeinfo(typeid(uint8_t)).get_hash(),  { write_column<uint8_t>, read_column<uint8_t> } },
+        { typeinfo(typeid(int16_t)).get_hash(),  { write_column<int16_t>, read_column<int16_t> } },
+        { typeinfo(typeid(uint16_t)).get_hash(), { write_column<uint16_t>, read_column<uint16_t> } },
+        { typeinfo(typeid(int32_t)).get_hash(),  { write_column<int32_t>, read_column<int32_t> } },
+        { typeinfo(typeid(uint32_t)).get_hash(), { write_column<uint32_t>, read_column<uint32_t> } },
+        { typeinfo(typeid(int64_t)).get_hash(),  { write_column<int64_t>, read_column<int64_t> } },
+        { typeinfo(typeid(uint64_t)).get_hash(), { write_column<uint64_t>, read_column<uint64_t> } },
+        { typeinfo(typeid(float)).get_hash(),    { write_column<float>, read_column<float> } },
+        { typeinfo(typeid(double)).get_hash(),   { write_column<double>, read_column<double> } }
+    };
+
+    return codecs;
+}
+
+/*
+ * The count of a varlist is shifted left by one and the lowest bit tells if its
+ * elements are the same kind of number. Then it's followed by the type tag of the
+ * elements and their little endian values as one block, otherwise by the values.
+ */
+bool c_compact_serializer::write_varlist(const var& v, buffer* buf, const serializer* s)
+{
+    const c_compact_serializer* cs = static_cast<const c_compact_serializer*>(s);
+    const varlist& vl = v.get<varlist>();
+    const column_codec* column = nullptr;
+
+    if (vl.size() >= min_column_size)
+    {
+        const type_descriptor& type = vl.front().get_descriptor();
+        auto c = get_column_codecs().find(type.hash());
+
+        if (c != get_column_codecs().end() &&
+            std::all_of(vl.begin(), vl.end(), [&](const var& subv) { return subv.get_descriptor().is_same(type); }))
+        {
+            column = &c->second;
+        }
+    }
+
+    if (column != nullptr)
+    {
+        write_varint(buf, ((uint64_t)vl.size() << 1) | 1);
+        cs->write_tag(vl.front().get_descriptor().hash(), buf);
+        column->m_write(vl, buf);
+        return true;
+    }
+
+    write_varint(buf, (uint64_t)vl.size() << 1);
+
+    for (const var& subv : vl)
+    {
+        if (!s->serialize(subv, buf)) return false;
+    }
+
+    return true;
+}
+
+optional<var> c_compact_serializer::read_varlist(buffer_reader& rd, const serializer* s)
+{
+    const c_compact_serializer* cs = static_cast<const c_compact_serializer*>(s);
+    size_t start = rd.position();
+    uint64_t header;
+    varlist vl;
+
+    if (read_varint(rd, header))
+    {
+        uint64_t vlsize = header >> 1;
+
+        if (header & 1)
+        {
+            size_t hash;
+            if (cs->read_tag(rd, hash))
+            {
+                auto c = get_column_codecs().find(hash);
+                if (c != get_column_codecs().end() && c->second.m_read(rd, vlsize, vl))
+                    return std::move(vl);
+            }
+        }
+        else if (vlsize <= rd.remaining()) // every element takes at least a byte
+        {
+            vl.reserve(vlsize);
+
+            for (; vlsize > 0; --vlsize)
+            {
+                optional<var> v = s->deserialize(rd);
+                if (!v) break;
+                vl.push_back(std::move(*v));
+            }
+
+            if (vlsize == 0) return std::move(vl);
+        }
+    }
+
+    rd.rewind(start);
+    return {};
+}
+
+void c_compact_serializer::write_tag(size_t hash, buffer* buf) const
+{
+    auto tag = m_tags.find(hash);
+    if (tag != m_tags.end())
+    {
+        write_varint(buf, tag->second);
+    }
+    else
+    {
+        uint64_t hash64 = hash;
+        buf->push(static_cast<uint8_t>(0));
+        buf->push(reinterpret_cast<const uint8_t*>(&hash64), sizeof(uint64_t));
+    }
+}
+
+bool c_compact_serializer::read_tag(buffer_reader& rd, size_t& hash) const
+{
+    size_t start = rd.position();
+    uint64_t tag;
+
+    if (!read_varint(rd, tag)) return false;
+
+    if (tag == 0)
+    {
+        uint64_t hash64;
+        if (rd.read(hash64))
+        {
+            hash = hash64;
+            return true;
+        }
+    }
+    else if (tag <= m_types.size())
+    {
+        hash = m_types[tag - 1];
+        return true;
+    }
+
+    rd.rewind(start);
+    return false;
+}
+
+application* c_compact_serializer::get_app() const
+{
+    return m_base->get_app();
+}
+
+unsigned c_compact_serializer::get_format_version() const
+{
+    return 2;
+}
+
+void c_compact_serializer::set_string_views(bool enabled)
+{
+    m_base->set_string_views(enabled);
+}
+
+bool c_compact_serializer::get_string_views() const
+{
+    return m_base->get_string_views();
+}
+
+// rules are shared with the base serializer, but the new types can only be sent
+// with their hash (tag 0), since they are missing from the agreed type table
+
+void c_compact_serializer::add_rule_ex(typeinfo ti, serializer_func_ex sfunc, deserializer_func_ex dfunc)
+{
+    m_base->add_rule_ex(ti, sfunc, dfunc);
+}
+
+void c_compact_serializer::add_rule(typeinfo ti, serializer_func sfunc, deserializer_func dfunc)
+{
+    m_base->add_rule(ti, sfunc, dfunc);
+}
+
+void c_compact_serializer::add_reader_rule(typeinfo ti, serializer_func_ex sfunc, reader_func rfunc)
+{
+    m_base->add_reader_rule(ti, sfunc, rfunc);
+}
+
+void c_compact_serializer::remove_rule(typeinfo ti)
+{
+    m_base->remove_rule(ti);
+}
+
+bool c_compact_serializer::write_value(const var& v, c_buffer* buf, size_t max_len) const
+{
+    size_t hash = v.get_descriptor().hash();
+    auto c = get_codecs().find(hash);
+    const c_serializer::rule* r = nullptr;
+
+    if (c == get_codecs().end())
+    {
+        r = m_base->find_rule(hash);
+        if (r == nullptr) return false;
+    }
+
+    size_t mark = buf->available();
+    size_t names = m_names.size();
+    write_tag(hash, buf);
+
+    bool result = (r == nullptr) ? c->second.m_write(v, buf, this) : r->m_sfunc(v, buf, this);
+    if (result && buf->available() - mark > max_len) result = false;
+
+    if (!result)
+    {
+        buf->truncate(mark);
+        m_names.truncate(names); // the reader won't see them
+    }
+
+    return result;
+}
+
+bool c_compact_serializer::serialize(const var& v, buffer* buf) const
+{
+    if (buf == nullptr) return false;
+    return c_serializer::write_message(buf, [&](c_buffer* dest) { return write_value(v, dest); });
+}
+
+optional<var> c_compact_serializer::deserialize(buffer* buf) const
+{
+    if (buf == nullptr) return {};
+    return read_from(buf, [this](buffer_reader& rd) { return deserialize(rd); });
+}
+
+optional<var> c_compact_serializer::deserialize(buffer_reader& rd) const
+{
+    size_t start = rd.position();
+    size_t names = m_names.size();
+    size_t hash;
+
+    if (!read_tag(rd, hash)) return {};
+
+    optional<var> v;
+
+    auto c = get_codecs().find(hash);
+    if (c != get_codecs().end())
+    {
+        v = c->second.m_read(rd, this);
+    }
+    else
+    {
+        const c_serializer::rule* r = m_base->find_rule(hash);
+        if (r != nullptr) v = c_serializer::read_with_rule(r, rd, this);
+    }
+
+    if (v) return std::move(*v);
+
+    rd.rewind(start);
+    m_names.truncate(names); // they are read again with the rest of the message
+    return {};
+}
+
+bool c_compact_serializer::serialize_frame(const var& v, buffer* buf, bool checksum) const
+{
+    if (buf == nullptr) return false;
+    // a frame that is too long is dropped, so its names have to be rolled back here
+    return c_serializer::write_frame(buf, checksum, [&](c_buffer* dest) { return write_value(v, dest, max_frame_length); });
+}
+
+optional<var> c_compact_serializer::deserialize_frame(buffer* buf) const
+{
+    return read_frame(buf, [this](buffer_reader& rd) { return deserialize(rd); });
+}
+
+incremental_deserializer* c_compact_serializer::create_incremental_deserializer(bool framed) const
+{
+    return new c_incremental_deserializer(this, m_base, this, framed);
+}
+
+varlist c_compact_serializer::deserialize_all(buffer* buf) const
+{
+    if (buf == nullptr) return {};
+
+    grab_guard bufgrab(buf);
+    buffer_reader rd(buf);
+    varlist vl;
+
+    for(;;)
+    {
+        optional<var> v = deserialize(rd);
+        if (v) vl.push_back( std::move(*v) );
+        else break;
+    }
+
+    rd.commit();
+    return vl;
+}
+
+/*
+ * A name is either a varint id shifted left by one, or its length shifted left by
+ * one with the lowest bit set, followed by the string (which gets the next id).
+ */
+void c_compact_serializer::write_name(const std::string& name, buffer* buf) const
+{
+    size_t id = m_names.find(name);
+    if (id != name_dictionary::npos)
+    {
+        write_varint(buf, (uint64_t)id << 1);
+        return;
+    }
+
+    write_varint(buf, ((uint64_t)name.length() << 1) | 1);
+    buf->push(reinterpret_cast<const uint8_t*>(name.c_str()), name.length());
+    m_names.add(name);
+}
+
+bool c_compact_serializer::read_name(buffer_reader& rd, std::string& name) const
+{
+    size_t start = rd.position();
+    uint64_t header;
+
+    if (read_varint(rd, header))
+    {
+        uint64_t value = header >> 1;
+
+        if ((header & 1) && value <= rd.remaining())
+        {
+            name.assign(value, '\0');
+            rd.read(reinterpret_cast<uint8_t*>(&name[0]), value);
+            m_names.add(name);
+            return true;
+        }
+        else if (!(header & 1) && value < m_names.size())
+        {
+            name = *m_names.get(value);
+            return true;
+        }
+    }
+
+    rd.rewind(start);
+    return false;
+}
+
+
+c_incremental_deserializer::c_incremental_deserializer(const serializer* srl, const c_serializer* base,
+                                                       const c_compact_serializer* compact, bool framed)
+ : m_srl(srl)
+ , m_base(base)
+ , m_compact(compact)
+ , m_framed(framed)
+ , m_in_frame(false)
+ , m_skip_frame(false)
+ , m_broken(false)
+ , m_frame_left(0)
+ , m_checksum(false)
+ , m_crc(0)
+ , m_expected_crc(0)
+ , m_in_string(false)
+ , m_str_left(0)
+{
+}
+
+c_incremental_deserializer::~c_incremental_deserializer()
+{
+}
+
+bool c_incremental_deserializer::start_frame(buffer_reader& rd)
+{
+    size_t start = rd.position();
+    uint8_t header[4];
+
+    if (!rd.read(header, 4)) return false;
+
+    uint32_t len = read_le32(header);
+    m_checksum = (len & frame_checksum_flag);
+    m_frame_left = (len & max_frame_length);
+    m_crc = 0;
+
+    if (m_checksum)
+    {
+        if (!rd.read(header, 4))
+        {
+            rd.rewind(start);
+            return false;
+        }
+
+        m_expected_crc = read_le32(header);
+    }
+
+    m_in_frame = true;
+    return true;
+}
+
+bool c_incremental_deserializer::read_type(buffer_reader& rd, size_t& hash) const
+{
+    if (m_compact != nullptr) return m_compact->read_tag(rd, hash);
+    else return rd.read(hash);
+}
+
+/*
+ * Decodes until the value is finished or the cursor reaches 'end' or 'budget_end'.
+ * 'whole' means that nothing follows before 'end' (the frame has fully arrived),
+ * so a value that doesn't fit is broken instead of incomplete.
+ */
+incremental_deserializer::status c_incremental_deserializer::decode(buffer_reader& rd, size_t end, bool whole, size_t budget_end)
+{
+    static const size_t string_hash = typeinfo(typeid(std::string)).get_hash();
+    static const size_t varlist_hash = typeinfo(typeid(varlist)).get_hash();
+
+    // headers and atomic values might have been read past the end of the frame
+    auto incomplete = [&](size_t start)
+    {
+        rd.rewind(start);
+        return whole ? failed : in_progress;
+    };
+
+    for (;;)
+    {
+        if (rd.position() >= budget_end) return in_progress;
+        if (rd.position() >= end) return whole ? failed : in_progress;
+
+        if (m_in_string)
+        {
+            size_t n = std::min(m_str_left, std::min(end, budget_end) - rd.position());
+            size_t len = m_str.length();
+
+            // the whole string can still arrive in one piece, which is taken as a view
+            shared_view vw;
+            if (len == 0 && n == m_str_left && m_srl->get_string_views() && rd.read(vw, n))
+            {
+                m_in_string = false;
+                m_str_left = 0;
+                if (complete(std::move(vw))) return finished;
+                continue;
+            }
+
+            if (len == 0) m_str.reserve(std::min<size_t>(m_str_left, 64 * 1024)); // the length isn't trusted yet
+            m_str.resize(len + n);
+            rd.read(reinterpret_cast<uint8_t*>(&m_str[len]), n);
+            m_str_left -= n;
+
+            if (m_str_left == 0)
+            {
+                m_in_string = false;
+
+                // a string put together from pieces is already a copy
+                var str(std::move(m_str));
+                m_str = std::string();
+                if (complete(std::move(str))) return finished;
+            }
+
+            continue;
+        }
+
+        size_t start = rd.position();
+        size_t hash;
+
+        if (!read_type(rd, hash) || rd.position() > end) return incomplete(start);
+        if (m_base->find_rule(hash) == nullptr) return failed;
+
+        if (hash == string_hash)
+        {
+            size_t len;
+            if (!read_length(rd, len, m_srl) || rd.position() > end) return incomplete(start);
+            if (m_framed && len > m_frame_left) return failed; // can't fit in the frame
+
+            // a string that has fully arrived can be a view, otherwise it's copied in pieces
+            shared_view vw;
+            if (m_srl->get_string_views() && len <= end - rd.position() && rd.read(vw, len))
+            {
+                if (complete(std::move(vw))) return finished;
+                continue;
+            }
+
+            if (len == 0)
+            {
+                if (complete(std::string())) return finished;
+                continue;
+            }
+
+            m_in_string = true;
+            m_str_left = len;
+            continue;
+        }
+
+        if (hash == varlist_hash)
+        {
+            size_t count = 0;
+            bool column = false;
+
+            if (m_compact != nullptr)
+            {
+                uint64_t header;
+                if (!read_varint(rd, header)) return incomplete(start);
+
+                count = header >> 1;
+                column = (header & 1);
+            }
+            else
+            {
+                uint16_t count16;
+                if (!rd.read(count16)) return incomplete(start);
+
+                count = count16;
+            }
+
+            if (rd.position() > end) return incomplete(start);
+
+            if (!column) // columns are decoded at once like any other value
+            {
+                if (count == 0)
+                {
+                    if (complete(varlist())) return finished;
+                    continue;
+                }
+
+                if (m_framed && count > m_frame_left) return failed; // every element takes at least a byte
+
+                level lvl { varlist(), count };
+                lvl.m_list.reserve(std::min<size_t>(count, 4096));
+                m_stack.push_back(std::move(lvl));
+                continue;
+            }
+        }
+
+        size_t names = (m_compact != nullptr) ? m_compact->m_names.size() : 0;
+
+        rd.rewind(start);
+        optional<var> v = m_srl->deserialize(rd);
+        if (!v || rd.position() > end)
+        {
+            if (m_compact != nullptr) m_compact->m_names.truncate(names);
+            return incomplete(start);
+        }
+
+        if (complete(std::move(*v))) return finished;
+    }
+}
+
+bool c_incremental_deserializer::complete(var&& v)
+{
+    while (!m_stack.empty())
+    {
+        level& lvl = m_stack.back();
+        lvl.m_list.push_back(std::move(v));
+        if (--lvl.m_left > 0) return false;
+
+        v = std::move(lvl.m_list);
+        m_stack.pop_back();
+    }
+
+    m_result = optional<var>(std::move(v)); // assigning a var would replace the inner var
+    return true;
+}
+
+void c_incremental_deserializer::clear_value()
+{
+    m_stack.clear();
+    m_in_string = false;
+    m_str = std::string();
+    m_str_left = 0;
+}
+
+incremental_deserializer::status c_incremental_deserializer::feed(buffer* buf, size_t max_bytes)
+{
+    if (buf == nullptr) return failed;
+    if (m_broken) return broken;
+    if (m_result) return finished; // the previous result wasn't taken yet
+
+    grab_guard bufgrab(buf);
+    buffer_reader rd(buf);
+    size_t budget_end = (max_bytes > 0) ? max_bytes : std::numeric_limits<size_t>::max();
+    status st;
+
+    if (!m_framed)
+    {
+        st = decode(rd, rd.remaining(), false, budget_end);
+        if (st == failed) clear_value();
+
+        rd.commit();
+        return st;
+    }
+
+    // a corrupt frame could have been damaged anywhere, and in format v2 the names
+    // interned by the sender in a failed frame are missing here, so the ids of the
+    // later frames would point to the wrong names
+    auto break_stream = [&]()
+    {
+        clear_value();
+        m_result = optional<var>();
+        m_broken = true;
+        rd.commit();
+        return broken;
+    };
+
+    if (m_skip_frame)
+    {
+        if (!skip_frame(buf, rd))
+        {
+            rd.commit();
+            return in_progress;
+        }
+
+        if (m_checksum && m_crc != m_expected_crc) return break_stream();
+    }
+
+    if (!m_in_frame && !start_frame(rd))
+    {
+        rd.commit();
+        return in_progress;
+    }
+
+    size_t start = rd.position();
+    size_t frame_end = start + m_frame_left;
+    size_t end = std::min(frame_end, start + rd.remaining());
+
+    st = decode(rd, end, (frame_end == end), budget_end);
+
+    size_t used = rd.position() - start;
+    if (m_checksum) m_crc = crc32(buf->view(start, used), m_crc);
+    m_frame_left -= used;
+
+    if (st == finished && m_frame_left > 0)
+    {
+        m_result = optional<var>(); // the message has to fill the frame
+        st = failed;
+    }
+
+    if ((st == finished && m_checksum && m_crc != m_expected_crc) || (st == failed && m_compact != nullptr))
+        return break_stream();
+
+    if (st == finished)
+    {
+        m_in_frame = false;
+    }
+    else if (st == failed)
+    {
+        clear_value();
+
+        // the checksum is verified once the rest of the frame is skipped
+        if (skip_frame(buf, rd) && m_checksum && m_crc != m_expected_crc)
+            return break_stream();
+    }
+
+    rd.commit();
+    return st;
+}
+
+// skips the frame as far as it has arrived, the skipped bytes are still added to the checksum
+bool c_incremental_deserializer::skip_frame(buffer* buf, buffer_reader& rd)
+{
+    size_t n = std::min(m_frame_left, rd.remaining());
+    if (m_checksum) m_crc = crc32(buf->view(rd.position(), n), m_crc);
+    rd.skip(n);
+    m_frame_left -= n;
+
+    m_skip_frame = (m_frame_left > 0);
+    m_in_frame = m_skip_frame;
+    return !m_skip_frame;
+}
+
+optional<var> c_incremental_deserializer::get_result()
+{
+    optional<var> v = std::move(m_result);
+    m_result = optional<var>();
+    return v;
+}
+
+void c_incremental_deserializer::reset()
+{
+    clear_value();
+    m_result = optional<var>();
+    m_in_frame = false;
+    m_skip_frame = false;
+    m_broken = false;
+    m_frame_left = 0;
 }
@@ -2,34 +2,252 @@
 #define C_SERIALIZER_HPP_INCLUDED
 
 #include <map>
+#include <memory>
+#include <set>
+#include <unordered_map>
+#include <vector>
 #include "tinythread.h"
+#include "gg/atomic.hpp"
 #include "gg/serializer.hpp"
+#include "c_buffer.hpp"
 
 namespace gg
 {
+    class c_compact_serializer;
+    class c_incremental_deserializer;
+
     class c_serializer : public serializer
     {
+        friend class c_compact_serializer;
+        friend class c_incremental_deserializer;
+
         struct rule
         {
             typeinfo m_type;
             serializer_func_ex m_sfunc;
             deserializer_func_ex m_dfunc;
+            reader_func m_rfunc; // preferred over m_dfunc if set
+        };
+
+        /*
+         * Open addressing (linear probing) table of the rules, never modified once
+         * it's published. Adding or removing a rule builds a new table and swaps the
+         * pointer, so serialize() and deserialize() don't need any lock.
+         */
+        class rule_table
+        {
+            struct slot
+            {
+                size_t m_hash;
+                const rule* m_rule;
+            };
+
+            std::vector<slot> m_slots;
+            size_t m_mask;
+
+        public:
+            rule_table(const std::map<size_t, const rule*>& rules);
+            const rule* find(size_t hash) const;
         };
 
-        mutable tthread::recursive_mutex m_mutex;
+        // gives access to the scratch buffer of the thread if nobody else uses it
+        class scratch_guard
+        {
+            struct scratch
+            {
+                c_buffer buf {false};
+                bool in_use = false;
+            };
+
+            static thread_local scratch sm_scratch;
+            bool m_acquired;
+
+        public:
+            scratch_guard();
+            scratch_guard(const scratch_guard&) = delete;
+            ~scratch_guard();
+            bool acquired() const;
+            c_buffer* get();
+        };
+
+        mutable tthread::mutex m_mutex; // only taken by the writers
         mutable application* m_app;
-        std::map<size_t, rule> m_rules;
+        std::map<size_t, const rule*> m_rules;
+        std::set<size_t> m_replaceable_rules; // built-in rules the user can still replace
+        atomic<const rule_table*> m_table;
+        atomic<bool> m_string_views;
+
+        // readers might still use a replaced table or a removed rule, so they are
+        // only freed with the serializer (adding and removing rules is rare)
+        std::vector<std::unique_ptr<const rule>> m_rule_storage;
+        std::vector<std::unique_ptr<const rule_table>> m_table_storage;
+
+        template<class T>
+        void add_array_rule();
+        void insert_rule(const rule*);
+        void publish_rules();
+        const rule* find_rule(size_t hash) const;
+        bool serialize_in_place(const rule*, size_t hash, const var&, c_buffer*) const;
+        static optional<var> read_with_rule(const rule*, buffer_reader&, const serializer*);
+
+        // 'write' gets a c_buffer to put the message to and has to leave it intact if it fails
+        template<class F>
+        static bool write_message(buffer*, F write);
+        template<class F>
+        static bool write_frame(buffer*, bool checksum, F write);
 
     public:
         c_serializer(application* app);
         ~c_serializer();
         application* get_app() const;
+        unsigned get_format_version() const;
+        void set_string_views(bool enabled);
+        bool get_string_views() const;
+        std::vector<uint64_t> get_type_table() const; // hashes of the types with a rule
+        void add_rule_ex(typeinfo, serializer_func_ex, deserializer_func_ex);
+        void add_rule(typeinfo, serializer_func, deserializer_func);
+        void add_reader_rule(typeinfo, serializer_func_ex, reader_func);
+        void remove_rule(typeinfo);
+        bool serialize(const var&, buffer*) const;
+        optional<var> deserialize(buffer*) const;
+        optional<var> deserialize(buffer_reader&) const;
+        varlist deserialize_all(buffer*) const;
+        bool serialize_frame(const var&, buffer*, bool checksum) const;
+        optional<var> deserialize_frame(buffer*) const;
+        incremental_deserializer* create_incremental_deserializer(bool framed) const;
+    };
+
+    /*
+     * Format v2 on top of the rules of a c_serializer. Every value is prefixed with
+     * its index in the type table of the sender as a varint (starting from 1), which
+     * the receiver got during the handshake, so one object serves one direction of a
+     * connection. Tag 0 is followed by the 8 byte hash of a type that was added after
+     * the table was made. The built-in types have compact encodings, other types use
+     * their rules with this object as serializer, so their nested values are compact too.
+     * The names of write_name() are interned, which makes the object stateful: messages
+     * have to be read in the order they were written, one at a time.
+     */
+    class c_compact_serializer : public serializer
+    {
+        friend class c_incremental_deserializer;
+
+        /*
+         * Both ends add a name when its string is sent, so the ids don't have to be sent.
+         * The limits are part of the format, as the reader has to skip the same names.
+         * Names of a failed message are removed by rolling back to the previous size.
+         */
+        class name_dictionary
+        {
+            std::vector<std::string> m_names; // id -> name
+            std::unordered_map<std::string, size_t> m_ids;
+
+        public:
+            static const size_t max_names = 4096;
+            static const size_t max_name_length = 255;
+            static const size_t npos = static_cast<size_t>(-1);
+
+            size_t size() const;
+            size_t find(const std::string&) const; // npos if it's missing
+            const std::string* get(size_t id) const;
+            void add(const std::string&); // unless it's over the limits
+            void truncate(size_t size);
+        };
+
+        struct codec
+        {
+            bool(*m_write)(const var&, buffer*, const serializer*);
+            optional<var>(*m_read)(buffer_reader&, const serializer*);
+        };
+
+        // homogeneous varlists of numbers are written as one block
+        struct column_codec
+        {
+            void(*m_write)(const varlist&, buffer*);
+            bool(*m_read)(buffer_reader&, size_t count, varlist&);
+        };
+
+        static const std::unordered_map<size_t, codec>& get_codecs();
+        static const std::unordered_map<size_t, column_codec>& get_column_codecs();
+        static bool write_varlist(const var&, buffer*, const serializer*);
+        static optional<var> read_varlist(buffer_reader&, const serializer*);
+
+        c_serializer* m_base;
+        std::vector<size_t> m_types; // tag - 1 -> hash
+        std::unordered_map<size_t, uint64_t> m_tags; // hash -> tag
+        mutable name_dictionary m_names;
+
+        void write_tag(size_t hash, buffer*) const;
+        bool read_tag(buffer_reader&, size_t& hash) const;
+        bool write_value(const var&, c_buffer*, size_t max_len = buffer::npos) const; // fails over 'max_len' bytes
+
+    public:
+        c_compact_serializer(c_serializer* base, const std::vector<uint64_t>& type_table);
+        c_compact_serializer(const c_compact_serializer&) = delete;
+        ~c_compact_serializer();
+        application* get_app() const;
+        unsigned get_format_version() const;
+        void set_string_views(bool enabled); // shared with the base serializer
+        bool get_string_views() const;
         void add_rule_ex(typeinfo, serializer_func_ex, deserializer_func_ex);
         void add_rule(typeinfo, serializer_func, deserializer_func);
+        void add_reader_rule(typeinfo, serializer_func_ex, reader_func);
         void remove_rule(typeinfo);
         bool serialize(const var&, buffer*) const;
         optional<var> deserialize(buffer*) const;
+        optional<var> deserialize(buffer_reader&) const;
         varlist deserialize_all(buffer*) const;
+        bool serialize_frame(const var&, buffer*, bool checksum) const;
+        optional<var> deserialize_frame(buffer*) const;
+        incremental_deserializer* create_incremental_deserializer(bool framed) const;
+        void write_name(const std::string&, buffer*) const;
+        bool read_name(buffer_reader&, std::string&) const;
+    };
+
+    /*
+     * Strings and varlists are decoded piece by piece, where the unfinished varlists
+     * are kept in a stack. Everything else goes through the serializer once it has
+     * fully arrived. Frames bound the decoding, so an incomplete value can be told
+     * apart from a broken one, and their checksum is updated with every decoded piece.
+     */
+    class c_incremental_deserializer : public incremental_deserializer
+    {
+        struct level
+        {
+            varlist m_list;
+            size_t m_left;
+        };
+
+        const serializer* m_srl;
+        const c_serializer* m_base;
+        const c_compact_serializer* m_compact; // nullptr in format v1
+        bool m_framed;
+        bool m_in_frame;
+        bool m_skip_frame; // the rest of a broken frame is dropped
+        bool m_broken;     // nothing is decoded after a corrupt frame (or any failed frame in v2)
+        size_t m_frame_left;
+        bool m_checksum;
+        uint32_t m_crc;
+        uint32_t m_expected_crc;
+        std::vector<level> m_stack;
+        bool m_in_string;
+        std::string m_str;
+        size_t m_str_left;
+        optional<var> m_result;
+
+        bool start_frame(buffer_reader&);
+        bool skip_frame(buffer*, buffer_reader&); // true if the whole frame is skipped
+        bool read_type(buffer_reader&, size_t& hash) const;
+        status decode(buffer_reader&, size_t end, bool whole, size_t budget_end);
+        bool complete(var&&);
+        void clear_value();
+
+    public:
+        c_incremental_deserializer(const serializer*, const c_serializer* base, const c_compact_serializer*, bool framed);
+        c_incremental_deserializer(const c_incremental_deserializer&) = delete;
+        ~c_incremental_deserializer();
+        status feed(buffer*, size_t max_bytes = 0);
+        optional<var> get_result();
+        void reset();
     };
 };
 
@@ -0,0 +1,526 @@
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include "c_spsc_buffer.hpp"
+#include "byte_search.hpp"
+#include "c_buffer_pool.hpp"
+#include "c_buffer_registry.hpp"
+
+using namespace gg;
+
+const size_t c_spsc_buffer::initial_size;
+const size_t c_spsc_buffer::max_segment_size;
+const size_t c_spsc_buffer::min_shared_size;
+
+
+c_spsc_buffer::segment::segment(size_t capacity)
+ : m_next(nullptr)
+ , m_head(0)
+ , m_tail(0)
+ , m_capacity(capacity)
+ , m_owner(nullptr)
+{
+}
+
+size_t c_spsc_buffer::segment::space() const
+{
+    // the head is read first: if the reader already moved past shared bytes,
+    // the owner is visible as well, so those bytes are never overwritten
+    size_t used = m_tail.load() - m_head.load();
+    if (m_owner.load() != nullptr) return 0;
+
+    return m_capacity - used;
+}
+
+c_spsc_buffer::segment* c_spsc_buffer::segment::create(size_t capacity)
+{
+    block_pool& pool = block_pool::chunks();
+    void* mem;
+
+    if (sizeof(segment) + capacity <= pool.get_block_size())
+        mem = pool.allocate();
+    else
+        mem = ::operator new(sizeof(segment) + capacity);
+
+    return new (mem) segment(capacity);
+}
+
+void c_spsc_buffer::segment::destroy(segment* s)
+{
+    block_pool& pool = block_pool::chunks();
+    bool pooled = (sizeof(segment) + s->m_capacity <= pool.get_block_size());
+
+    s->~segment();
+
+    if (pooled) pool.release(s);
+    else ::operator delete(static_cast<void*>(s));
+}
+
+void c_spsc_buffer::segment::release(segment* s)
+{
+    segment_owner* owner = s->m_owner.load();
+    if (owner != nullptr) owner->drop();
+    else destroy(s);
+}
+
+
+void* c_spsc_buffer::operator new(size_t size)
+{
+    block_pool& pool = block_pool::objects();
+    if (size <= pool.get_block_size()) return pool.allocate();
+    else return ::operator new(size);
+}
+
+void c_spsc_buffer::operator delete(void* ptr, size_t size)
+{
+    block_pool& pool = block_pool::objects();
+    if (size <= pool.get_block_size()) pool.release(ptr);
+    else ::operator delete(ptr);
+}
+
+
+c_spsc_buffer::c_spsc_buffer()
+ : m_read_seg(segment::create(initial_size))
+ , m_write_seg(m_read_seg)
+ , m_pushed(0)
+ , m_popped(0)
+ , m_prepared(0)
+ , m_tracked(false)
+ , m_high_water(0)
+ , m_pushed_base(0)
+ , m_popped_base(0)
+{
+}
+
+c_spsc_buffer::~c_spsc_buffer()
+{
+    if (m_tracked.load()) disable_tracking();
+
+    while (m_read_seg != nullptr)
+    {
+        segment* next = m_read_seg->m_next.load();
+        segment::release(m_read_seg);
+        m_read_seg = next;
+    }
+}
+
+c_spsc_buffer::segment* c_spsc_buffer::grow(size_t min_len)
+{
+    segment* s = m_write_seg;
+    size_t capacity = s->m_capacity;
+
+    // a full segment means the reader can't keep up, so the next one is bigger
+    if (capacity - (s->m_tail.load() - s->m_head.load()) < min_len)
+        capacity = std::min(capacity * 2, std::max(capacity, max_segment_size));
+
+    while (capacity < min_len) capacity *= 2;
+
+    segment* next = segment::create(capacity);
+    // the writer never touches the old segment after this point
+    s->m_next.store(next);
+    m_write_seg = next;
+    return next;
+}
+
+void c_spsc_buffer::write(const uint8_t* buf, size_t len)
+{
+    size_t written = 0;
+
+    while (written < len)
+    {
+        segment* s = m_write_seg;
+        size_t tail = s->m_tail.load();
+        size_t space = s->space();
+
+        if (space == 0)
+        {
+            grow(1);
+            continue;
+        }
+
+        size_t n = std::min(len - written, space);
+        size_t pos = tail & (s->m_capacity - 1);
+        size_t first = std::min(n, s->m_capacity - pos);
+
+        std::memcpy(s->data() + pos, buf + written, first);
+        std::memcpy(s->data(), buf + written + first, n - first);
+        s->m_tail.store(tail + n);
+        written += n;
+    }
+
+    m_pushed.store(m_pushed.load() + len);
+    track_size();
+}
+
+void c_spsc_buffer::track_size()
+{
+    if (!m_tracked.load()) return;
+
+    size_t size = available();
+    if (size > m_high_water.load()) m_high_water.store(size);
+}
+
+template<class F>
+size_t c_spsc_buffer::for_each_span(size_t start_pos, size_t len, F func) const
+{
+    size_t avail = available();
+    if (start_pos >= avail) return 0;
+
+    // the writer might be ahead of the counter, but only counted bytes are readable
+    len = std::min(len, avail - start_pos);
+    size_t total = 0;
+
+    for (segment* s = m_read_seg; s != nullptr && total < len; )
+    {
+        // the next pointer has to be read first: if it's already set,
+        // the tail of this segment won't move anymore
+        segment* next = s->m_next.load();
+        size_t head = s->m_head.load();
+        size_t tail = s->m_tail.load();
+        size_t mask = s->m_capacity - 1;
+
+        if (start_pos >= tail - head)
+        {
+            start_pos -= tail - head;
+            s = next;
+            continue;
+        }
+
+        head += start_pos;
+        start_pos = 0;
+
+        // readable bytes might wrap around the end of the segment
+        while (head != tail && total < len)
+        {
+            size_t pos = head & mask;
+            size_t n = std::min(std::min(tail - head, s->m_capacity - pos), len - total);
+            func(s->data() + pos, n);
+            head += n;
+            total += n;
+        }
+
+        s = next;
+    }
+
+    return total;
+}
+
+size_t c_spsc_buffer::available() const
+{
+    return (m_pushed.load() - m_popped.load());
+}
+
+void c_spsc_buffer::advance(size_t len)
+{
+    len = std::min(len, available());
+    size_t left = len;
+
+    while (left > 0)
+    {
+        segment* s = m_read_seg;
+        segment* next = s->m_next.load();
+        size_t head = s->m_head.load();
+        size_t tail = s->m_tail.load();
+        size_t n = std::min(left, tail - head);
+
+        s->m_head.store(head + n);
+        left -= n;
+
+        if (head + n == tail && next != nullptr)
+        {
+            // drained and the writer already moved on
+            m_read_seg = next;
+            segment::release(s);
+        }
+        else if (n == 0)
+        {
+            break;
+        }
+    }
+
+    m_popped.store(m_popped.load() + len - left);
+}
+
+void c_spsc_buffer::clear()
+{
+    advance(available());
+}
+
+buffer::byte_array c_spsc_buffer::peek(size_t len) const
+{
+    return peek((size_t)0, len);
+}
+
+buffer::byte_array c_spsc_buffer::peek(size_t start_pos, size_t len) const
+{
+    size_t avail = available();
+    if (start_pos >= avail) return {};
+
+    byte_array r(std::min(len, avail - start_pos));
+    r.resize(peek(start_pos, r.data(), r.size()));
+
+    return r;
+}
+
+size_t c_spsc_buffer::peek(uint8_t* buf, size_t len) const
+{
+    return peek((size_t)0, buf, len);
+}
+
+size_t c_spsc_buffer::peek(size_t start_pos, uint8_t* buf, size_t len) const
+{
+    if (buf == nullptr || len == 0) return 0;
+
+    return for_each_span(start_pos, len,
+        [&](const uint8_t* data, size_t n) { std::memcpy(buf, data, n); buf += n; });
+}
+
+buffer_view c_spsc_buffer::view(size_t len) const
+{
+    return view((size_t)0, len);
+}
+
+buffer_view c_spsc_buffer::view(size_t start_pos, size_t len) const
+{
+    std::vector<buffer_view::span> spans;
+
+    for_each_span(start_pos, len,
+        [&](const uint8_t* data, size_t n) { spans.push_back({data, n}); });
+
+    return buffer_view(std::move(spans));
+}
+
+shared_view c_spsc_buffer::share(size_t start_pos, size_t len) const
+{
+    size_t avail = available();
+    if (start_pos >= avail) return {};
+
+    len = std::min(len, avail - start_pos);
+    if (len < min_shared_size) return shared_view(view(start_pos, len));
+
+    for (segment* s = m_read_seg; s != nullptr; )
+    {
+        segment* next = s->m_next.load();
+        size_t head = s->m_head.load();
+        size_t tail = s->m_tail.load();
+
+        if (start_pos >= tail - head)
+        {
+            start_pos -= tail - head;
+            s = next;
+            continue;
+        }
+
+        // ranges spanning segments or wrapping around the end of one are copied
+        size_t pos = (head + start_pos) & (s->m_capacity - 1);
+        if (tail - head - start_pos < len || s->m_capacity - pos < len) break;
+
+        segment_owner* owner = s->m_owner.load();
+        if (owner == nullptr)
+        {
+            owner = new segment_owner(s);
+            s->m_owner.store(owner);
+        }
+
+        return shared_view(owner, s->data() + pos, len);
+    }
+
+    return shared_view(view(start_pos, len));
+}
+
+void c_spsc_buffer::push(uint8_t byte)
+{
+    write(&byte, 1);
+}
+
+void c_spsc_buffer::push(const uint8_t* buf, size_t len)
+{
+    if (buf == nullptr || len == 0) return;
+
+    write(buf, len);
+}
+
+void c_spsc_buffer::push(const byte_array& buf)
+{
+    write(buf.data(), buf.size());
+}
+
+void c_spsc_buffer::push(const buffer* buf)
+{
+    if (buf == nullptr) return;
+
+    grab_guard bufgrab(buf);
+    buffer_view vw = buf->view(buf->available());
+
+    for (size_t i = 0, spans = vw.span_count(); i < spans; ++i)
+        write(vw.get_span(i).data, vw.get_span(i).size);
+}
+
+void c_spsc_buffer::merge(buffer* buf)
+{
+    if (buf == nullptr) return;
+
+    grab_guard bufgrab(buf);
+    buffer_view vw = buf->view(buf->available());
+
+    for (size_t i = 0, spans = vw.span_count(); i < spans; ++i)
+        write(vw.get_span(i).data, vw.get_span(i).size);
+
+    buf->advance(vw.size());
+}
+
+optional<uint8_t> c_spsc_buffer::pop()
+{
+    uint8_t byte;
+    if (peek((size_t)0, &byte, 1) == 0) return {};
+
+    advance(1);
+    return byte;
+}
+
+buffer::byte_array c_spsc_buffer::pop(size_t len)
+{
+    byte_array r = peek((size_t)0, len);
+    advance(r.size());
+
+    return r;
+}
+
+size_t c_spsc_buffer::pop(uint8_t* buf, size_t len)
+{
+    len = peek((size_t)0, buf, len);
+    advance(len);
+
+    return len;
+}
+
+size_t c_spsc_buffer::find(uint8_t byte, size_t start_pos) const
+{
+    size_t pos = start_pos;
+    size_t found = npos;
+
+    for_each_span(start_pos, available(),
+        [&](const uint8_t* data, size_t n)
+        {
+            if (found != npos) return;
+
+            const uint8_t* p = find_byte(data, data + n, byte);
+            if (p != data + n) found = pos + (p - data);
+            else pos += n;
+        });
+
+    return found;
+}
+
+size_t c_spsc_buffer::find(const uint8_t* pattern, size_t len, size_t start_pos) const
+{
+    size_t pos = view(start_pos, available()).find(pattern, len);
+    return (pos != npos) ? (start_pos + pos) : npos;
+}
+
+buffer::byte_array c_spsc_buffer::pop_until(uint8_t delim)
+{
+    size_t pos = find(delim);
+    if (pos == npos) return {};
+
+    return pop(pos + 1);
+}
+
+uint8_t* c_spsc_buffer::prepare(size_t len)
+{
+    segment* s = m_write_seg;
+    size_t tail = s->m_tail.load();
+    size_t pos = tail & (s->m_capacity - 1);
+    size_t space = std::min(s->space(), s->m_capacity - pos);
+
+    // the returned memory has to be contiguous, so the wrapped part doesn't count
+    if (space < len || space == 0)
+    {
+        s = grow(len);
+        pos = 0;
+        space = s->m_capacity;
+    }
+
+    m_prepared = space;
+    return s->data() + pos;
+}
+
+void c_spsc_buffer::commit(size_t len)
+{
+    segment* s = m_write_seg;
+
+    len = std::min(len, m_prepared);
+    s->m_tail.store(s->m_tail.load() + len);
+    m_pushed.store(m_pushed.load() + len);
+    m_prepared = 0;
+    track_size();
+}
+
+buffer_view::span c_spsc_buffer::data() const
+{
+    size_t avail = available();
+
+    for (segment* s = m_read_seg; s != nullptr && avail > 0; )
+    {
+        segment* next = s->m_next.load();
+        size_t head = s->m_head.load();
+        size_t tail = s->m_tail.load();
+
+        if (head != tail)
+        {
+            size_t pos = head & (s->m_capacity - 1);
+            size_t n = std::min(std::min(tail - head, s->m_capacity - pos), avail);
+            return {s->data() + pos, n};
+        }
+
+        s = next;
+    }
+
+    return {nullptr, 0};
+}
+
+size_t c_spsc_buffer::gather(buffer_view::span* spans, size_t max_spans, size_t len) const
+{
+    if (spans == nullptr) return 0;
+
+    size_t cnt = 0;
+
+    for_each_span(0, len,
+        [&](const uint8_t* data, size_t n) { if (cnt < max_spans) spans[cnt++] = {data, n}; });
+
+    return cnt;
+}
+
+void c_spsc_buffer::set_spill_threshold(size_t)
+{
+    // the reader and the writer would have to agree on where the data is
+}
+
+void c_spsc_buffer::enable_tracking(std::string owner)
+{
+    if (m_tracked.load()) c_buffer_registry::get_instance().remove(this);
+
+    m_owner = owner;
+    m_pushed_base = m_pushed.load();
+    m_popped_base = m_popped.load();
+    m_high_water.store(available());
+    m_tracked.store(true);
+
+    c_buffer_registry::get_instance().add(this);
+}
+
+void c_spsc_buffer::disable_tracking()
+{
+    c_buffer_registry::get_instance().remove(this);
+    m_tracked.store(false);
+}
+
+buffer::usage_stats c_spsc_buffer::get_usage_stats() const
+{
+    if (!m_tracked.load()) return {};
+
+    size_t popped = m_popped.load();
+    size_t pushed = m_pushed.load();
+
+    return {m_owner, pushed - m_pushed_base, popped - m_popped_base, pushed - popped, m_high_water.load(), 0};
+}
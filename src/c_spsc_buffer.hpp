@@ -0,0 +1,121 @@
+#ifndef C_SPSC_BUFFER_HPP_INCLUDED
+#define C_SPSC_BUFFER_HPP_INCLUDED
+
+#include <string>
+#include "gg/atomic.hpp"
+#include "gg/buffer.hpp"
+
+namespace gg
+{
+    /*
+     * Buffer without locks for exactly one writer and one reader thread.
+     * Data is stored in ring segments: the writer only moves the tail, the reader
+     * only moves the head of a segment. If the writer runs out of space, it links
+     * a bigger segment after the current one and the reader frees the old one once
+     * it's drained. A segment that was shared (see share) isn't written anymore,
+     * so the writer links a new one after it. Writer operations: push, merge,
+     * prepare, commit.
+     * Every other operation (including clear and the tracking settings) belongs
+     * to the reader.
+     */
+    class c_spsc_buffer : public buffer
+    {
+        class segment_owner;
+
+        struct segment
+        {
+            atomic<segment*> m_next;
+            atomic<size_t> m_head; // only modified by the reader
+            atomic<size_t> m_tail; // only modified by the writer
+            const size_t m_capacity; // power of 2, so the positions can wrap around
+            atomic<segment_owner*> m_owner; // only set by the reader once the segment is shared
+
+            segment(size_t capacity);
+            uint8_t* data() { return reinterpret_cast<uint8_t*>(this + 1); }
+            size_t space() const; // writable bytes (none if the segment is shared)
+
+            static segment* create(size_t capacity);
+            static void destroy(segment*);
+            static void release(segment*); // destroys the segment once it's not shared anymore
+        };
+
+        // shared_views keep the segment alive with this, while the buffer holds one reference
+        class segment_owner : public reference_counted
+        {
+            segment* m_segment;
+
+        public:
+            segment_owner(segment* s) : m_segment(s) {}
+            ~segment_owner() { segment::destroy(m_segment); }
+        };
+
+        static const size_t initial_size = 4096;
+        static const size_t max_segment_size = 1024 * 1024;
+        static const size_t min_shared_size = 256; // shorter ranges are copied by share()
+
+        segment* m_read_seg;
+        segment* m_write_seg;
+        atomic<size_t> m_pushed; // only modified by the writer
+        atomic<size_t> m_popped; // only modified by the reader
+        size_t m_prepared;
+        atomic<bool> m_tracked;
+        atomic<size_t> m_high_water; // raised by the writer
+        std::string m_owner;
+        size_t m_pushed_base; // counters at the time tracking was enabled
+        size_t m_popped_base;
+
+        segment* grow(size_t min_len);
+        void track_size();
+        void write(const uint8_t* buf, size_t len);
+        template<class F> size_t for_each_span(size_t start_pos, size_t len, F func) const;
+
+    public:
+        c_spsc_buffer();
+        c_spsc_buffer(const c_spsc_buffer&) = delete;
+        c_spsc_buffer(c_spsc_buffer&&) = delete;
+        ~c_spsc_buffer();
+
+        static void* operator new(size_t size);
+        static void operator delete(void* ptr, size_t size);
+
+        size_t available() const;
+        void advance(size_t len);
+        void clear();
+
+        byte_array peek(size_t len) const;
+        byte_array peek(size_t start_pos, size_t len) const;
+        size_t peek(uint8_t* buf, size_t len) const;
+        size_t peek(size_t start_pos, uint8_t* buf, size_t len) const;
+
+        buffer_view view(size_t len) const;
+        buffer_view view(size_t start_pos, size_t len) const;
+        shared_view share(size_t start_pos, size_t len) const;
+
+        void push(uint8_t byte);
+        void push(const uint8_t* buf, size_t len);
+        void push(const byte_array& buf);
+        void push(const buffer* buf);
+        void merge(buffer* buf);
+
+        optional<uint8_t> pop();
+        byte_array pop(size_t len);
+        size_t pop(uint8_t* buf, size_t len);
+
+        size_t find(uint8_t byte, size_t start_pos = 0) const;
+        size_t find(const uint8_t* pattern, size_t len, size_t start_pos = 0) const;
+        byte_array pop_until(uint8_t delim);
+
+        uint8_t* prepare(size_t len);
+        void commit(size_t len);
+        buffer_view::span data() const;
+        size_t gather(buffer_view::span* spans, size_t max_spans, size_t len) const;
+
+        void set_spill_threshold(size_t threshold);
+
+        void enable_tracking(std::string owner);
+        void disable_tracking();
+        usage_stats get_usage_stats() const;
+    };
+};
+
+#endif // C_SPSC_BUFFER_HPP_INCLUDED
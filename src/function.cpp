@@ -34,7 +34,7 @@ dynamic_function& dynamic_function::operator= (dynamic_function&& func)
 
 var dynamic_function::operator() (varlist vl) const
 {
-    return m_func(vl);
+    return m_func(std::move(vl));
 }
 
 dynamic_function::operator bool() const
@@ -1,5 +1,10 @@
 #include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include "gg/var.hpp"
+#include "gg/buffer.hpp"
 
 using namespace gg;
 
@@ -18,40 +23,105 @@ var::view::~view()
 {
 }
 
+const size_t var::inline_size;
+
+static const std::type_info& empty_type()
+{
+    return typeid(void);
+}
+
+static size_t empty_hash()
+{
+    static const size_t h = typeid(void).hash_code();
+    return h;
+}
+
+const type_descriptor var::empty_descriptor = {
+    &var::empty_descriptor, &empty_type, &empty_hash, type_descriptor::stored_inline,
+    nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr };
+
+static const size_t max_number_length = 64;
+
+
 var::var()
 {
 }
 
 var::var(const var& v)
 {
-    if (v.m_var != nullptr)
-        m_var = v.m_var->clone();
+    if (v.m_desc != nullptr)
+    {
+        v.m_desc->copy(&m_storage, &v.m_storage);
+        m_desc = v.m_desc;
+    }
 }
 
 var::var(var&& v)
 {
-    std::swap(m_var, v.m_var);
+    if (v.m_desc != nullptr)
+    {
+        v.m_desc->move(&m_storage, &v.m_storage);
+        m_desc = v.m_desc;
+        v.m_desc = nullptr;
+    }
 }
 
 var::~var()
 {
-    if (m_var != nullptr)
-        delete m_var;
+    destroy();
 }
 
 var& var::operator= (const var& v)
 {
-    if (m_var != nullptr) { delete m_var; m_var = nullptr; }
-    if (v.m_var != nullptr) m_var = v.m_var->clone();
+    if (this == &v) return *this;
+
+    destroy();
+    if (v.m_desc != nullptr)
+    {
+        v.m_desc->copy(&m_storage, &v.m_storage);
+        m_desc = v.m_desc;
+    }
     return *this;
 }
 
 var& var::operator= (var&& v)
 {
-    std::swap(m_var, v.m_var);
+    if (this == &v) return *this;
+
+    destroy();
+    if (v.m_desc != nullptr)
+    {
+        v.m_desc->move(&m_storage, &v.m_storage);
+        m_desc = v.m_desc;
+        v.m_desc = nullptr;
+    }
     return *this;
 }
 
+void* var::get_value_ptr() const
+{
+    void* p = const_cast<storage*>(&m_storage);
+    if (m_desc->kind == type_descriptor::stored_inline) return p;
+    else return *static_cast<void**>(p);
+}
+
+void var::detach()
+{
+    // the var is left empty if the copy fails
+    const type_descriptor* desc = m_desc;
+    m_desc = nullptr;
+    desc->detach(&m_storage);
+    m_desc = desc->value;
+}
+
+void var::destroy()
+{
+    if (m_desc == nullptr) return;
+
+    m_desc->destroy(&m_storage);
+    m_desc = nullptr;
+}
+
 var::view var::to_stream() const
 {
     return view(*this);
@@ -66,30 +136,235 @@ std::string var::to_string() const
 
 const std::type_info& var::get_type() const
 {
-    if (m_var != nullptr)
-        return m_var->get_type();
+    if (m_desc != nullptr)
+        return m_desc->type();
     else
         return typeid(void);
 }
 
+const type_descriptor& var::get_descriptor() const
+{
+    if (m_desc != nullptr)
+        return *m_desc->value;
+    else
+        return empty_descriptor;
+}
+
 bool var::is_empty() const
 {
-    return (m_var == nullptr);
+    return (m_desc == nullptr);
 }
 
 void var::clear()
 {
-    if (m_var != nullptr)
+    destroy();
+}
+
+var& var::share()
+{
+    if (m_desc != nullptr && m_desc->share != nullptr)
+        m_desc = m_desc->share(&m_storage);
+
+    return *this;
+}
+
+bool var::is_shared() const
+{
+    return (m_desc != nullptr && m_desc->kind == type_descriptor::stored_shared);
+}
+
+bool var::materialize(const type_descriptor& type)
+{
+    // only owned views, a referenced one has to stay a reference
+    if (m_desc != &descriptors<shared_view>::value && m_desc != &descriptors<shared_view>::shared) return false;
+
+    const shared_view& vw = *static_cast<const shared_view*>(get_value_ptr());
+
+    if (type.is_same(descriptors<std::string>::value))
     {
-        delete m_var;
-        m_var = nullptr;
+        std::string str = vw.to_string();
+        destroy();
+        create<std::string>(std::move(str));
     }
+    else if (type.is_same(descriptors<std::vector<uint8_t>>::value))
+    {
+        std::vector<uint8_t> bytes = vw.to_byte_array();
+        destroy();
+        create<std::vector<uint8_t>>(std::move(bytes));
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+bool var::copy_view(std::string& str) const
+{
+    if (!is<shared_view>()) return false;
+
+    str = static_cast<const shared_view*>(get_value_ptr())->to_string();
+    return true;
+}
+
+bool var::copy_view(std::vector<uint8_t>& bytes) const
+{
+    if (!is<shared_view>()) return false;
+
+    bytes = static_cast<const shared_view*>(get_value_ptr())->to_byte_array();
+    return true;
+}
+
+bool var::get_text(const char*& data, size_t& len) const
+{
+    if (m_desc->value == &descriptors<std::string>::value)
+    {
+        const std::string& str = *static_cast<const std::string*>(get_value_ptr());
+        data = str.data();
+        len = str.size();
+        return true;
+    }
+    else if (m_desc->value == &descriptors<shared_view>::value)
+    {
+        const shared_view& vw = *static_cast<const shared_view*>(get_value_ptr());
+        data = reinterpret_cast<const char*>(vw.data());
+        len = vw.size();
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * Takes the longest prefix that the stream extraction would accept as a number (so
+ * no hex, inf or nan), null terminated for the strto* functions. Longer numbers
+ * are left to the stream.
+ */
+static bool get_number_text(const char* data, size_t len, bool floating, char (&buf)[max_number_length])
+{
+    const char* p = data;
+    const char* end = data + len;
+    size_t n = 0;
+
+    auto accept = [&](bool (*pred)(char)) -> size_t
+    {
+        size_t cnt = 0;
+        for (; p < end && pred(*p) && n < max_number_length; ++cnt) buf[n++] = *p++;
+        return cnt;
+    };
+    auto is_space = [](char c) { return (c == ' ' || (c >= '\t' && c <= '\r')); };
+    auto is_sign = [](char c) { return (c == '+' || c == '-'); };
+    auto is_digit = [](char c) { return (c >= '0' && c <= '9'); };
+
+    while (p < end && is_space(*p)) ++p;
+
+    if (p < end && is_sign(*p)) buf[n++] = *p++;
+    size_t digits = accept(is_digit);
+
+    if (floating)
+    {
+        if (p < end && *p == '.' && n < max_number_length)
+        {
+            buf[n++] = *p++;
+            digits += accept(is_digit);
+        }
+
+        // an exponent without digits makes the whole text invalid, like for the stream
+        if (digits > 0 && p < end && (*p == 'e' || *p == 'E'))
+        {
+            if (n < max_number_length) buf[n++] = *p++;
+            if (p < end && is_sign(*p) && n < max_number_length) buf[n++] = *p++;
+            if (accept(is_digit) == 0) digits = 0;
+        }
+    }
+
+    if (n >= max_number_length) return false;
+
+    if (digits == 0) n = 0; // not a number, which gives 0
+    buf[n] = '\0';
+    return true;
+}
+
+// like the stream extraction, text that isn't a number gives 0 and out of range values are clamped
+bool var::parse_signed(const char* data, size_t len, int64_t& result)
+{
+    char buf[max_number_length];
+    if (!get_number_text(data, len, false, buf)) return false;
+
+    result = std::strtoll(buf, nullptr, 10);
+    return true;
+}
+
+bool var::parse_unsigned(const char* data, size_t len, uint64_t& magnitude, bool& negative)
+{
+    char buf[max_number_length];
+    if (!get_number_text(data, len, false, buf)) return false;
+
+    negative = (buf[0] == '-');
+    errno = 0;
+    magnitude = std::strtoull(buf + negative, nullptr, 10);
+    if (errno == ERANGE)
+    {
+        magnitude = std::numeric_limits<uint64_t>::max();
+        negative = false;
+    }
+    return true;
+}
+
+bool var::parse_floating(const char* data, size_t len, long double& result)
+{
+    char buf[max_number_length];
+    if (!get_number_text(data, len, true, buf)) return false;
+
+    result = std::strtold(buf, nullptr);
+    return true;
+}
+
+// formats numbers the same way as an ostream with the default flags
+bool var::convert(std::string& str) const
+{
+    type_descriptor::number n;
+    if (!m_desc->to_number(get_value_ptr(), n)) return false;
+
+    char buf[max_number_length];
+    char* end = buf + max_number_length;
+    char* p = end;
+
+    switch (n.kind)
+    {
+        case type_descriptor::number::character:
+            str.assign(1, static_cast<char>(n.i));
+            return true;
+
+        case type_descriptor::number::floating:
+            str.assign(buf, std::snprintf(buf, max_number_length, "%g", static_cast<double>(n.f)));
+            return true;
+
+        case type_descriptor::number::signed_int:
+        {
+            uint64_t u = (n.i < 0) ? (0 - static_cast<uint64_t>(n.i)) : static_cast<uint64_t>(n.i);
+            do { *--p = '0' + (u % 10); u /= 10; } while (u > 0);
+            if (n.i < 0) *--p = '-';
+            break;
+        }
+
+        case type_descriptor::number::unsigned_int:
+        {
+            uint64_t u = n.u;
+            do { *--p = '0' + (u % 10); u /= 10; } while (u > 0);
+            break;
+        }
+    }
+
+    str.assign(p, end - p);
+    return true;
 }
 
 std::ostream& gg::operator<< (std::ostream& o, const gg::var::view& vw)
 {
-    if (vw.m_var.m_var == nullptr) o << "(empty)";
-    else vw.m_var.m_var->extract_to(o);
+    if (vw.m_var.m_desc == nullptr) o << "(empty)";
+    else vw.m_var.m_desc->extract(o, vw.m_var.get_value_ptr());
     return o;
 }
 
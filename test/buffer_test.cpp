@@ -0,0 +1,302 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+#include "tinythread.h"
+#include "c_buffer.hpp"
+#include "gg/buffer.hpp"
+#include "test.hpp"
+
+using namespace gg;
+
+// c_buffer stores the bytes in chunks of this size
+static const size_t chunk = 4096;
+
+// the period is a prime, so chunk boundaries don't line up with it
+static std::vector<uint8_t> make_bytes(size_t len, size_t first = 0)
+{
+    std::vector<uint8_t> bytes(len);
+    for (size_t i = 0; i < len; ++i) bytes[i] = static_cast<uint8_t>((first + i) % 251);
+    return bytes;
+}
+
+static void push_in_pieces(buffer* buf, const std::vector<uint8_t>& bytes, size_t piece)
+{
+    for (size_t pos = 0; pos < bytes.size(); pos += piece)
+        buf->push(bytes.data() + pos, std::min(piece, bytes.size() - pos));
+}
+
+// every read sees the same bytes whether or not it crosses a chunk boundary
+static void test_chunk_boundaries(buffer* buf)
+{
+    std::vector<uint8_t> bytes = make_bytes(3 * chunk + 123);
+    push_in_pieces(buf, bytes, 1000);
+    CHECK(buf->available() == bytes.size());
+
+    for (size_t boundary = chunk; boundary < bytes.size(); boundary += chunk)
+    {
+        for (size_t start = boundary - 3; start <= boundary; ++start)
+        {
+            std::vector<uint8_t> part(bytes.begin() + start, bytes.begin() + start + 6);
+            CHECK(buf->peek(start, 6) == part);
+
+            size_t expected = std::find(bytes.begin() + start, bytes.end(), bytes[boundary]) - bytes.begin();
+            CHECK(buf->find(bytes[boundary], start) == expected);
+
+            expected = std::search(bytes.begin(), bytes.end(), part.begin(), part.end()) - bytes.begin();
+            CHECK(buf->find(part.data(), part.size()) == expected);
+
+            expected = std::search(bytes.begin() + start + 1, bytes.end(), part.begin(), part.end()) - bytes.begin();
+            CHECK(buf->find(part.data(), part.size(), start + 1) == (expected < bytes.size() ? expected : buffer::npos));
+        }
+    }
+
+    const uint8_t missing[] = { 250, 0, 0 };
+    CHECK(buf->find(missing, sizeof(missing)) == buffer::npos);
+    CHECK(buf->find(bytes[0], bytes.size()) == buffer::npos);
+
+    std::vector<uint8_t> popped;
+    while (buf->available() > 0)
+    {
+        buffer::byte_array part = buf->pop(777);
+        CHECK(!part.empty());
+        popped.insert(popped.end(), part.begin(), part.end());
+    }
+
+    CHECK(popped == bytes);
+    CHECK(!buf->pop());
+
+    // single bytes across a boundary
+    for (size_t i = 0; i < chunk + 2; ++i) buf->push(bytes[i]);
+    buf->advance(chunk - 1);
+
+    optional<uint8_t> b = buf->pop();
+    CHECK(b && *b == bytes[chunk - 1]);
+    b = buf->pop();
+    CHECK(b && *b == bytes[chunk]);
+    CHECK(buf->available() == 1);
+
+    buf->clear();
+    CHECK(buf->available() == 0);
+}
+
+// truncation undoes the end of a write, including whole chunks
+static void test_truncate()
+{
+    c_buffer buf(false);
+    std::vector<uint8_t> bytes = make_bytes(2 * chunk + 500);
+
+    buf.push(bytes.data(), bytes.size());
+    buf.truncate(chunk + 4);
+    CHECK(buf.available() == chunk + 4);
+    CHECK(buf.peek(chunk, 4) == std::vector<uint8_t>(bytes.begin() + chunk, bytes.begin() + chunk + 4));
+
+    buf.truncate(chunk);
+    CHECK(buf.available() == chunk);
+    buf.push(bytes.data() + chunk, bytes.size() - chunk);
+    CHECK(buf.pop(bytes.size()) == bytes);
+
+    buf.push(bytes.data(), 10);
+    buf.truncate(10);
+    buf.truncate(0);
+    CHECK(buf.available() == 0);
+    buf.push(bytes.data(), 3);
+    CHECK(buf.pop(3) == std::vector<uint8_t>(bytes.begin(), bytes.begin() + 3));
+}
+
+// small sources are copied into the tail, full chunks are handed over
+static void test_merge()
+{
+    buffer* dest = buffer::create();
+    buffer* src = buffer::create();
+    std::vector<uint8_t> bytes = make_bytes(100 * 20 + 2 * chunk + 10);
+    size_t pos = 0;
+
+    for (int i = 0; i < 100; ++i, pos += 20)
+    {
+        src->push(bytes.data() + pos, 20);
+        dest->merge(src);
+        CHECK(src->available() == 0);
+    }
+
+    buffer_view::span spans[4];
+    CHECK(dest->gather(spans, 4, dest->available()) == 1);
+
+    // a chunk that doesn't fit in the tail is spliced without copying
+    src->push(bytes.data() + pos, chunk);
+    const uint8_t* spliced = src->data().data;
+    pos += chunk;
+    src->push(bytes.data() + pos, chunk);
+    pos += chunk;
+
+    dest->merge(src);
+    CHECK(src->available() == 0);
+    CHECK(dest->gather(spans, 4, dest->available()) >= 2 && spans[1].data == spliced);
+
+    // the prepared tail of the source stays there until it's committed
+    src->push(bytes.data() + pos, 10);
+    uint8_t* p = src->prepare(100);
+    dest->merge(src);
+    CHECK(src->available() == 0);
+
+    p[0] = 42;
+    src->commit(1);
+    CHECK(src->available() == 1);
+    optional<uint8_t> b = src->pop();
+    CHECK(b && *b == 42);
+
+    CHECK(dest->available() == bytes.size());
+    CHECK(dest->pop(bytes.size()) == bytes);
+
+    src->drop();
+    dest->drop();
+}
+
+// longer ranges of a single chunk are shared, the rest is copied
+static void test_share()
+{
+    buffer* buf = buffer::create();
+    std::vector<uint8_t> bytes = make_bytes(2 * chunk);
+    buf->push(bytes.data(), bytes.size());
+
+    shared_view inside = buf->share(100, 1000);
+    shared_view across = buf->share(chunk - 500, 1000);
+    shared_view small = buf->share(0, 10);
+
+    CHECK(inside.data() == buf->data().data + 100);
+    CHECK(small.data() != buf->data().data);
+
+    // the views outlive the bytes in the buffer
+    buf->clear();
+    buf->push(make_bytes(2 * chunk, 7));
+
+    CHECK(inside.to_byte_array() == std::vector<uint8_t>(bytes.begin() + 100, bytes.begin() + 1100));
+    CHECK(across.to_byte_array() == std::vector<uint8_t>(bytes.begin() + chunk - 500, bytes.begin() + chunk + 500));
+    CHECK(small.to_byte_array() == std::vector<uint8_t>(bytes.begin(), bytes.begin() + 10));
+
+    buf->drop();
+}
+
+// commit() without prepare() is a no-op, even before the first chunk exists
+static void test_commit()
+{
+    buffer* buf = buffer::create();
+    buf->commit(0);
+    CHECK(buf->available() == 0);
+
+    uint8_t* p = buf->prepare(chunk * 2);
+    p[chunk * 2 - 1] = 9;
+    buf->commit(chunk * 2);
+    buf->commit(0);
+    CHECK(buf->available() == chunk * 2);
+    CHECK(buf->peek(chunk * 2 - 1, 1) == buffer::byte_array(1, 9));
+
+    buf->drop();
+}
+
+// a shared range pins its segment, and the writer continues in a new one
+static void test_spsc_share()
+{
+    buffer* buf = buffer::create(buffer::mode::LOCK_FREE_SPSC);
+    std::vector<uint8_t> bytes = make_bytes(3000);
+    buf->push(bytes.data(), 1000);
+
+    shared_view pinned = buf->share(100, 800);
+    CHECK(pinned.data() == buf->data().data + 100);
+
+    buf->push(bytes.data() + 1000, 2000);
+    CHECK(buf->pop(bytes.size()) == bytes);
+
+    buf->push(make_bytes(5000, 3));
+    CHECK(pinned.to_byte_array() == std::vector<uint8_t>(bytes.begin() + 100, bytes.begin() + 900));
+    CHECK(buf->share(0, 10).data() != buf->data().data);
+
+    buf->drop();
+}
+
+struct spsc_stream
+{
+    buffer* buf;
+    size_t total;
+};
+
+// pushes the bytes in pieces of changing size, some of them through prepare() and commit()
+static void spsc_writer(void* arg)
+{
+    spsc_stream* s = static_cast<spsc_stream*>(arg);
+    std::vector<uint8_t> bytes = make_bytes(s->total);
+    size_t piece = 1;
+
+    for (size_t pos = 0; pos < s->total; )
+    {
+        size_t len = std::min(piece, s->total - pos);
+
+        if (piece % 3 == 0)
+        {
+            std::memcpy(s->buf->prepare(len), bytes.data() + pos, len);
+            s->buf->commit(len);
+        }
+        else
+        {
+            s->buf->push(bytes.data() + pos, len);
+        }
+
+        pos += len;
+        piece = (piece * 7) % 5003 + 1;
+    }
+}
+
+// the reader checks every byte while the writer is still pushing, and keeps some shared ranges
+static void test_spsc_threads()
+{
+    spsc_stream s { buffer::create(buffer::mode::LOCK_FREE_SPSC), 4 * 1024 * 1024 };
+    std::vector<std::pair<size_t, shared_view>> views;
+    size_t popped = 0;
+    bool same = true;
+
+    tthread::thread writer(spsc_writer, &s);
+
+    while (popped < s.total)
+    {
+        size_t len = std::min<size_t>(s.buf->available(), 3001);
+        if (len == 0)
+        {
+            tthread::this_thread::yield();
+            continue;
+        }
+
+        if (len >= 300 && views.size() < 64 && (popped / len) % 5 == 0)
+            views.push_back(std::make_pair(popped, s.buf->share(0, len)));
+
+        same = same && (s.buf->pop(len) == make_bytes(len, popped));
+        popped += len;
+    }
+
+    writer.join();
+    CHECK(same);
+    CHECK(s.buf->available() == 0);
+    CHECK(!views.empty());
+
+    for (auto& v : views)
+        CHECK(v.second.to_byte_array() == make_bytes(v.second.size(), v.first));
+
+    s.buf->drop();
+}
+
+void buffer_test()
+{
+    for (buffer::mode m : { buffer::mode::SYNCHRONIZED, buffer::mode::UNSYNCHRONIZED, buffer::mode::LOCK_FREE_SPSC })
+    {
+        buffer* buf = buffer::create(m);
+        test_chunk_boundaries(buf);
+        buf->drop();
+    }
+
+    test_truncate();
+    test_merge();
+    test_share();
+    test_commit();
+    test_spsc_share();
+    test_spsc_threads();
+}
@@ -0,0 +1,341 @@
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "c_serializer.hpp"
+#include "gg/buffer.hpp"
+#include "gg/serializer.hpp"
+#include "test.hpp"
+
+using namespace gg;
+
+// a message of mixed types, with a name repeated in v2 (see write_name)
+static var sample(int32_t id)
+{
+    return varlist { id, std::string("sample"), std::vector<double> { 0.5, 1.5 }, varlist { id, id } };
+}
+
+static bool is_sample(const var& v, int32_t id)
+{
+    if (!v.is<varlist>()) return false;
+
+    const varlist& vl = v.get<varlist>();
+    return (vl.size() == 4 && vl[0].is<int32_t>() && vl[0].get<int32_t>() == id &&
+        vl[1].is<std::string>() && vl[1].get<std::string>() == "sample");
+}
+
+static bool is_sample(const optional<var>& v, int32_t id)
+{
+    return (v && is_sample(*v, id));
+}
+
+// the frame header is the length of the message, its highest bit marks the checksum
+static void test_frame_layout(const serializer& out, const serializer& in)
+{
+    buffer* buf = buffer::create();
+    buffer* msg = buffer::create();
+
+    CHECK(out.serialize(sample(1), msg));
+    CHECK(out.serialize_frame(sample(1), buf, false));
+    CHECK(get_frame_size(buf) == 4 + msg->available());
+    CHECK(buf->available() == 4 + msg->available());
+
+    uint8_t header[4];
+    buf->peek(header, 4);
+    CHECK(header[0] == (msg->available() & 0xFF) && header[3] == 0);
+    CHECK(is_sample(in.deserialize_frame(buf), 1));
+    CHECK(buf->available() == 0);
+
+    CHECK(out.serialize_frame(sample(2), buf, true));
+    CHECK(get_frame_size(buf) == 8 + msg->available());
+    buf->peek(header, 4);
+    CHECK((header[3] & 0x80) != 0);
+    CHECK(is_sample(in.deserialize_frame(buf), 2));
+    CHECK(buf->available() == 0);
+
+    msg->drop();
+    buf->drop();
+}
+
+// an incomplete frame isn't touched, so it can be read once the rest arrives
+static void test_incomplete_frame(const serializer& out, const serializer& in)
+{
+    buffer* buf = buffer::create();
+    CHECK(out.serialize_frame(sample(3), buf, true));
+    buffer::byte_array frame = buf->pop(buf->available());
+
+    for (size_t len = 0; len < frame.size(); ++len)
+    {
+        buf->clear();
+        buf->push(frame.data(), len);
+        CHECK(get_frame_size(buf) == 0);
+        CHECK(!in.deserialize_frame(buf));
+        CHECK(buf->available() == len);
+    }
+
+    buf->push(&frame[frame.size() - 1], 1);
+    CHECK(get_frame_size(buf) == frame.size());
+    CHECK(is_sample(in.deserialize_frame(buf), 3));
+    CHECK(buf->available() == 0);
+
+    buf->drop();
+}
+
+// a complete but broken frame is consumed, and in v1 the next frame is still fine
+static void test_broken_frame(const serializer& out, const serializer& in)
+{
+    buffer* buf = buffer::create();
+    CHECK(out.serialize_frame(sample(4), buf, true));
+    buffer::byte_array frame = buf->pop(buf->available());
+    frame.back() ^= 0x01;
+
+    buf->push(frame);
+    CHECK(out.serialize_frame(sample(5), buf, true));
+    CHECK(!in.deserialize_frame(buf));
+    CHECK(is_sample(in.deserialize_frame(buf), 5));
+    CHECK(buf->available() == 0);
+
+    // without a checksum a message that doesn't fill its frame is rejected
+    CHECK(out.serialize_frame(sample(6), buf, false));
+    frame = buf->pop(buf->available());
+    frame[0] += 1;
+    frame.push_back(0);
+
+    buf->push(frame);
+    CHECK(!in.deserialize_frame(buf));
+    CHECK(buf->available() == 0);
+
+    buf->drop();
+}
+
+// the samples and a long string that is decoded as it arrives
+static buffer::byte_array encode_stream(const serializer& out, bool framed)
+{
+    buffer* buf = buffer::create();
+    var text = std::string(2000, 't');
+
+    for (int32_t id = 0; id < 3; ++id)
+    {
+        bool ok = framed ? out.serialize_frame(sample(id), buf, (id % 2) == 0) : out.serialize(sample(id), buf);
+        CHECK(ok);
+    }
+
+    bool ok = framed ? out.serialize_frame(text, buf, true) : out.serialize(text, buf);
+    CHECK(ok);
+
+    buffer::byte_array stream = buf->pop(buf->available());
+    buf->drop();
+    return stream;
+}
+
+static bool is_stream(const varlist& values)
+{
+    if (values.size() != 4) return false;
+
+    for (int32_t id = 0; id < 3; ++id)
+    {
+        if (!is_sample(values[id], id)) return false;
+    }
+
+    return (values[3].is<std::string>() && values[3].get<std::string>() == std::string(2000, 't'));
+}
+
+// feeds everything that arrived, and collects the finished values
+static incremental_deserializer::status drain(incremental_deserializer* d, buffer* buf, varlist& values)
+{
+    for (;;)
+    {
+        incremental_deserializer::status st = d->feed(buf);
+        if (st != incremental_deserializer::finished) return st;
+
+        optional<var> v = d->get_result();
+        if (v) values.push_back(std::move(*v));
+    }
+}
+
+// the stream is pushed in parts ending at the given offsets (and the rest at the end)
+static varlist decode_parts(const serializer& in, bool framed, const buffer::byte_array& stream, const std::vector<size_t>& cuts)
+{
+    incremental_deserializer* d = in.create_incremental_deserializer(framed);
+    buffer* buf = buffer::create();
+    varlist values;
+    size_t pos = 0;
+
+    for (size_t cut : cuts)
+    {
+        buf->push(stream.data() + pos, cut - pos);
+        pos = cut;
+        CHECK(drain(d, buf, values) == incremental_deserializer::in_progress);
+    }
+
+    buf->push(stream.data() + pos, stream.size() - pos);
+    CHECK(drain(d, buf, values) == incremental_deserializer::in_progress);
+    CHECK(buf->available() == 0);
+
+    buf->drop();
+    d->drop();
+    return values;
+}
+
+// the same stream arrives one byte at a time, or split in two at every offset
+static void test_split_stream(c_serializer& cs, bool compact, bool framed)
+{
+    c_compact_serializer writer(&cs, cs.get_type_table());
+    const serializer& out = compact ? static_cast<const serializer&>(writer) : cs;
+    buffer::byte_array stream = encode_stream(out, framed);
+
+    std::vector<size_t> cuts;
+    for (size_t i = 1; i < stream.size(); ++i) cuts.push_back(i);
+
+    {
+        c_compact_serializer reader(&cs, cs.get_type_table());
+        const serializer& in = compact ? static_cast<const serializer&>(reader) : cs;
+        CHECK(is_stream(decode_parts(in, framed, stream, cuts)));
+    }
+
+    for (size_t i = 0; i <= stream.size(); ++i)
+    {
+        c_compact_serializer reader(&cs, cs.get_type_table());
+        const serializer& in = compact ? static_cast<const serializer&>(reader) : cs;
+        CHECK(is_stream(decode_parts(in, framed, stream, std::vector<size_t> { i })));
+    }
+}
+
+// a fed buffer is only consumed up to about the byte budget per call
+static void test_byte_budget(const serializer& out, const serializer& in, bool framed)
+{
+    const size_t budget = 64;
+    buffer::byte_array stream = encode_stream(out, framed);
+    incremental_deserializer* d = in.create_incremental_deserializer(framed);
+    buffer* buf = buffer::create();
+    varlist values;
+    size_t calls = 0;
+
+    buf->push(stream);
+
+    while (buf->available() > 0)
+    {
+        size_t before = buf->available();
+        incremental_deserializer::status st = d->feed(buf, budget);
+        size_t used = before - buf->available();
+
+        ++calls;
+        CHECK(st == incremental_deserializer::finished || st == incremental_deserializer::in_progress);
+        CHECK(used > 0 && used <= budget + 16); // the header of a frame or a value isn't split
+        if (used == 0) break;
+        if (st != incremental_deserializer::finished) continue;
+
+        optional<var> v = d->get_result();
+        if (v) values.push_back(std::move(*v));
+    }
+
+    CHECK(calls >= stream.size() / (budget + 16));
+    CHECK(is_stream(values));
+
+    buf->drop();
+    d->drop();
+}
+
+// a checksum mismatch breaks the stream in both formats until reset()
+static void test_checksum_mismatch(const serializer& out, const serializer& in)
+{
+    buffer* buf = buffer::create();
+    CHECK(out.serialize_frame(sample(1), buf, true));
+    buffer::byte_array first = buf->pop(buf->available());
+    CHECK(out.serialize_frame(sample(2), buf, true));
+    buffer::byte_array second = buf->pop(buf->available());
+    CHECK(out.serialize_frame(sample(3), buf, true));
+
+    first.back() ^= 0x01;
+    incremental_deserializer* d = in.create_incremental_deserializer(true);
+    buffer* stream = buffer::create();
+    stream->push(first);
+    stream->push(second);
+
+    CHECK(d->feed(stream) == incremental_deserializer::broken);
+    CHECK(!d->get_result());
+    CHECK(d->feed(stream) == incremental_deserializer::broken);
+    CHECK(stream->available() == second.size());
+
+    d->reset();
+    CHECK(d->feed(stream) == incremental_deserializer::finished);
+    CHECK(is_sample(d->get_result(), 2));
+    CHECK(d->feed(buf) == incremental_deserializer::finished);
+    CHECK(is_sample(d->get_result(), 3));
+
+    stream->drop();
+    buf->drop();
+    d->drop();
+}
+
+// a frame that can't be decoded is skipped in v1, but breaks a v2 stream
+static void test_bad_frame(const serializer& out, const serializer& in, bool compact)
+{
+    const uint8_t garbage[] = { 8, 0, 0, 0, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+    buffer* buf = buffer::create();
+    buf->push(garbage, sizeof(garbage));
+    CHECK(out.serialize_frame(sample(1), buf, false));
+
+    incremental_deserializer* d = in.create_incremental_deserializer(true);
+
+    if (compact)
+    {
+        CHECK(d->feed(buf) == incremental_deserializer::broken);
+        CHECK(d->feed(buf) == incremental_deserializer::broken);
+    }
+    else
+    {
+        CHECK(d->feed(buf) == incremental_deserializer::failed);
+        CHECK(d->feed(buf) == incremental_deserializer::finished);
+        CHECK(is_sample(d->get_result(), 1));
+        CHECK(buf->available() == 0);
+    }
+
+    buf->drop();
+    d->drop();
+}
+
+static void test_incremental()
+{
+    c_serializer cs(nullptr);
+    c_compact_serializer writer(&cs, cs.get_type_table());
+
+    for (bool framed : { false, true })
+    {
+        test_split_stream(cs, false, framed);
+        test_split_stream(cs, true, framed);
+        test_byte_budget(cs, cs, framed);
+
+        c_compact_serializer reader(&cs, cs.get_type_table());
+        test_byte_budget(writer, reader, framed);
+    }
+
+    test_checksum_mismatch(cs, cs);
+    test_bad_frame(cs, cs, false);
+
+    c_compact_serializer reader(&cs, cs.get_type_table());
+    test_checksum_mismatch(writer, reader);
+
+    c_compact_serializer bad_reader(&cs, cs.get_type_table());
+    test_bad_frame(writer, bad_reader, true);
+}
+
+static void test_frames()
+{
+    c_serializer cs(nullptr);
+
+    test_frame_layout(cs, cs);
+    test_incomplete_frame(cs, cs);
+    test_broken_frame(cs, cs);
+
+    c_compact_serializer writer(&cs, cs.get_type_table());
+    c_compact_serializer reader(&cs, cs.get_type_table());
+
+    test_frame_layout(writer, reader);
+    test_incomplete_frame(writer, reader);
+}
+
+void frame_test()
+{
+    test_frames();
+    test_incremental();
+}
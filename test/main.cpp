@@ -0,0 +1,21 @@
+#include <iostream>
+#include "test.hpp"
+
+int failures = 0;
+
+int main()
+{
+    var_test();
+    buffer_test();
+    serializer_test();
+    frame_test();
+
+    if (failures > 0)
+    {
+        std::cout << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+
+    std::cout << "all checks passed" << std::endl;
+    return 0;
+}
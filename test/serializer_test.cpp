@@ -0,0 +1,322 @@
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+#include "c_serializer.hpp"
+#include "gg/buffer.hpp"
+#include "gg/serializer.hpp"
+#include "test.hpp"
+
+using namespace gg;
+
+namespace
+{
+    struct blob
+    {
+        int32_t id;
+        std::vector<uint8_t> data;
+    };
+
+    enum class color : uint8_t { red, green, blue };
+
+    struct flags
+    {
+        bool on;
+        color c;
+    };
+
+    struct label
+    {
+        bool on;
+        std::string text;
+    };
+
+    struct attribute
+    {
+        std::string key;
+        int32_t value;
+    };
+}
+
+template<class T>
+static bool equal_as(var& a, var& b)
+{
+    return a.is<T>() && b.is<T>() && a.get<T>() == b.get<T>();
+}
+
+// same type and value, element by element for varlists
+static bool same(var& a, var& b)
+{
+    if (a.is_empty() || b.is_empty()) return a.is_empty() && b.is_empty();
+
+    if (a.is<varlist>())
+    {
+        if (!b.is<varlist>()) return false;
+
+        varlist& la = a.get<varlist>();
+        varlist& lb = b.get<varlist>();
+        if (la.size() != lb.size()) return false;
+
+        for (size_t i = 0; i < la.size(); ++i)
+        {
+            if (!same(la[i], lb[i])) return false;
+        }
+
+        return true;
+    }
+
+    return equal_as<int8_t>(a, b) || equal_as<uint8_t>(a, b) ||
+        equal_as<int16_t>(a, b) || equal_as<uint16_t>(a, b) ||
+        equal_as<int32_t>(a, b) || equal_as<uint32_t>(a, b) ||
+        equal_as<int64_t>(a, b) || equal_as<uint64_t>(a, b) ||
+        equal_as<float>(a, b) || equal_as<double>(a, b) ||
+        equal_as<std::string>(a, b) ||
+        equal_as<std::vector<int8_t>>(a, b) || equal_as<std::vector<uint8_t>>(a, b) ||
+        equal_as<std::vector<int16_t>>(a, b) || equal_as<std::vector<uint16_t>>(a, b) ||
+        equal_as<std::vector<int32_t>>(a, b) || equal_as<std::vector<uint32_t>>(a, b) ||
+        equal_as<std::vector<int64_t>>(a, b) || equal_as<std::vector<uint64_t>>(a, b) ||
+        equal_as<std::vector<float>>(a, b) || equal_as<std::vector<double>>(a, b);
+}
+
+template<class T>
+static var limits_of()
+{
+    return varlist { std::numeric_limits<T>::min(), std::numeric_limits<T>::max(), T(0), T(1) };
+}
+
+template<class T>
+static var column_of(size_t count)
+{
+    varlist vl;
+    for (size_t i = 0; i < count; ++i) vl.emplace_back(static_cast<T>(i * 37));
+    return std::move(vl);
+}
+
+// a value of every built-in type, varlists long enough to be sent as columns in v2
+static varlist built_in_values()
+{
+    varlist values {
+        var(),
+        limits_of<int8_t>(), limits_of<uint8_t>(),
+        limits_of<int16_t>(), limits_of<uint16_t>(),
+        limits_of<int32_t>(), limits_of<uint32_t>(),
+        limits_of<int64_t>(), limits_of<uint64_t>(),
+        varlist { 1.5f, -0.25f, std::numeric_limits<float>::max() },
+        varlist { 1.5, -1e300, std::numeric_limits<double>::min() },
+        std::string(), std::string("text"), std::string(1000, 's'),
+        varlist(), varlist { int32_t(1), std::string("nested"), varlist { 2.5, var() } },
+        std::vector<int8_t> { -128, 0, 127 }, std::vector<uint8_t> { 0, 255 },
+        std::vector<int16_t> { -32768, 32767 }, std::vector<uint16_t> { 65535 },
+        std::vector<int32_t> { -5, 5 }, std::vector<uint32_t> { 0xFFFFFFFF },
+        std::vector<int64_t> { INT64_MIN, INT64_MAX }, std::vector<uint64_t> { UINT64_MAX },
+        std::vector<float> { 0.5f, -2.0f }, std::vector<double> { 1e-300, 3.0 },
+        std::vector<int32_t>(),
+        column_of<int8_t>(20), column_of<uint8_t>(20),
+        column_of<int16_t>(100), column_of<uint16_t>(100),
+        column_of<int32_t>(100), column_of<uint32_t>(100),
+        column_of<int64_t>(100), column_of<uint64_t>(100),
+        column_of<float>(100), column_of<double>(100)
+    };
+
+    return values;
+}
+
+static bool round_trip(const serializer& out, const serializer& in, var& value)
+{
+    buffer* buf = buffer::create();
+    bool ok = out.serialize(value, buf);
+
+    optional<var> copy = in.deserialize(buf);
+    ok = ok && copy && same(value, *copy) && buf->available() == 0;
+
+    buf->drop();
+    return ok;
+}
+
+// every built-in type comes back with the same type and value in both formats
+static void test_round_trips()
+{
+    c_serializer cs(nullptr);
+    c_compact_serializer writer(&cs, cs.get_type_table());
+    c_compact_serializer reader(&cs, cs.get_type_table());
+    varlist values = built_in_values();
+
+    for (var& v : values)
+    {
+        CHECK(round_trip(cs, cs, v));
+        CHECK(round_trip(writer, reader, v));
+    }
+
+    // all of them in a single message too
+    var all = values;
+    CHECK(round_trip(cs, cs, all));
+    CHECK(round_trip(writer, reader, all));
+
+    // lengths over uint16 only fit in v2
+    var long_text = std::string(70000, 'l');
+    var long_list = column_of<int32_t>(70000);
+    CHECK(round_trip(writer, reader, long_text));
+    CHECK(round_trip(writer, reader, long_list));
+
+    // shared views are sent as strings
+    var view = shared_view(reinterpret_cast<const uint8_t*>("view"), 4);
+    var text = std::string("view");
+    buffer* buf = buffer::create();
+    CHECK(cs.serialize(view, buf) && writer.serialize(view, buf));
+    optional<var> v1_copy = cs.deserialize(buf);
+    optional<var> v2_copy = reader.deserialize(buf);
+    CHECK(v1_copy && same(text, *v1_copy));
+    CHECK(v2_copy && same(text, *v2_copy));
+    buf->drop();
+}
+
+// with string views enabled, typed deserialization still gives strings and byte arrays
+static void test_string_views()
+{
+    c_serializer cs(nullptr);
+    serializer& srl = cs;
+    srl.set_string_views(true);
+    srl.add_struct_rule<blob, GG_FIELD(blob, id), GG_FIELD(blob, data)>();
+
+    buffer* buf = buffer::create();
+    std::string text(1000, 't');
+    std::vector<uint8_t> bytes(1000, 0xAB);
+
+    CHECK(srl.serialize(text, buf));
+    optional<std::string> text_copy = srl.deserialize<std::string>(buf);
+    CHECK(text_copy && *text_copy == text);
+
+    CHECK(srl.serialize(bytes, buf));
+    optional<std::vector<uint8_t>> bytes_copy = srl.deserialize<std::vector<uint8_t>>(buf);
+    CHECK(bytes_copy && *bytes_copy == bytes);
+
+    CHECK(srl.serialize(text, buf));
+    CHECK(!srl.deserialize<int32_t>(buf));
+
+    blob b { 7, bytes };
+    CHECK(srl.serialize(b, buf));
+    optional<blob> b_copy = srl.deserialize<blob>(buf);
+    CHECK(b_copy && b_copy->id == 7 && b_copy->data == bytes);
+    CHECK(buf->available() == 0);
+
+    buf->drop();
+}
+
+// bools and enums are decoded through integers, strings follow the format version
+static void test_struct_fields()
+{
+    c_serializer cs(nullptr);
+    serializer& srl = cs;
+    srl.add_struct_rule<label, GG_FIELD(label, on), GG_FIELD(label, text)>();
+
+    buffer* buf = buffer::create();
+    const uint8_t raw[] = { 2, 2 };
+    typedef struct_serializer<flags, GG_FIELD(flags, on), GG_FIELD(flags, c)> flags_serializer;
+    flags f { false, color::red };
+
+    buf->push(raw, sizeof(raw));
+    CHECK(flags_serializer::deserialize(f, buf));
+    CHECK(f.on == true && f.c == color::blue);
+
+    label big { true, std::string(70000, 'x') };
+    CHECK(!srl.serialize(big, buf));
+    buf->clear();
+
+    c_compact_serializer writer(&cs, cs.get_type_table());
+    c_compact_serializer reader(&cs, cs.get_type_table());
+    serializer& srl_v2 = writer;
+    serializer& srl_v2_reader = reader;
+
+    CHECK(srl_v2.serialize(big, buf));
+    optional<label> big_copy = srl_v2_reader.deserialize<label>(buf);
+    CHECK(big_copy && big_copy->on && big_copy->text == big.text);
+    CHECK(buf->available() == 0);
+
+    buf->drop();
+}
+
+// the key is a name (see write_name), and a negative value fails after it was written
+static void add_attribute_rule(serializer& srl)
+{
+    srl.add_reader_rule(typeid(attribute),
+        [](const var& v, buffer* buf, const serializer* s)
+        {
+            const attribute& a = v.get<attribute>();
+            if (!write_name(buf, a.key, s) || a.value < 0) return false;
+
+            buf->push(reinterpret_cast<const uint8_t*>(&a.value), sizeof(int32_t));
+            return true;
+        },
+        [](buffer_reader& rd, const serializer* s)->optional<var>
+        {
+            attribute a;
+            if (!read_name(rd, a.key, s) || !rd.read(a.value)) return {};
+            return var(a);
+        });
+}
+
+static bool is_attribute(const optional<var>& v, const std::string& key, int32_t value)
+{
+    return (v && v->is<attribute>() && v->get<attribute>().key == key && v->get<attribute>().value == value);
+}
+
+// names interned by a failed message are removed on both ends, so the ids stay in sync
+static void test_name_rollback()
+{
+    c_serializer cs(nullptr);
+    add_attribute_rule(cs);
+
+    c_compact_serializer writer(&cs, cs.get_type_table());
+    c_compact_serializer reader(&cs, cs.get_type_table());
+    buffer* buf = buffer::create();
+
+    // failed serialize: the writer forgets "first", and both names of the varlist
+    CHECK(!writer.serialize(var(attribute { "first", -1 }), buf));
+    CHECK(buf->available() == 0);
+    var pair = varlist { attribute { "a", 1 }, attribute { "b", -1 } };
+    CHECK(!writer.serialize(pair, buf));
+    CHECK(buf->available() == 0);
+    CHECK(!writer.serialize_frame(var(attribute { "frame", -1 }), buf, true));
+    CHECK(buf->available() == 0);
+
+    const char* keys[] = { "b", "first", "frame", "a", "first", "b", "a", "frame" };
+    for (int32_t i = 0; i < 8; ++i) CHECK(writer.serialize(var(attribute { keys[i], i }), buf));
+    for (int32_t i = 0; i < 8; ++i) CHECK(is_attribute(reader.deserialize(buf), keys[i], i));
+    CHECK(buf->available() == 0);
+
+    // retried decode: an incomplete message is decoded again once the rest arrives
+    c_compact_serializer retry_writer(&cs, cs.get_type_table());
+    CHECK(retry_writer.serialize(var(attribute { "retried", 1 }), buf));
+    buffer::byte_array first = buf->pop(buf->available());
+    CHECK(retry_writer.serialize(var(attribute { "next", 2 }), buf));
+    CHECK(retry_writer.serialize(var(attribute { "retried", 3 }), buf));
+    CHECK(retry_writer.serialize(var(attribute { "next", 4 }), buf));
+    buffer::byte_array rest = buf->pop(buf->available());
+
+    for (size_t len = 1; len < first.size(); ++len)
+    {
+        c_compact_serializer retry_reader(&cs, cs.get_type_table());
+
+        buf->push(first.data(), len);
+        CHECK(!retry_reader.deserialize(buf));
+        CHECK(buf->available() == len);
+
+        buf->push(first.data() + len, first.size() - len);
+        buf->push(rest);
+        CHECK(is_attribute(retry_reader.deserialize(buf), "retried", 1));
+        CHECK(is_attribute(retry_reader.deserialize(buf), "next", 2));
+        CHECK(is_attribute(retry_reader.deserialize(buf), "retried", 3));
+        CHECK(is_attribute(retry_reader.deserialize(buf), "next", 4));
+        CHECK(buf->available() == 0);
+    }
+
+    buf->drop();
+}
+
+void serializer_test()
+{
+    test_round_trips();
+    test_string_views();
+    test_struct_fields();
+    test_name_rollback();
+}
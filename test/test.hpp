@@ -0,0 +1,17 @@
+#ifndef TEST_HPP_INCLUDED
+#define TEST_HPP_INCLUDED
+
+#include <iostream>
+
+// number of failed checks, reported by main()
+extern int failures;
+
+#define CHECK(expr) \
+    if (!(expr)) { std::cout << __FILE__ << ":" << __LINE__ << ": check failed: " #expr << std::endl; ++failures; }
+
+void var_test();
+void buffer_test();
+void serializer_test();
+void frame_test();
+
+#endif // TEST_HPP_INCLUDED
@@ -0,0 +1,80 @@
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include "gg/buffer.hpp"
+#include "gg/var.hpp"
+#include "test.hpp"
+
+template<class T>
+static T max_of() { return std::numeric_limits<T>::max(); }
+
+template<class T>
+static T min_of() { return std::numeric_limits<T>::min(); }
+
+// arithmetic conversions are clamped to the range of the target
+static void test_cast_clamping()
+{
+    CHECK(gg::var(1e20).cast<int>() == max_of<int>());
+    CHECK(gg::var(-1e20).cast<int>() == min_of<int>());
+    CHECK(gg::var(-1.0).cast<unsigned>() == 0);
+    CHECK(gg::var(-0.5).cast<unsigned>() == 0);
+    CHECK(gg::var(std::nan("")).cast<int>() == 0);
+    CHECK(gg::var(std::nan("")).cast<uint64_t>() == 0);
+    CHECK(gg::var(std::nan("")).cast<bool>() == false);
+    CHECK(gg::var(HUGE_VAL).cast<int64_t>() == max_of<int64_t>());
+    CHECK(gg::var(-HUGE_VAL).cast<int64_t>() == min_of<int64_t>());
+    CHECK(gg::var(1e19).cast<uint64_t>() == 10000000000000000000ULL);
+    CHECK(gg::var(2e19).cast<uint64_t>() == max_of<uint64_t>());
+    CHECK(gg::var(-9223372036854775808.0).cast<int64_t>() == min_of<int64_t>());
+    CHECK(gg::var(9223372036854775808.0).cast<int64_t>() == max_of<int64_t>());
+    CHECK(gg::var(1e300).cast<float>() == max_of<float>());
+    CHECK(gg::var(-1e300).cast<float>() == -max_of<float>());
+    CHECK(gg::var(HUGE_VAL).cast<float>() == HUGE_VALF);
+    CHECK(gg::var(HUGE_VAL).cast<long double>() == HUGE_VALL);
+    CHECK(gg::var(-HUGE_VALF).cast<double>() == -HUGE_VAL);
+    CHECK(gg::var(-HUGE_VALL).cast<float>() == -HUGE_VALF);
+    CHECK(std::isnan(gg::var(std::nan("")).cast<float>()));
+    CHECK(std::isnan(gg::var(std::nanf("")).cast<long double>()));
+    CHECK(gg::var(3.9).cast<int>() == 3);
+    CHECK(gg::var(-3.9).cast<int>() == -3);
+    CHECK(gg::var(65).cast<char>() == 'A');
+    CHECK(gg::var(300).cast<signed char>() == max_of<signed char>());
+    CHECK(gg::var(-1).cast<unsigned>() == 0);
+    CHECK(gg::var(-1).cast<uint64_t>() == 0);
+    CHECK(gg::var(max_of<uint64_t>()).cast<int64_t>() == max_of<int64_t>());
+    CHECK(gg::var(max_of<uint64_t>()).cast<uint16_t>() == max_of<uint16_t>());
+    CHECK(gg::var(min_of<int64_t>()).cast<int32_t>() == min_of<int32_t>());
+    CHECK(gg::var(min_of<int64_t>()).cast<double>() == -9223372036854775808.0);
+    CHECK(gg::var(0.5).cast<bool>() == true);
+
+    // the text path clamps the same way
+    CHECK(gg::var(std::string("99999999999")).cast<int>() == max_of<int>());
+    CHECK(gg::var(std::string("-99999999999")).cast<int>() == min_of<int>());
+    CHECK(gg::var(std::string("1e300")).cast<float>() == max_of<float>());
+}
+
+// only the non-const accessors turn a shared_view into a copy in place
+static void test_view_access()
+{
+    gg::var v = gg::shared_view(reinterpret_cast<const uint8_t*>("text"), 4);
+    const gg::var& cv = v;
+    bool thrown = false;
+
+    CHECK(cv.cast<std::string>() == "text");
+    CHECK(cv.cast<std::vector<uint8_t>>().size() == 4);
+    CHECK(cv.is<gg::shared_view>() && !cv.is<std::string>());
+
+    try { cv.get<std::string>(); } catch (std::runtime_error&) { thrown = true; }
+    CHECK(thrown);
+    CHECK(cv.is<gg::shared_view>());
+
+    CHECK(v.get<std::string>() == "text");
+    CHECK(v.is<std::string>());
+}
+
+void var_test()
+{
+    test_cast_clamping();
+    test_view_access();
+}